@@ -22,7 +22,13 @@
                                                                              
  For a full copy of the GNU General Public License see the LICENSE.txt file. 
 *******************************************************************                                                                             
-  w/ Simple Rotary 1.1.2 Library from mprograms
+  Built on the zyn_controls library of the V5 firmware, header only:
+  copy or link External_USB_Encoders_V5/lib/zyn_controls into the
+  libraries folder of the Arduino IDE. The PlatformIO project
+  (External_USB_Encoders_V5) runs the same firmware with more options,
+  this keymap is its -D LEGACY_BEHAVIOR one.
+  On the STM32 pick USB support: HID in the Tools menu, the library
+  brings the device up itself.
 *******************************************************************
  * Keymappings for reference - Oct 25th 2020
  Back Down    - "down" "Caps Lock"
@@ -55,99 +61,39 @@
  S4           - "v"    "Caps Lock"
  
 ********************************************************/
-#include <SimpleRotary.h>
 #include <Keyboard.h>
-#include "encoder_helpers.h"
 
 /**********************************
  * Include ONE of the following Hardware configurations
  * black_pill_cfg.h
  * mkzero_cfg.h
+ * from the library, or a copy of its hw_template_cfg.h next to this sketch
  */
 //#include "hw_template_cfg.h"
 #include "black_pill_cfg.h"
 //#include "mkzero_cfg.h"
 
-/***********************************************
- * Create the encoder instances and maps
- */
-ENCODER_DEF_PIN_MAP(back,ENC0_GND,ENC0_VCC,ENC0_SW,ENC0_A,ENC0_B);
-ENCODER_CREATE(back, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_CAPS_LOCK, KEY_ESC, KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL );
-
-ENCODER_DEF_PIN_MAP(layer,ENC1_GND,ENC1_VCC,ENC1_SW,ENC1_A,ENC1_B);
-ENCODER_CREATE(layer, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_LEFT_SHIFT, 'l', KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL );
-
-ENCODER_DEF_PIN_MAP(snap,ENC2_GND,ENC2_VCC,ENC2_SW,ENC2_A,ENC2_B);
-ENCODER_CREATE(snap, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_LEFT_CTRL, 's', KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL );
-
-ENCODER_DEF_PIN_MAP(select,ENC3_GND,ENC3_VCC,ENC3_SW,ENC3_A,ENC3_B);
-ENCODER_CREATE(select, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_NONE, KEY_RETURN, KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL );
-/***********************************************/
+#include "controller.h"
 
 /***********************************************
- * Create the button instances and maps
- */
-BUTTON_CREATE(v4b_1,SW0,'z',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL);
-BUTTON_CREATE(v4b_2,SW1,'x',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL);
-BUTTON_CREATE(v4b_3,SW2,'c',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL);
-BUTTON_CREATE(v4b_4,SW3,'v',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL);
-
-/***************************************************
- * setup
+ * Encoder keymaps by hardware slot, switches short/bold/long
  */
-void setup() {
-  // declare led pin to be an output:
-  if( led != PIN_NA) { 
-    pinMode(led, OUTPUT); 
-    digitalWrite(led,0); //Turn on the LED to indicate that we are running code, not bootloader
-  }
-
-  ENCODER_SET_GPIO(back);
-  ENCODER_SET_GPIO(layer);
-  ENCODER_SET_GPIO(snap);
-  ENCODER_SET_GPIO(select);
-  
-  BUTTON_SET_GPIO(v4b_1);
-  BUTTON_SET_GPIO(v4b_2);
-  BUTTON_SET_GPIO(v4b_3);
-  BUTTON_SET_GPIO(v4b_4);
-
-  //Detect config for inverted rotation encoders
-  invert_encoders = default_invert;
-  if( pin_invert != PIN_NA ) {
-    pinMode(pin_invert, INPUT);
-    if( digitalRead(pin_invert) ) {
-      invert_encoders = true;
-    }
-  }
-  if( invert_encoders ) {
-      cw = 2;
-      ccw = 1;
-  }    
-
-  // wait for 2 second before starting keyboard.
-  delay(2000);
-
-// initialize control over the keyboard:
-  Keyboard.begin();
+constexpr EncDef_t enc_all[] = {
+  ENCODER_DEF(ENC0, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_CAPS_LOCK, KEY_NONE, KEY_ESC, KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL ),     //back
+  ENCODER_DEF(ENC1, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_LEFT_SHIFT, KEY_NONE, 'l', KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL ),       //layer
+  ENCODER_DEF(ENC2, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_LEFT_CTRL, KEY_NONE, 's', KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL ),        //snap
+  ENCODER_DEF(ENC3, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_NONE, KEY_NONE, KEY_RETURN, KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL ),      //select
+};
 
-  // wait for .5 second AFTER starting keyboard.
-  delay(500);
-
-  if( led != PIN_NA) { digitalWrite(led,1); } //Turn off the LED once we are booted and servicing Encoders
-}
-
-/***************************************************
- * loop
+/***********************************************
+ * Button keymaps by hardware slot
  */
-void loop() {  
-  ENCODER_PROCESS(back);
-  ENCODER_PROCESS(layer);
-  ENCODER_PROCESS(snap);
-  ENCODER_PROCESS(select);
-  
-  BUTTON_PROCESS(v4b_1);
-  BUTTON_PROCESS(v4b_2);
-  BUTTON_PROCESS(v4b_3);
-  BUTTON_PROCESS(v4b_4);
-}
+constexpr BtnDef_t btn_all[] = {
+  BUTTON_DEF(SW0,'z',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL),
+  BUTTON_DEF(SW1,'x',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL),
+  BUTTON_DEF(SW2,'c',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL),
+  BUTTON_DEF(SW3,'v',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL),
+};
+
+//setup() and loop()
+#include "controller_main.h"
@@ -1,51 +0,0 @@
-/*****************************************************************
- * HW Template Configuration
- * 
- * Use PIN_NA for any pins that are not required for your implementation
- * such as ENC0_VCC or ENC_1_GND
- *  
- * If pin_invert is used, the rotation direction of the encoders is determined
- * by reading the GPIO pin specified. This behavior can be overridden by
- * using PIN_NA and setting default_invert to true/false to achieve the desired
- * behavior.
- * 
- */
-
-//LED Indicator pin 
-#define led PIN_NA
-
-//Active HIGH or LOW encoders
-#define r_polarity HIGH
-
-//Normal rotation, or inverted encoders
-#define pin_invert PIN_NA
-#define default_invert false
-
-#define ENC0_GND  PIN_NA
-#define ENC0_VCC  PIN_NA
-#define ENC0_SW   PIN_NA
-#define ENC0_A    PIN_NA
-#define ENC0_B    PIN_NA
-
-#define ENC1_GND  PIN_NA
-#define ENC1_VCC  PIN_NA
-#define ENC1_SW   PIN_NA
-#define ENC1_A    PIN_NA
-#define ENC1_B    PIN_NA
-
-#define ENC2_GND  PIN_NA
-#define ENC2_VCC  PIN_NA
-#define ENC2_SW   PIN_NA
-#define ENC2_A    PIN_NA
-#define ENC2_B    PIN_NA
-
-#define ENC3_GND  PIN_NA
-#define ENC3_VCC  PIN_NA
-#define ENC3_SW   PIN_NA
-#define ENC3_A    PIN_NA
-#define ENC3_B    PIN_NA
-
-#define SW0        PIN_NA
-#define SW1        PIN_NA
-#define SW2        PIN_NA
-#define SW3        PIN_NA
@@ -0,0 +1,41 @@
+/***************************************************************
+ * SPI library stand-in for the native simulator
+ *
+ * The bus only carries the MCP23S17 port expanders of sim_mcp.cpp.
+ * A transaction frames one chip select: its first byte is the opcode
+ * with the hardware address, the second the register, the rest are
+ * written to or read from the registers from there up.
+ */
+#ifndef SPI_H
+#define SPI_H
+
+#include "Arduino.h"
+
+#define LSBFIRST  0
+#define MSBFIRST  1
+#define SPI_MODE0 0x00
+
+class SPISettings {
+  public:
+    SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) {
+      (void)clock;
+      (void)bitOrder;
+      (void)dataMode;
+    }
+};
+
+class SPIClass {
+  private:
+    uint8_t _n;      //Bytes so far in this transaction
+    uint8_t _opcode;
+    uint8_t _reg;
+  public:
+    void begin(void);
+    void end(void);
+    void beginTransaction(SPISettings settings);
+    void endTransaction(void);
+    uint8_t transfer(uint8_t data);
+};
+extern SPIClass SPI;
+
+#endif
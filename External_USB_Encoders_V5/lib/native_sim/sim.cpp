@@ -0,0 +1,556 @@
+/***************************************************************
+ * Native simulator - HAL and USB endpoint model
+ */
+#include <stdio.h>
+#include "Arduino.h"
+#include "Keyboard.h"
+#include "sim.h"
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct SimEdge_s {
+  uint64_t t_us;
+  uint32_t seq;    //Keeps scripted order for edges at the same time
+  int16_t pin;
+  int8_t level;
+}SimEdge_t;
+
+typedef struct SimBus_s {
+  uint64_t t_us;
+  uint64_t len_us; //Suspended, or reset to configured
+  int type;
+  uint8_t report[SIM_FEATURE_LEN]; //SIM_BUS_FEATURE, report ID first
+  uint8_t len;
+}SimBus_t;
+
+typedef struct SimIsr_s {
+  void (*callback)(void);
+  uint32_t mode;
+}SimIsr_t;
+
+/**************************************************************
+ * Global Variables
+ */
+uint64_t sim_now_us = 0;
+SimStats_t sim_stats;
+uint64_t sim_clock_offset_us = 0;
+uint64_t sim_enum_us = SIM_ENUM_US;
+bool sim_wakeup_enabled = true;
+sim_report_cb_t sim_report_cb = NULL;
+sim_midi_cb_t sim_midi_cb = NULL;
+
+static int8_t sim_level[SIM_NUM_PINS];
+static boolean sim_level_set[SIM_NUM_PINS];
+static SimIsr_t sim_isr[SIM_NUM_PINS];
+
+static SimEdge_t *sim_edges = NULL;
+static uint32_t sim_edge_count = 0;
+static uint32_t sim_edge_size = 0;
+static uint32_t sim_edge_next = 0;
+
+static boolean sim_usb_up = false;
+static uint32_t sim_enums = 0;        //Enumerations started
+static uint64_t sim_config_us = 0;    //The current one is complete
+static boolean sim_suspended = false;
+static uint64_t sim_resume_us = 0;    //Suspended until then
+static SimBus_t sim_bus_events[SIM_MAX_BUS];
+static int sim_bus_count = 0;
+static int sim_bus_next = 0;
+static boolean sim_ep_full = false;
+static uint8_t sim_ep[SIM_REPORT_LEN];
+static uint8_t sim_ep_len = 0;
+static uint8_t sim_host[SIM_REPORT_LEN]; //Last report the host took
+static uint64_t sim_next_poll_us = SIM_POLL_US;
+static void (*sim_timer_cb)(void) = NULL;
+static uint32_t sim_timer_us = 0;
+static uint64_t sim_next_tick_us = 0;
+static uint8_t sim_midi_ep[SIM_MIDI_LEN];
+static uint16_t sim_midi_len = 0; //Bytes waiting in the MIDI endpoint
+
+Keyboard_ Keyboard;
+
+void diag_set_feature(const byte *buf, uint16_t len);
+
+static const char *sim_port_names = "ABC";
+
+/******************************************************************
+ * Pins
+ */
+static boolean sim_pin_ok(uint32_t pin) {
+  return pin < SIM_NUM_PINS;
+}
+
+const char *sim_pin_name(int pin) {
+  static char name[8];
+
+  if( (pin >= SIM_MCP_PIN0) && (pin < SIM_MCP_PIN0 + 16 * SIM_MCP_CHIPS) ) {
+    pin -= SIM_MCP_PIN0;
+    snprintf(name, sizeof(name), "X%d%c%d", pin / 16, "AB"[(pin / 8) & 1], pin % 8);
+  }else if( (pin < 0) || (pin >= SIM_NUM_PINS) ) {
+    return "NA";
+  }else if( pin < D0 ) {
+    snprintf(name, sizeof(name), "P%c%d", sim_port_names[pin / 16], pin % 16);
+  }else if( pin < LED_BUILTIN ) {
+    snprintf(name, sizeof(name), "D%d", pin - D0);
+  }else {
+    snprintf(name, sizeof(name), "LED");
+  }
+  return name;
+}
+
+int sim_pin_number(const char *name) {
+  for( int pin = 0; pin < SIM_NUM_PINS; pin++ ) {
+    if( !strcmp(name, sim_pin_name(pin)) ) {
+      return pin;
+    }
+  }
+  for( int pin = SIM_MCP_PIN0; pin < SIM_MCP_PIN0 + 16 * SIM_MCP_CHIPS; pin++ ) {
+    if( !strcmp(name, sim_pin_name(pin)) ) {
+      return pin;
+    }
+  }
+  return -1;
+}
+
+//Edge interrupt line, modelled on the STM32 EXTI: one line per pin number
+int sim_irq_line(int pin) {
+  if( !sim_pin_ok(pin) ) {
+    return -1;
+  }
+  return ( pin < D0 ) ? (pin % 16) : ((pin - D0) % 16);
+}
+
+//A scripted edge
+void sim_set_pin(int pin, int level) {
+  sim_stats.edges++;
+  if( pin >= SIM_MCP_PIN0 ) {
+    sim_mcp_set_pin(pin - SIM_MCP_PIN0, level);
+  }else {
+    sim_drive_pin(pin, level);
+  }
+}
+
+//Change a level, firing the ISR on its line
+void sim_drive_pin(int pin, int level) {
+  SimIsr_t *isr;
+  int old;
+
+  if( !sim_pin_ok(pin) ) {
+    return;
+  }
+  old = digitalRead(pin);
+  sim_level[pin] = level ? HIGH : LOW;
+  sim_level_set[pin] = true;
+
+  isr = &sim_isr[sim_irq_line(pin)];
+  if( (old == sim_level[pin]) || !isr->callback ) {
+    return;
+  }
+  if( (isr->mode == CHANGE) || ((isr->mode == RISING) && level) || ((isr->mode == FALLING) && !level) ) {
+    isr->callback();
+  }
+}
+
+void pinMode(uint32_t pin, uint32_t mode) {
+  (void)pin;
+  (void)mode;
+}
+
+//Inputs idle high: pull-ups on the switches, encoders resting on their detents
+int digitalRead(uint32_t pin) {
+  if( !sim_pin_ok(pin) ) {
+    return HIGH;
+  }
+  return sim_level_set[pin] ? sim_level[pin] : HIGH;
+}
+
+//Input register of a port, 16 pins each in pin number order
+uint32_t sim_port_read(int port) {
+  uint32_t in = 0;
+
+  for( int i = 0; i < 16; i++ ) {
+    if( digitalRead(port * 16 + i) ) {
+      in |= 1ul << i;
+    }
+  }
+  return in;
+}
+
+void digitalWrite(uint32_t pin, uint32_t val) {
+  if( sim_pin_ok(pin) ) {
+    sim_level[pin] = val ? HIGH : LOW;
+    sim_level_set[pin] = true;
+  }
+}
+
+void attachInterrupt(uint32_t pin, void (*callback)(void), uint32_t mode) {
+  if( sim_pin_ok(pin) ) {
+    sim_isr[sim_irq_line(pin)].callback = callback;
+    sim_isr[sim_irq_line(pin)].mode = mode;
+  }
+}
+
+void detachInterrupt(uint32_t pin) {
+  if( sim_pin_ok(pin) ) {
+    sim_isr[sim_irq_line(pin)].callback = NULL;
+  }
+}
+
+/******************************************************************
+ * Time
+ */
+//32 bit like the boards, sim_clock_offset_us moves their wrap around
+unsigned long millis(void) {
+  return (unsigned long)(uint32_t)((sim_now_us + sim_clock_offset_us) / 1000);
+}
+
+unsigned long micros(void) {
+  return (unsigned long)(uint32_t)(sim_now_us + sim_clock_offset_us);
+}
+
+/******************************************************************
+ * Periodic timer interrupt
+ */
+void sim_timer_begin(uint32_t period_us, void (*callback)(void)) {
+  sim_timer_us = period_us;
+  sim_next_tick_us = sim_now_us + period_us;
+  sim_timer_cb = callback;
+}
+
+void sim_timer_end() {
+  sim_timer_cb = NULL;
+}
+
+void delay(unsigned long ms) {
+  sim_advance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  sim_advance(us);
+}
+
+/******************************************************************
+ * Timeline
+ */
+void sim_schedule(uint64_t t_us, int pin, int level) {
+  SimEdge_t *e;
+
+  if( sim_edge_count == sim_edge_size ) {
+    sim_edge_size = sim_edge_size ? sim_edge_size * 2 : 1024;
+    sim_edges = (SimEdge_t *)realloc(sim_edges, sim_edge_size * sizeof(SimEdge_t));
+  }
+  e = &sim_edges[sim_edge_count];
+  e->t_us = t_us;
+  e->seq = sim_edge_count++;
+  e->pin = pin;
+  e->level = level;
+}
+
+static int sim_edge_cmp(const void *a, const void *b) {
+  const SimEdge_t *ea = (const SimEdge_t *)a;
+  const SimEdge_t *eb = (const SimEdge_t *)b;
+
+  if( ea->t_us != eb->t_us ) {
+    return ea->t_us < eb->t_us ? -1 : 1;
+  }
+  return ea->seq < eb->seq ? -1 : 1;
+}
+
+/******************************************************************
+ * USB host model
+ */
+static void sim_host_poll() {
+  uint8_t downs = 0;
+
+  sim_next_poll_us += SIM_POLL_US;
+  if( !sim_usb_configured() ) {
+    return;
+  }
+  if( (sim_midi_len || sim_ep_full) && !sim_stats.first_poll_us ) {
+    sim_stats.first_poll_us = sim_now_us;
+  }
+  if( sim_midi_len ) {
+    sim_stats.midi_events += sim_midi_len / 4;
+    if( sim_midi_cb ) {
+      sim_midi_cb(sim_now_us, sim_midi_ep, sim_midi_len / 4);
+    }
+    sim_midi_len = 0;
+  }
+  if( !sim_ep_full ) {
+    return;
+  }
+  sim_ep_full = false;
+  sim_stats.polled++;
+  if( sim_ep_len <= SIM_BOOT_LEN ) {
+    for( int i = 2; i < SIM_BOOT_LEN; i++ ) {
+      if( sim_ep[i] && !memchr(&sim_host[2], sim_ep[i], SIM_BOOT_LEN - 2) ) {
+        downs++;
+      }
+    }
+  }else {
+    for( int i = 1; i < sim_ep_len; i++ ) {
+      for( uint8_t bits = sim_ep[i] & ~sim_host[i]; bits; bits &= bits - 1 ) {
+        downs++;
+      }
+    }
+  }
+  sim_stats.key_downs += downs;
+  memcpy(sim_host, sim_ep, SIM_REPORT_LEN);
+  if( sim_report_cb ) {
+    sim_report_cb(sim_now_us, sim_ep, sim_ep_len, downs);
+  }
+}
+
+void sim_usb_begin() {
+  if( !sim_usb_up ) {
+    sim_usb_up = true;
+    sim_enums++;
+    sim_config_us = sim_now_us + sim_enum_us;
+    sim_stats.configured_us = sim_config_us;
+  }
+}
+
+boolean sim_usb_suspended() {
+  return sim_suspended && (sim_now_us < sim_resume_us);
+}
+
+boolean sim_usb_configured() {
+  return sim_usb_up && (sim_now_us >= sim_config_us) && !sim_usb_suspended();
+}
+
+uint32_t sim_usb_configs() {
+  return (sim_usb_up && (sim_now_us < sim_config_us)) ? sim_enums - 1 : sim_enums;
+}
+
+//The host resumes the bus SIM_RESUME_US later, if it allows remote wakeup
+boolean sim_usb_wakeup() {
+  if( !sim_usb_suspended() || !sim_wakeup_enabled ) {
+    return false;
+  }
+  sim_stats.wakeups++;
+  if( sim_now_us + SIM_RESUME_US < sim_resume_us ) {
+    sim_resume_us = sim_now_us + SIM_RESUME_US;
+  }
+  return true;
+}
+
+//Script a suspend for len_us, or a bus reset enumerating for len_us, kept in time order
+static SimBus_t *sim_bus_add(uint64_t t_us, int type, uint64_t len_us) {
+  int i;
+
+  if( sim_bus_count == SIM_MAX_BUS ) {
+    fprintf(stderr, "too many bus events\n");
+    exit(2);
+  }
+  for( i = sim_bus_count; (i > 0) && (sim_bus_events[i - 1].t_us > t_us); i-- ) {
+    sim_bus_events[i] = sim_bus_events[i - 1];
+  }
+  sim_bus_events[i].t_us = t_us;
+  sim_bus_events[i].len_us = len_us;
+  sim_bus_events[i].type = type;
+  sim_bus_count++;
+  return &sim_bus_events[i];
+}
+
+void sim_bus(uint64_t t_us, int type, uint64_t len_us) {
+  sim_bus_add(t_us, type, len_us);
+}
+
+//Script the host setting a feature report
+void sim_feature(uint64_t t_us, const uint8_t *report, uint8_t len) {
+  SimBus_t *bus = sim_bus_add(t_us, SIM_BUS_FEATURE, 0);
+
+  bus->len = (len < SIM_FEATURE_LEN) ? len : SIM_FEATURE_LEN;
+  memcpy(bus->report, report, bus->len);
+}
+
+static void sim_bus_apply(SimBus_t *bus) {
+  if( bus->type == SIM_BUS_FEATURE ) {
+    if( sim_usb_configured() ) {
+      diag_set_feature(bus->report, bus->len);
+    }
+    return;
+  }
+  if( bus->type == SIM_BUS_SUSPEND ) {
+    if( sim_usb_configured() ) {
+      sim_suspended = true;
+      sim_resume_us = sim_now_us + bus->len_us;
+      sim_stats.suspends++;
+    }
+    return;
+  }
+  //The host forgets the device and what it had taken, and enumerates it again
+  sim_stats.resets++;
+  sim_suspended = false;
+  sim_ep_full = false;
+  sim_midi_len = 0;
+  memset(sim_host, 0, SIM_REPORT_LEN);
+  if( sim_usb_up ) {
+    sim_enums++;
+    sim_config_us = sim_now_us + bus->len_us;
+  }
+}
+
+boolean sim_hid_ready() {
+  return sim_usb_configured() && !sim_ep_full;
+}
+
+void sim_hid_report(const uint8_t *rep, uint16_t len) {
+  sim_stats.reports++;
+  if( !sim_usb_configured() ) {
+    sim_stats.drop_offline++;
+    return;
+  }
+  if( sim_ep_full ) {
+    sim_stats.drop_busy++;
+    return;
+  }
+  sim_ep_len = len < SIM_REPORT_LEN ? len : SIM_REPORT_LEN;
+  memset(sim_ep, 0, SIM_REPORT_LEN);
+  memcpy(sim_ep, rep, sim_ep_len);
+  sim_ep_full = true;
+}
+
+boolean sim_midi_ready() {
+  return sim_usb_configured() && !sim_midi_len;
+}
+
+void sim_midi_send(const uint8_t *buf, uint16_t len) {
+  sim_stats.midi_sent++;
+  if( !sim_usb_configured() || sim_midi_len ) {
+    sim_stats.midi_drop_busy++;
+    return;
+  }
+  sim_midi_len = (len < SIM_MIDI_LEN ? len : SIM_MIDI_LEN) & ~3;
+  memcpy(sim_midi_ep, buf, sim_midi_len);
+}
+
+/******************************************************************
+ * Advance virtual time, applying edges, timer ticks, bus events and
+ * host polls on the way, in that order when they fall at the same time
+ */
+void sim_advance(uint64_t us) {
+  uint64_t end = sim_now_us + us;
+  static boolean sorted = false;
+
+  if( !sorted ) {
+    qsort(sim_edges, sim_edge_count, sizeof(SimEdge_t), sim_edge_cmp);
+    sorted = true;
+  }
+  for(;;) {
+    uint64_t t_edge = (sim_edge_next < sim_edge_count) ? sim_edges[sim_edge_next].t_us : UINT64_MAX;
+    uint64_t t_tick = sim_timer_cb ? sim_next_tick_us : UINT64_MAX;
+    uint64_t t_bus = (sim_bus_next < sim_bus_count) ? sim_bus_events[sim_bus_next].t_us : UINT64_MAX;
+    uint64_t t = sim_next_poll_us;
+
+    t = (t_bus < t) ? t_bus : t;
+    t = (t_tick < t) ? t_tick : t;
+    t = (t_edge < t) ? t_edge : t;
+    if( t > end ) {
+      break;
+    }
+    if( t > sim_now_us ) {
+      sim_now_us = t;
+    }
+    if( t == t_edge ) {
+      sim_set_pin(sim_edges[sim_edge_next].pin, sim_edges[sim_edge_next].level);
+      sim_edge_next++;
+    }else if( t == t_tick ) {
+      sim_next_tick_us += sim_timer_us;
+      sim_timer_cb();
+    }else if( t == t_bus ) {
+      sim_bus_apply(&sim_bus_events[sim_bus_next++]);
+    }else {
+      sim_host_poll();
+    }
+  }
+  sim_now_us = end;
+}
+
+//An edge on the pin interrupts, itself or through an expander's INT
+static boolean sim_edge_irq(int pin) {
+  if( pin >= SIM_MCP_PIN0 ) {
+    pin = sim_mcp_int_pin(pin - SIM_MCP_PIN0);
+  }
+  return sim_pin_ok(pin) && sim_isr[sim_irq_line(pin)].callback;
+}
+
+/******************************************************************
+ * Sleep until the next interrupt, host polls don't interrupt
+ */
+void sim_wfi() {
+  uint64_t start = sim_now_us;
+  uint64_t t = (sim_now_us / 1000 + 1) * 1000; //SysTick
+
+  sim_advance(0); //Sorts the edges
+  if( sim_timer_cb && (sim_next_tick_us < t) ) {
+    t = sim_next_tick_us;
+  }
+  for( uint32_t i = sim_edge_next; (i < sim_edge_count) && (sim_edges[i].t_us < t); i++ ) {
+    if( sim_edge_irq(sim_edges[i].pin) ) {
+      t = sim_edges[i].t_us;
+      break;
+    }
+  }
+  sim_advance(t > sim_now_us ? t - sim_now_us : 0);
+  sim_stats.asleep_us += sim_now_us - start;
+}
+
+/******************************************************************
+ * Keyboard
+ */
+void Keyboard_::begin(void) {
+  memset(&_keyReport, 0, sizeof(_keyReport));
+  sim_usb_begin();
+}
+
+void Keyboard_::end(void) {
+}
+
+void Keyboard_::sendReport() {
+  sim_hid_report((const uint8_t *)&_keyReport, sizeof(_keyReport));
+}
+
+//Modifiers and non printing keys only, printable keys go through hid_output.h
+size_t Keyboard_::press(uint8_t k) {
+  if( k >= 0x88 ) {
+    k -= 0x88;
+    for( int i = 0; i < 6; i++ ) {
+      if( _keyReport.keys[i] == k ) {
+        return 1;
+      }
+      if( !_keyReport.keys[i] ) {
+        _keyReport.keys[i] = k;
+        break;
+      }
+    }
+  }else if( k >= 0x80 ) {
+    _keyReport.modifiers |= 1 << (k - 0x80);
+  }else {
+    return 0;
+  }
+  sendReport();
+  return 1;
+}
+
+size_t Keyboard_::release(uint8_t k) {
+  if( k >= 0x88 ) {
+    for( int i = 0; i < 6; i++ ) {
+      if( _keyReport.keys[i] == k - 0x88 ) {
+        _keyReport.keys[i] = 0;
+      }
+    }
+  }else if( k >= 0x80 ) {
+    _keyReport.modifiers &= ~(1 << (k - 0x80));
+  }else {
+    return 0;
+  }
+  sendReport();
+  return 1;
+}
+
+void Keyboard_::releaseAll(void) {
+  memset(&_keyReport, 0, sizeof(_keyReport));
+  sendReport();
+}
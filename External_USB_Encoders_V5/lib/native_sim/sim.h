@@ -0,0 +1,141 @@
+/***************************************************************
+ * Native simulator
+ *
+ * Virtual time, GPIO levels, edge interrupts and a model of the
+ * USB keyboard endpoint, so the firmware in src/main.cpp runs
+ * unchanged on a Linux host ([env:native]).
+ *
+ * Time only moves when the firmware calls delay() or when the
+ * timeline runner charges the cost of a loop() pass. Scripted edges
+ * are applied at their exact virtual time, firing the ISRs attached
+ * to the pin, and so are the ticks of the periodic timer interrupt.
+ * The host polls the keyboard endpoint every SIM_POLL_US; a report
+ * sent while the previous one is still waiting to be polled is
+ * dropped, as the STM32 HID stack does. Reports of SIM_BOOT_LEN bytes
+ * are read as boot reports, longer ones as the HID_NKRO bitmap.
+ * USB_MIDI builds get a bulk IN endpoint the host empties on the same
+ * polls.
+ * The host configures the device sim_enum_us after usb_begin(), and
+ * again some time after each bus reset the timeline scripts. It
+ * neither polls nor takes reports while the bus is suspended; a
+ * suspended bus resumes when the timeline says so, or SIM_RESUME_US
+ * after the device signals remote wakeup if the host enabled it.
+ * Feature reports the timeline sets go to the diagnostic channel
+ * (usb_diag.h) as from the USB interrupt, once configured.
+ * __WFI() sleeps until the next interrupt: a scripted edge on a pin
+ * with an ISR attached, a timer tick or the 1ms SysTick.
+ * MCP23017 port expanders sit on an I2C bus (sim_mcp.cpp), or as
+ * MCP23S17s on SPI, their pins X0A0-X7B7 are driven by the timeline
+ * like the controller's.
+ * The ADC (sim_adc.cpp) converts the levels of the timeline's analog
+ * ramps into the firmware's DMA buffer.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+#define SIM_NUM_PINS   72
+#define SIM_NUM_PORTS  ((SIM_NUM_PINS + 15) / 16)
+#define SIM_POLL_US    1000
+#define SIM_REPORT_LEN 16 /* Longest keyboard report, HID_NKRO */
+#define SIM_BOOT_LEN   8
+#define SIM_MIDI_LEN   64
+#define SIM_ENUM_US    200000 /* usb_begin() to configured, default */
+#define SIM_RESUME_US  20000  /* Remote wakeup to resumed */
+#define SIM_MAX_BUS    32     /* Scripted bus suspends and resets */
+#define SIM_MCP_CHIPS  8
+#define SIM_MCP_PIN0   0x100  /* Pin number of X0A0, 16 a chip */
+#define SIM_MCP_BYTE_US 23    /* I2C at 400 kHz, 9 bits a byte */
+#define SIM_SPI_BYTE_US 1     /* SPI at 10 MHz, rounded up */
+#if !defined(SIM_MCP_FITTED)
+#define SIM_MCP_FITTED 0xFF   /* Chips on the board, by bit */
+#endif
+#if !defined(SIM_SPI_MISO)
+#define SIM_SPI_MISO   0xFF   /* Read while no chip drives MISO */
+#endif
+
+//Scripted bus events
+#define SIM_BUS_SUSPEND 0
+#define SIM_BUS_RESET   1
+#define SIM_BUS_FEATURE 2 /* SET_REPORT of a diagnostic feature report */
+#define SIM_FEATURE_LEN 64
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct SimStats_s {
+  uint32_t edges;          //Scripted pin changes applied
+  uint32_t reports;        //Reports sent by the firmware
+  uint32_t polled;         //Reports taken by the host
+  uint32_t drop_busy;      //Sent while the endpoint was still full
+  uint32_t drop_offline;   //Sent before the host configured the device
+  uint32_t key_downs;      //Keys seen going down by the host
+  uint32_t midi_sent;      //MIDI transfers sent by the firmware
+  uint32_t midi_events;    //MIDI event packets taken by the host
+  uint32_t midi_drop_busy; //MIDI transfers sent while the endpoint was full
+  uint64_t configured_us;  //Time the host configured the device
+  uint64_t first_poll_us;  //Time the host took the first report or MIDI
+  uint64_t asleep_us;      //Time spent in __WFI()
+  uint32_t suspends;       //Bus suspended by the host
+  uint32_t resets;         //Bus resets, each followed by an enumeration
+  uint32_t wakeups;        //Remote wakeups signalled and taken
+}SimStats_t;
+
+/**************************************************************
+ * Global Variables
+ */
+extern uint64_t sim_now_us;
+extern SimStats_t sim_stats;
+extern uint64_t sim_enum_us;
+extern uint64_t sim_clock_offset_us; //Added to millis()/micros()
+extern bool sim_wakeup_enabled;        //Host allows remote wakeup
+
+/******************************************************************
+ * Procedures
+ */
+void sim_schedule(uint64_t t_us, int pin, int level);
+void sim_set_pin(int pin, int level);
+void sim_drive_pin(int pin, int level);
+void sim_advance(uint64_t us);
+void sim_timer_begin(uint32_t period_us, void (*callback)(void));
+void sim_timer_end();
+void sim_wfi();
+void sim_usb_begin();
+bool sim_usb_configured();
+bool sim_usb_suspended();
+uint32_t sim_usb_configs();
+bool sim_usb_wakeup();
+void sim_bus(uint64_t t_us, int type, uint64_t len_us);
+void sim_feature(uint64_t t_us, const uint8_t *report, uint8_t len);
+bool sim_hid_ready();
+void sim_hid_report(const uint8_t *rep, uint16_t len);
+bool sim_midi_ready();
+void sim_midi_send(const uint8_t *buf, uint16_t len);
+int  sim_irq_line(int pin);
+uint32_t sim_port_read(int port);
+int  sim_pin_number(const char *name);
+const char *sim_pin_name(int pin);
+
+//Expanders, addr is the I2C address, pin counts from SIM_MCP_PIN0
+void sim_mcp_begin(uint8_t addr, int int_pin);
+bool sim_mcp_write(uint8_t addr, uint8_t reg, const uint8_t *data, uint8_t n);
+bool sim_mcp_read(uint8_t addr, uint8_t reg, uint8_t *buf, uint8_t n);
+void sim_mcp_set_pin(int pin, int level);
+int  sim_mcp_int_pin(int pin);
+
+//ADC, len samples round buf, one conversion of the n pins in turn every conv_us
+extern int sim_adc_noise;
+void sim_adc_begin(const int *pins, int n, volatile uint16_t *buf, uint16_t len, uint32_t conv_us);
+void sim_adc_sync();
+void sim_adc_ramp(uint64_t t_us, uint64_t len_us, int pin, int level);
+
+//Called by the simulator for every report the host takes
+typedef void (*sim_report_cb_t)(uint64_t t_us, const uint8_t *rep, uint8_t len, uint8_t downs);
+extern sim_report_cb_t sim_report_cb;
+
+//Called for every MIDI transfer the host takes, n 4 byte event packets
+typedef void (*sim_midi_cb_t)(uint64_t t_us, const uint8_t *pkt, uint8_t n);
+extern sim_midi_cb_t sim_midi_cb;
+
+#endif
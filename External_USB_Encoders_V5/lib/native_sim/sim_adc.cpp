@@ -0,0 +1,123 @@
+/***************************************************************
+ * Native simulator - ADC and DMA
+ *
+ * The firmware hands sim_adc_begin() its channels and DMA buffer, as
+ * it would program the ADC scan and a circular DMA channel. The ADC
+ * converts one channel every conv_us in scan order; sim_adc_sync()
+ * writes the results of the conversions made since the last call into
+ * the buffer, at most one lap of it, before the firmware reads it.
+ *
+ * The voltage of a pin follows the timeline's "analog" ramps, linear
+ * from the value at the start of a ramp to its target, 0 before the
+ * first one. Every conversion adds up to +/- sim_adc_noise LSB of
+ * noise from a fixed seed, so runs are repeatable.
+ */
+#include <stdio.h>
+#include "Arduino.h"
+#include "sim.h"
+
+#define SIM_ADC_RAMPS 1024
+#define SIM_ADC_MAX   4095
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct SimRamp_s {
+  uint64_t t_us;
+  uint64_t len_us;
+  int16_t pin;
+  int16_t level;   //Target, 0-4095
+}SimRamp_t;
+
+/**************************************************************
+ * Global Variables
+ */
+int sim_adc_noise = 0;
+
+static SimRamp_t sim_ramps[SIM_ADC_RAMPS];
+static int sim_ramp_count = 0;
+static int sim_adc_pins[SIM_NUM_PINS];
+static int sim_adc_n = 0;
+static volatile uint16_t *sim_adc_buf = NULL;
+static uint16_t sim_adc_len = 0;
+static uint32_t sim_adc_conv_us = 0;
+static uint64_t sim_adc_next_us = 0;  //Time of the next conversion
+static uint32_t sim_adc_pos = 0;      //Next slot the DMA writes
+static uint32_t sim_adc_seed = 12345;
+
+/******************************************************************
+ * Procedures
+ */
+//Timeline, ramps of a pin in time order
+void sim_adc_ramp(uint64_t t_us, uint64_t len_us, int pin, int level) {
+  if( sim_ramp_count == SIM_ADC_RAMPS ) {
+    fprintf(stderr, "too many analog ramps\n");
+    exit(2);
+  }
+  sim_ramps[sim_ramp_count].t_us = t_us;
+  sim_ramps[sim_ramp_count].len_us = len_us;
+  sim_ramps[sim_ramp_count].pin = pin;
+  sim_ramps[sim_ramp_count].level = constrain(level, 0, SIM_ADC_MAX);
+  sim_ramp_count++;
+}
+
+//Level of a pin at time t, without noise
+static int sim_adc_level(int pin, uint64_t t) {
+  int level = 0;
+
+  for( int i = 0; i < sim_ramp_count; i++ ) {
+    SimRamp_t *r = &sim_ramps[i];
+    if( (r->pin != pin) || (r->t_us > t) ) {
+      continue;
+    }
+    if( t >= r->t_us + r->len_us ) {
+      level = r->level;
+    }else {
+      level += (int)((int64_t)(r->level - level) * (int64_t)(t - r->t_us) / (int64_t)r->len_us);
+    }
+  }
+  return level;
+}
+
+static int sim_adc_convert(int pin, uint64_t t) {
+  int level = sim_adc_level(pin, t);
+
+  if( sim_adc_noise ) {
+    sim_adc_seed = sim_adc_seed * 1103515245 + 12345;
+    level += (int)((sim_adc_seed >> 16) % (2 * sim_adc_noise + 1)) - sim_adc_noise;
+  }
+  return constrain(level, 0, SIM_ADC_MAX);
+}
+
+void sim_adc_begin(const int *pins, int n, volatile uint16_t *buf, uint16_t len, uint32_t conv_us) {
+  sim_adc_n = n < SIM_NUM_PINS ? n : SIM_NUM_PINS;
+  memcpy(sim_adc_pins, pins, sim_adc_n * sizeof(int));
+  sim_adc_buf = buf;
+  sim_adc_len = len;
+  sim_adc_conv_us = conv_us;
+  sim_adc_pos = 0;
+  sim_adc_next_us = sim_now_us + conv_us;
+  for( uint16_t i = 0; i < len; i++ ) {
+    buf[i] = sim_adc_convert(pins[i % n], sim_now_us);
+  }
+}
+
+//The conversions due by now, the last lap of the buffer only
+void sim_adc_sync() {
+  uint64_t due;
+
+  if( !sim_adc_buf || (sim_adc_next_us > sim_now_us) ) {
+    return;
+  }
+  due = (sim_now_us - sim_adc_next_us) / sim_adc_conv_us + 1;
+  if( due > sim_adc_len ) {
+    sim_adc_pos = (sim_adc_pos + (due - sim_adc_len)) % sim_adc_len;
+    sim_adc_next_us += (due - sim_adc_len) * sim_adc_conv_us;
+    due = sim_adc_len;
+  }
+  for( ; due; due-- ) {
+    sim_adc_buf[sim_adc_pos] = sim_adc_convert(sim_adc_pins[sim_adc_pos % sim_adc_n], sim_adc_next_us);
+    sim_adc_pos = (sim_adc_pos + 1) % sim_adc_len;
+    sim_adc_next_us += sim_adc_conv_us;
+  }
+}
@@ -0,0 +1,357 @@
+/***************************************************************
+ * Native simulator - timeline runner
+ *
+ * Usage: program [timeline]   (reads stdin without a file)
+ *
+ * Timeline lines, times in ms from reset, '#' starts a comment:
+ *   loop_us <us>                    cost of one loop() pass, default 20
+ *   end <t>                         stop time, default last edge + 500
+ *   enum <ms>                       usb_begin() to configured, default 200
+ *   millis_wrap <ms>                make millis() wrap around at this time
+ *   diag_save <obj> <file>          at the end, read a diagnostic object
+ *                                   through the feature reports, as
+ *                                   tools/zyn_diag.py does, into a file
+ *   adc_noise <lsb>                 noise on every ADC conversion, default 0
+ *   remote_wakeup <0|1>             the host allows remote wakeup, default 1
+ *   <t> set <pin> <0|1>             drive a pin
+ *   <t> turn <pinA> <pinB> <n> <ms> n detents (-ve = CCW), ms per detent
+ *   <t> press <pin> <ms> [bounce]   pull a switch low for ms, the contact
+ *                                   chattering for bounce ms at each end
+ *   <t> analog <pin> <0-4095> [ms]  move a fader or pot to the level,
+ *                                   linearly over ms
+ *   <t> suspend <ms>                the host suspends the bus for ms at most
+ *   <t> reset [ms]                  the host resets the bus (reboots) and
+ *                                   configures the device again ms later,
+ *                                   default the enum time
+ *   <t> diag_write <obj> <offset> <hex>  the host writes the bytes at
+ *                                   offset of a diagnostic object
+ *   <t> diag_cmd <obj> <cmd>        the host sends a diagnostic command
+ * Edges at time 0 are applied before setup() runs (config straps).
+ *
+ * Every report the host takes is printed with its virtual time, then
+ * per command latency (first key down after the input completed) and
+ * settle time (last report before the next command), and the drop
+ * counters of the endpoint model. MIDI transfers are printed one event
+ * packet per line, tagged "midi"; every one counts as a key down.
+ * The output each timeline must give is kept in timelines/expected
+ * and checked by tools/sim_check.py.
+ */
+#include <stdio.h>
+#include "Arduino.h"
+#include "sim.h"
+
+#define SIM_MAX_CMDS 1024
+#define SIM_LINE_LEN 256
+#define SIM_BOUNCE_US 200  /* Contact chatter period */
+#define SIM_DIAG_LEN  64   /* Feature report, ID included */
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct SimCmd_s {
+  uint64_t t_input;  //Time the scripted input was complete
+  uint64_t t_first;  //First key down seen by the host after it
+  uint64_t t_last;   //Last report before the next command
+  uint32_t inputs;   //Detents or presses
+  uint32_t downs;    //Key downs attributed to the command
+  char text[SIM_LINE_LEN];
+}SimCmd_t;
+
+/**************************************************************
+ * Global Variables
+ */
+static SimCmd_t sim_cmds[SIM_MAX_CMDS];
+static int sim_cmd_count = 0;
+static uint32_t sim_loop_us = 20;
+static uint64_t sim_end_us = 0;
+static uint64_t sim_last_edge_us = 0;
+static uint32_t sim_inputs = 0;
+static int sim_diag_obj = 0;
+static char sim_diag_file[SIM_LINE_LEN];
+
+void setup();
+void loop();
+uint16_t diag_get_feature(byte id, byte *buf);
+void diag_set_feature(const byte *buf, uint16_t len);
+
+/******************************************************************
+ * Timeline parsing
+ */
+static uint64_t sim_ms(const char *s) {
+  return (uint64_t)(atof(s) * 1000.0 + 0.5);
+}
+
+static void sim_edge(uint64_t t_us, int pin, int level) {
+  sim_schedule(t_us, pin, level);
+  if( t_us > sim_last_edge_us ) {
+    sim_last_edge_us = t_us;
+  }
+}
+
+static int sim_pin_arg(const char *name, int line) {
+  int pin = sim_pin_number(name);
+  if( pin < 0 ) {
+    fprintf(stderr, "line %d: unknown pin %s\n", line, name);
+    exit(2);
+  }
+  return pin;
+}
+
+static SimCmd_t *sim_cmd_add(uint64_t t_input, uint32_t inputs, const char *text) {
+  SimCmd_t *cmd;
+
+  if( sim_cmd_count == SIM_MAX_CMDS ) {
+    fprintf(stderr, "too many commands\n");
+    exit(2);
+  }
+  cmd = &sim_cmds[sim_cmd_count++];
+  memset(cmd, 0, sizeof(SimCmd_t));
+  cmd->t_input = t_input;
+  cmd->inputs = inputs;
+  strncpy(cmd->text, text, SIM_LINE_LEN - 1);
+  cmd->text[strcspn(cmd->text, "#\r\n")] = 0;
+  sim_inputs += inputs;
+  return cmd;
+}
+
+static void sim_parse(FILE *f) {
+  char line[SIM_LINE_LEN];
+  char text[SIM_LINE_LEN];
+  char *tok[8];
+  int n;
+  int line_no = 0;
+
+  while( fgets(line, sizeof(line), f) ) {
+    line_no++;
+    strcpy(text, line);
+    line[strcspn(line, "#\r\n")] = 0;
+    for( n = 0; n < 8; n++ ) {
+      tok[n] = strtok(n ? NULL : line, " \t");
+      if( !tok[n] ) {
+        break;
+      }
+    }
+    if( !n ) {
+      continue;
+    }
+
+    if( !strcmp(tok[0], "loop_us") && (n == 2) ) {
+      sim_loop_us = atoi(tok[1]);
+    }else if( !strcmp(tok[0], "end") && (n == 2) ) {
+      sim_end_us = sim_ms(tok[1]);
+    }else if( !strcmp(tok[0], "enum") && (n == 2) ) {
+      sim_enum_us = sim_ms(tok[1]);
+    }else if( !strcmp(tok[0], "millis_wrap") && (n == 2) ) {
+      sim_clock_offset_us = (1ULL << 32) * 1000 - sim_ms(tok[1]);
+    }else if( !strcmp(tok[0], "diag_save") && (n == 3) ) {
+      sim_diag_obj = atoi(tok[1]);
+      strncpy(sim_diag_file, tok[2], SIM_LINE_LEN - 1);
+    }else if( !strcmp(tok[0], "adc_noise") && (n == 2) ) {
+      sim_adc_noise = atoi(tok[1]);
+    }else if( !strcmp(tok[0], "remote_wakeup") && (n == 2) ) {
+      sim_wakeup_enabled = atoi(tok[1]) != 0;
+    }else if( (n == 3) && !strcmp(tok[1], "suspend") ) {
+      sim_bus(sim_ms(tok[0]), SIM_BUS_SUSPEND, sim_ms(tok[2]));
+    }else if( ((n == 2) || (n == 3)) && !strcmp(tok[1], "reset") ) {
+      sim_bus(sim_ms(tok[0]), SIM_BUS_RESET, (n == 3) ? sim_ms(tok[2]) : sim_enum_us);
+    }else if( (n == 5) && !strcmp(tok[1], "diag_write") ) {
+      byte rep[SIM_DIAG_LEN] = { 2, (byte)atoi(tok[2]), 0, (byte)(atoi(tok[3]) & 0xFF), (byte)(atoi(tok[3]) >> 8), 0, 0 };
+      unsigned int b;
+      int len = 0;
+
+      while( (7 + len < SIM_DIAG_LEN) && (2 * len < (int)strlen(tok[4])) && (sscanf(tok[4] + 2 * len, "%2x", &b) == 1) ) {
+        rep[7 + len++] = b;
+      }
+      rep[2] = len;
+      sim_feature(sim_ms(tok[0]), rep, 7 + len);
+    }else if( (n == 4) && !strcmp(tok[1], "diag_cmd") ) {
+      byte rep[7] = { 1, (byte)atoi(tok[2]), (byte)atoi(tok[3]), 0, 0, 0, 0 };
+
+      sim_feature(sim_ms(tok[0]), rep, sizeof(rep));
+    }else if( ((n == 4) || (n == 5)) && !strcmp(tok[1], "analog") ) {
+      uint64_t t = sim_ms(tok[0]);
+      uint64_t len = (n == 5) ? sim_ms(tok[4]) : 0;
+
+      sim_adc_ramp(t, len, sim_pin_arg(tok[2], line_no), atoi(tok[3]));
+      if( t + len > sim_last_edge_us ) {
+        sim_last_edge_us = t + len;
+      }
+      if( t + len ) {
+        sim_cmd_add(t, 1, text); //Not the levels at reset, sent as it moves
+      }
+    }else if( (n == 4) && !strcmp(tok[1], "set") ) {
+      uint64_t t = sim_ms(tok[0]);
+      sim_edge(t, sim_pin_arg(tok[2], line_no), atoi(tok[3]));
+    }else if( (n == 6) && !strcmp(tok[1], "turn") ) {
+      //Leave the detent on the leading line first, both lines rest at HIGH
+      uint64_t t = sim_ms(tok[0]);
+      int lead = sim_pin_arg(tok[2], line_no);
+      int lag = sim_pin_arg(tok[3], line_no);
+      int count = atoi(tok[4]);
+      uint64_t period = sim_ms(tok[5]);
+      uint64_t q = period / 4;
+
+      if( count < 0 ) {
+        int swap = lead;
+        lead = lag;
+        lag = swap;
+        count = -count;
+      }
+      for( int i = 0; i < count; i++ ) {
+        uint64_t base = t + i * period;
+        sim_edge(base, lead, LOW);
+        sim_edge(base + q, lag, LOW);
+        sim_edge(base + 2 * q, lead, HIGH);
+        sim_edge(base + 3 * q, lag, HIGH);
+      }
+      sim_cmd_add(t + 3 * q, count, text);
+    }else if( ((n == 4) || (n == 5)) && !strcmp(tok[1], "press") ) {
+      uint64_t t = sim_ms(tok[0]);
+      int pin = sim_pin_arg(tok[2], line_no);
+      uint64_t up = t + sim_ms(tok[3]);
+      uint64_t bounce = (n == 5) ? sim_ms(tok[4]) : 0;
+
+      for( uint64_t b = 0; b < bounce; b += 2 * SIM_BOUNCE_US ) {
+        sim_edge(t + b, pin, LOW);
+        sim_edge(t + b + SIM_BOUNCE_US, pin, HIGH);
+        sim_edge(up + b, pin, HIGH);
+        sim_edge(up + b + SIM_BOUNCE_US, pin, LOW);
+      }
+      sim_edge(t + bounce, pin, LOW);
+      sim_edge(up + bounce, pin, HIGH);
+      sim_cmd_add(t, 1, text);
+    }else {
+      fprintf(stderr, "line %d: can't parse '%s'\n", line_no, text);
+      exit(2);
+    }
+  }
+}
+
+/******************************************************************
+ * Reports taken by the host
+ */
+static void sim_charge(uint64_t t_us, uint8_t downs) {
+  SimCmd_t *cmd = NULL;
+
+  //Charge the report to the latest command whose input is complete
+  for( int i = 0; i < sim_cmd_count; i++ ) {
+    if( sim_cmds[i].t_input <= t_us && (!cmd || sim_cmds[i].t_input >= cmd->t_input) ) {
+      cmd = &sim_cmds[i];
+    }
+  }
+  if( !cmd ) {
+    return;
+  }
+  if( downs && !cmd->t_first ) {
+    cmd->t_first = t_us;
+  }
+  cmd->downs += downs;
+  cmd->t_last = t_us;
+}
+
+static void sim_report(uint64_t t_us, const uint8_t *rep, uint8_t len, uint8_t downs) {
+  printf("%10.3f", t_us / 1000.0);
+  for( int i = 0; i < len; i++ ) {
+    printf(" %02x", rep[i]);
+  }
+  printf("\n");
+  sim_charge(t_us, downs);
+}
+
+static void sim_midi(uint64_t t_us, const uint8_t *pkt, uint8_t n) {
+  for( int i = 0; i < n; i++, pkt += 4 ) {
+    printf("%10.3f midi %02x %02x %02x %02x\n", t_us / 1000.0, pkt[0], pkt[1], pkt[2], pkt[3]);
+  }
+  sim_charge(t_us, n);
+}
+
+/******************************************************************
+ * Diagnostic object dump, report layout in usb_diag.h
+ */
+static void sim_diag_save() {
+  byte buf[SIM_DIAG_LEN] = { 1, (byte)sim_diag_obj, 0, 0, 0, 0, 0 };
+  uint16_t got = 0;
+  uint16_t size;
+  FILE *f;
+
+  if( !(f = fopen(sim_diag_file, "wb")) ) {
+    perror(sim_diag_file);
+    exit(2);
+  }
+  diag_set_feature(buf, 7);
+  do {
+    diag_get_feature(2, buf);
+    size = buf[5] | (buf[6] << 8);
+    fwrite(&buf[7], 1, buf[2], f);
+    got += buf[2];
+  } while( buf[2] && (got < size) );
+  fclose(f);
+  printf("# diag object %d, %u bytes saved to %s\n", sim_diag_obj, got, sim_diag_file);
+}
+
+/******************************************************************
+ * Summary
+ */
+static void sim_summary() {
+  double lat_min = 0, lat_max = 0, lat_sum = 0;
+  int lat_n = 0;
+
+  printf("# loop_us %u, end %.3f ms\n", sim_loop_us, sim_end_us / 1000.0);
+  printf("# configured %.3f ms, first report %.3f ms\n", sim_stats.configured_us / 1000.0,
+         sim_stats.first_poll_us / 1000.0);
+  for( int i = 0; i < sim_cmd_count; i++ ) {
+    SimCmd_t *cmd = &sim_cmds[i];
+    if( cmd->t_first ) {
+      double lat = (cmd->t_first - cmd->t_input) / 1000.0;
+      printf("# %-40s inputs %3u downs %3u latency %8.3f ms settle %8.3f ms\n", cmd->text, cmd->inputs, cmd->downs,
+             lat, (cmd->t_last - cmd->t_input) / 1000.0);
+      lat_min = (!lat_n || lat < lat_min) ? lat : lat_min;
+      lat_max = (!lat_n || lat > lat_max) ? lat : lat_max;
+      lat_sum += lat;
+      lat_n++;
+    }else {
+      printf("# %-40s inputs %3u downs %3u no output\n", cmd->text, cmd->inputs, cmd->downs);
+    }
+  }
+  if( lat_n ) {
+    printf("# latency ms min %.3f avg %.3f max %.3f\n", lat_min, lat_sum / lat_n, lat_max);
+  }
+  printf("# inputs %u edges %u\n", sim_inputs, sim_stats.edges);
+  printf("# reports %u polled %u drop_busy %u drop_offline %u key_downs %u\n", sim_stats.reports, sim_stats.polled,
+         sim_stats.drop_busy, sim_stats.drop_offline, sim_stats.key_downs);
+  printf("# asleep %.3f ms\n", sim_stats.asleep_us / 1000.0);
+  if( sim_stats.suspends || sim_stats.resets ) {
+    printf("# bus suspends %u wakeups %u resets %u\n", sim_stats.suspends, sim_stats.wakeups, sim_stats.resets);
+  }
+  if( sim_stats.midi_sent ) {
+    printf("# midi sent %u events %u drop_busy %u\n", sim_stats.midi_sent, sim_stats.midi_events,
+           sim_stats.midi_drop_busy);
+  }
+}
+
+int main(int argc, char **argv) {
+  FILE *f = stdin;
+
+  if( argc > 1 && !(f = fopen(argv[1], "r")) ) {
+    perror(argv[1]);
+    return 2;
+  }
+  sim_parse(f);
+  if( !sim_end_us ) {
+    sim_end_us = sim_last_edge_us + 500000;
+  }
+  sim_report_cb = sim_report;
+  sim_midi_cb = sim_midi;
+
+  sim_advance(0); //Straps at time 0
+  setup();
+  while( sim_now_us < sim_end_us ) {
+    loop();
+    sim_advance(sim_loop_us);
+  }
+  sim_summary();
+  if( sim_diag_obj ) {
+    sim_diag_save();
+  }
+  return 0;
+}
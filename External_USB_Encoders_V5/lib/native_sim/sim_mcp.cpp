@@ -0,0 +1,252 @@
+/***************************************************************
+ * Native simulator - MCP23017 port expanders
+ *
+ * Register model of the chips on the I2C bus, IOCON.BANK = 0 with
+ * sequential addressing. Pins are inputs only: GPIO reads the levels
+ * the timeline drives, inverted by IPOL, and unwired pins read high
+ * as with the pull-ups on. A change on a pin enabled in GPINTEN,
+ * against the last level or DEFVAL by INTCON, latches INTF and INTCAP
+ * and pulls INT low until GPIO or INTCAP is read. With IOCON.MIRROR
+ * and ODR the INT pins of all chips are wired together, low while any
+ * of them asserts. Each transaction takes SIM_MCP_BYTE_US a byte of
+ * virtual time, so reads in loop() cost what they do on the bus.
+ *
+ * The same chips answer as MCP23S17s on the SPI stand-in (SPI.h), at
+ * SIM_SPI_BYTE_US a byte, with hardware address n for I2C address
+ * 0x20 + n. IOCON.HAEN isn't modelled, the address is always decoded.
+ * Only the chips in SIM_MCP_FITTED answer, on SPI the others leave
+ * MISO at SIM_SPI_MISO.
+ */
+#include <stdio.h>
+#include "Arduino.h"
+#include "SPI.h"
+#include "sim.h"
+
+#define SIM_MCP_ADDR   0x20 /* A2-A0 low */
+#define SIM_MCP_REGS   0x16
+
+//Registers, port A, port B is the next one up
+#define MCP_IODIR   0x00
+#define MCP_IPOL    0x02
+#define MCP_GPINTEN 0x04
+#define MCP_DEFVAL  0x06
+#define MCP_INTCON  0x08
+#define MCP_IOCON   0x0A
+#define MCP_GPPU    0x0C
+#define MCP_INTF    0x0E
+#define MCP_INTCAP  0x10
+#define MCP_GPIO    0x12
+#define MCP_OLAT    0x14
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct SimMcp_s {
+  boolean present;
+  int int_pin;           //Controller pin the INT is wired to, -1 for none
+  boolean int_active;
+  uint16_t levels;       //Pin levels, GPB in the high byte
+  uint8_t regs[SIM_MCP_REGS];
+}SimMcp_t;
+
+/**************************************************************
+ * Global Variables
+ */
+static SimMcp_t sim_mcp[SIM_MCP_CHIPS];
+SPIClass SPI;
+
+/******************************************************************
+ * Procedures
+ */
+static uint16_t sim_mcp_reg16(SimMcp_t *mcp, uint8_t reg) {
+  return mcp->regs[reg] | (mcp->regs[reg + 1] << 8);
+}
+
+static SimMcp_t *sim_mcp_chip(uint8_t addr) {
+  int chip = addr - SIM_MCP_ADDR;
+
+  if( (chip < 0) || (chip >= SIM_MCP_CHIPS) || !sim_mcp[chip].present ) {
+    return NULL; //NAK
+  }
+  return &sim_mcp[chip];
+}
+
+//Level of an INT line, open drain: low while any chip on it asserts
+static void sim_mcp_int_update(int int_pin) {
+  int level = HIGH;
+
+  if( int_pin < 0 ) {
+    return;
+  }
+  for( int c = 0; c < SIM_MCP_CHIPS; c++ ) {
+    if( sim_mcp[c].present && (sim_mcp[c].int_pin == int_pin) && sim_mcp[c].int_active ) {
+      level = LOW;
+    }
+  }
+  if( digitalRead(int_pin) != level ) {
+    sim_drive_pin(int_pin, level);
+  }
+}
+
+//Latch a change on the enabled pins, unless the last one is still pending
+static void sim_mcp_check(SimMcp_t *mcp, uint16_t old) {
+  uint16_t enabled = sim_mcp_reg16(mcp, MCP_GPINTEN);
+  uint16_t intcon = sim_mcp_reg16(mcp, MCP_INTCON);
+  uint16_t changed = ((old ^ mcp->levels) & ~intcon) | ((sim_mcp_reg16(mcp, MCP_DEFVAL) ^ mcp->levels) & intcon);
+
+  changed &= enabled;
+  if( !changed || mcp->int_active ) {
+    return;
+  }
+  mcp->regs[MCP_INTF] = changed & 0xFF;
+  mcp->regs[MCP_INTF + 1] = changed >> 8;
+  mcp->regs[MCP_INTCAP] = mcp->levels & 0xFF;
+  mcp->regs[MCP_INTCAP + 1] = mcp->levels >> 8;
+  mcp->int_active = true;
+  sim_mcp_int_update(mcp->int_pin);
+}
+
+void sim_mcp_begin(uint8_t addr, int int_pin) {
+  int chip = addr - SIM_MCP_ADDR;
+  SimMcp_t *mcp;
+
+  if( (chip < 0) || (chip >= SIM_MCP_CHIPS) || !(SIM_MCP_FITTED & (1 << chip)) ) {
+    return;
+  }
+  mcp = &sim_mcp[chip];
+  if( !mcp->present ) {
+    mcp->levels = 0xFFFF;
+  }
+  memset(mcp->regs, 0, sizeof(mcp->regs));
+  mcp->regs[MCP_IODIR] = 0xFF;
+  mcp->regs[MCP_IODIR + 1] = 0xFF;
+  mcp->present = true;
+  mcp->int_pin = int_pin;
+  mcp->int_active = false;
+}
+
+//A scripted edge on pin bit of chip pin / 16
+void sim_mcp_set_pin(int pin, int level) {
+  SimMcp_t *mcp = &sim_mcp[(pin / 16) % SIM_MCP_CHIPS];
+  uint16_t old = mcp->levels;
+
+  if( level ) {
+    mcp->levels |= 1 << (pin % 16);
+  }else {
+    mcp->levels &= ~(1 << (pin % 16));
+  }
+  if( mcp->present ) {
+    sim_mcp_check(mcp, old);
+  }
+}
+
+int sim_mcp_int_pin(int pin) {
+  SimMcp_t *mcp = &sim_mcp[(pin / 16) % SIM_MCP_CHIPS];
+
+  return mcp->present ? mcp->int_pin : -1;
+}
+
+//Register access of one transaction, the bus charges its time
+static void sim_mcp_regs_write(SimMcp_t *mcp, uint8_t reg, const uint8_t *data, uint8_t n) {
+  for( int i = 0; i < n; i++, reg++ ) {
+    if( reg >= SIM_MCP_REGS ) {
+      reg = 0; //Sequential addressing wraps
+    }
+    if( (reg == MCP_INTF) || (reg == MCP_INTF + 1) || (reg == MCP_INTCAP) || (reg == MCP_INTCAP + 1) ) {
+      continue; //Read only
+    }
+    mcp->regs[reg] = data[i];
+    if( (reg & ~1) == MCP_IOCON ) {
+      mcp->regs[reg ^ 1] = data[i]; //One register at both addresses
+    }
+  }
+}
+
+static void sim_mcp_regs_read(SimMcp_t *mcp, uint8_t reg, uint8_t *buf, uint8_t n) {
+  boolean clear = false;
+  uint16_t gpio;
+
+  gpio = mcp->levels ^ sim_mcp_reg16(mcp, MCP_IPOL);
+  mcp->regs[MCP_GPIO] = gpio & 0xFF;
+  mcp->regs[MCP_GPIO + 1] = gpio >> 8;
+  for( int i = 0; i < n; i++, reg++ ) {
+    if( reg >= SIM_MCP_REGS ) {
+      reg = 0;
+    }
+    buf[i] = mcp->regs[reg];
+    if( (reg >= MCP_INTCAP) && (reg <= MCP_GPIO + 1) ) {
+      clear = true;
+    }
+  }
+  if( clear && mcp->int_active ) {
+    mcp->int_active = false;
+    mcp->regs[MCP_INTF] = 0;
+    mcp->regs[MCP_INTF + 1] = 0;
+    sim_mcp_int_update(mcp->int_pin);
+  }
+}
+
+bool sim_mcp_write(uint8_t addr, uint8_t reg, const uint8_t *data, uint8_t n) {
+  SimMcp_t *mcp = sim_mcp_chip(addr);
+
+  sim_advance((2 + n) * SIM_MCP_BYTE_US);
+  if( !mcp ) {
+    return false;
+  }
+  sim_mcp_regs_write(mcp, reg, data, n);
+  return true;
+}
+
+bool sim_mcp_read(uint8_t addr, uint8_t reg, uint8_t *buf, uint8_t n) {
+  SimMcp_t *mcp = sim_mcp_chip(addr);
+
+  sim_advance((3 + n) * SIM_MCP_BYTE_US);
+  if( !mcp ) {
+    return false;
+  }
+  sim_mcp_regs_read(mcp, reg, buf, n);
+  return true;
+}
+
+/******************************************************************
+ * SPI
+ */
+void SPIClass::begin(void) {
+  _n = 0;
+}
+
+void SPIClass::end(void) {
+}
+
+void SPIClass::beginTransaction(SPISettings settings) {
+  (void)settings;
+  _n = 0;
+}
+
+void SPIClass::endTransaction(void) {
+  _n = 0;
+}
+
+//Opcode 0100 A2 A1 A0 R/W, then the register, then data at reg up
+uint8_t SPIClass::transfer(uint8_t data) {
+  SimMcp_t *mcp;
+  uint8_t got = SIM_SPI_MISO; //No chip driving MISO
+
+  sim_advance(SIM_SPI_BYTE_US);
+  if( _n == 0 ) {
+    _opcode = data;
+  }else if( _n == 1 ) {
+    _reg = data;
+  }else if( ((_opcode & 0xF0) == 0x40) && (mcp = sim_mcp_chip(SIM_MCP_ADDR + ((_opcode >> 1) & 7))) ) {
+    if( _opcode & 1 ) {
+      sim_mcp_regs_read(mcp, _reg, &got, 1);
+    }else {
+      sim_mcp_regs_write(mcp, _reg, &data, 1);
+    }
+    _reg = (_reg + 1) % SIM_MCP_REGS;
+  }
+  if( _n < 0xFF ) {
+    _n++;
+  }
+  return got;
+}
@@ -0,0 +1,326 @@
+/***************************************************************
+ * Analog controls
+ *
+ * Include after controls.h, once main.cpp has listed its faders and
+ * pots by hardware slot like the encoders:
+ *   constexpr AnaDef_t ana_all[] = { ANALOG_DEF_MIDI(ANA0, ...), ... };
+ * Slots the board config leaves at PIN_NA are dropped.
+ *
+ * The ADC converts every channel over and over on its own, a DMA
+ * channel in circular mode writing the results round a buffer of
+ * ANA_OVERSAMPLE samples per channel, with no interrupt and no CPU.
+ *   STM32  ADC1 scan mode, DMA2 stream 0
+ *   SAMD   ADC free running input scan over the AIN range of the
+ *          pins, DMAC channel ANA_DMAC_CH
+ *   native sim_adc.cpp fills the buffer as virtual time passes
+ * Every ANA_PERIOD_MS the scan tick takes one batched pass over the
+ * buffer: the samples of each channel are summed, oversampling 12 bits
+ * up to 16, the sum smoothed by a first order IIR (1/2^ANA_IIR_SHIFT
+ * of the way a pass) and the result quantized into the steps of the
+ * control. A control only moves off its step once the value is
+ * ANA_DEADBAND of a step past the step's edges, so a resting fader
+ * whose value dithers round an edge sends nothing. A change of step
+ * sends the absolute value as MIDI CC (0-127), or the up/down key of
+ * the map once per step. While the route is backed up the step is
+ * held and the next pass sends the newest value.
+ *
+ * The scan ticks stop while the controller sleeps (idle_sleep.h), the
+ * DMA doesn't: ana_moved() looks at the buffer at each SysTick wake.
+ * -D ANALOG_SCAN builds it, without it nothing of this is built.
+ */
+#define ANA_OVERSAMPLE  16   /* Samples per channel in the buffer, power of 2, <= 16 */
+#define ANA_PERIOD_MS   4    /* Batched pass */
+#define ANA_IIR_SHIFT   2
+#define ANA_FULL        65536L /* Filtered value range */
+#define ANA_DEADBAND(size) ((size) / 4) /* Hysteresis, past a step's edge */
+#define ANA_DMAC_CH     0    /* SAMD */
+#define ANA_CONV_US     24   /* STM32 and native, 480 + 12 ADC cycles at 21 MHz */
+
+#if (ANA_OVERSAMPLE & (ANA_OVERSAMPLE - 1)) || (ANA_OVERSAMPLE > 16)
+#error "ANA_OVERSAMPLE must be a power of 2, 16 at most"
+#endif
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct AnaState_s {
+  const AnaDef_t *def;
+  byte slot;       //Offset of the channel in a row of ana_dma[]
+  int32_t filt;    //Smoothed value, 0 to ANA_FULL - 1
+  int16_t step;    //Step sent last, -1 until the first pass
+}AnaState_t;
+
+#if defined(ANALOG_SCAN)
+#if defined(ARDUINO_ARCH_SAMD)
+#include "wiring_private.h" /* pinPeripheral() */
+#endif
+
+constexpr int ctl_used(const AnaDef_t &def) {
+  return def.pin != PIN_NA;
+}
+
+/**************************************************************
+ * Global Variables
+ */
+constexpr int ana_count = ctl_count(ana_all);
+#if defined(ARDUINO_ARCH_SAMD)
+#define ANA_STRIDE_MAX  20   /* AIN0-19, the scan covers the range in between */
+#else
+#define ANA_STRIDE_MAX  ana_count
+#endif
+
+AnaState_t ana_state[ana_count];
+volatile uint16_t ana_dma[ANA_OVERSAMPLE * ANA_STRIDE_MAX]; //Written by the DMA
+byte ana_stride = ana_count;      //Conversions per round of the scan
+uint32_t ana_last_ms = 0;
+#if defined(ARDUINO_ARCH_STM32)
+ADC_HandleTypeDef ana_adc;
+DMA_HandleTypeDef ana_dma_h;
+#elif defined(ARDUINO_ARCH_SAMD)
+DmacDescriptor ana_desc __attribute__((aligned(16)));
+DmacDescriptor ana_desc_wb __attribute__((aligned(16)));
+#endif
+
+/******************************************************************
+ * Procedures
+ */
+#if defined(ARDUINO_ARCH_STM32)
+/***************************************************
+ * ana hw begin
+ * ADC1 scans the channels in ana_state order, continuously, DMA2
+ * stream 0 copies each result round ana_dma[]. The DMA interrupts stay
+ * off in the NVIC, nothing is done per conversion or per round.
+ */
+void ana_hw_begin() {
+  ADC_ChannelConfTypeDef ch;
+
+  __HAL_RCC_ADC1_CLK_ENABLE();
+  __HAL_RCC_DMA2_CLK_ENABLE();
+  ana_adc.Instance = ADC1;
+  ana_adc.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4;
+  ana_adc.Init.Resolution = ADC_RESOLUTION_12B;
+  ana_adc.Init.DataAlign = ADC_DATAALIGN_RIGHT;
+  ana_adc.Init.ScanConvMode = ENABLE;
+  ana_adc.Init.ContinuousConvMode = ENABLE;
+  ana_adc.Init.DiscontinuousConvMode = DISABLE;
+  ana_adc.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
+  ana_adc.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+  ana_adc.Init.NbrOfConversion = ana_count;
+  ana_adc.Init.DMAContinuousRequests = ENABLE;
+  ana_adc.Init.EOCSelection = ADC_EOC_SEQ_CONV;
+  HAL_ADC_Init(&ana_adc);
+  for( int i = 0; i < ana_count; i++ ) {
+    pinMode(ana_state[i].def->pin, INPUT_ANALOG);
+    ch.Channel = STM_PIN_CHANNEL(pinmap_function(digitalPinToPinName(ana_state[i].def->pin), PinMap_ADC));
+    ch.Rank = i + 1;
+    ch.SamplingTime = ADC_SAMPLETIME_480CYCLES; //Pots are high impedance sources
+    ch.Offset = 0;
+    HAL_ADC_ConfigChannel(&ana_adc, &ch);
+  }
+
+  ana_dma_h.Instance = DMA2_Stream0;
+  ana_dma_h.Init.Channel = DMA_CHANNEL_0;
+  ana_dma_h.Init.Direction = DMA_PERIPH_TO_MEMORY;
+  ana_dma_h.Init.PeriphInc = DMA_PINC_DISABLE;
+  ana_dma_h.Init.MemInc = DMA_MINC_ENABLE;
+  ana_dma_h.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+  ana_dma_h.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+  ana_dma_h.Init.Mode = DMA_CIRCULAR;
+  ana_dma_h.Init.Priority = DMA_PRIORITY_LOW;
+  ana_dma_h.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+  HAL_DMA_Init(&ana_dma_h);
+  __HAL_LINKDMA(&ana_adc, DMA_Handle, ana_dma_h);
+  HAL_ADC_Start_DMA(&ana_adc, (uint32_t *)ana_dma, ANA_OVERSAMPLE * ana_count);
+  __HAL_DMA_DISABLE_IT(&ana_dma_h, DMA_IT_TC | DMA_IT_HT);
+  __HAL_ADC_DISABLE_IT(&ana_adc, ADC_IT_OVR);
+}
+#elif defined(ARDUINO_ARCH_SAMD)
+/***************************************************
+ * ana hw begin
+ * The SAMD21 input scan only takes consecutive AIN channels, so the
+ * ADC free runs from the lowest AIN of the pins to the highest and
+ * each control reads its own slot of a round. The DMAC descriptor
+ * links to itself, one beat per result, no interrupts.
+ */
+void ana_hw_begin() {
+  byte lo = 0xFF;
+  byte hi = 0;
+  byte ain;
+
+  for( int i = 0; i < ana_count; i++ ) {
+    ain = g_APinDescription[ana_state[i].def->pin].ulADCChannelNumber;
+    lo = min(lo, ain);
+    hi = max(hi, ain);
+    pinPeripheral(ana_state[i].def->pin, PIO_ANALOG);
+  }
+  for( int i = 0; i < ana_count; i++ ) {
+    ana_state[i].slot = g_APinDescription[ana_state[i].def->pin].ulADCChannelNumber - lo;
+  }
+  ana_stride = hi - lo + 1;
+
+  //The core has set the ADC clock and calibration up, slow the ADC
+  //clock to 750 kHz and sample long for the pots
+  ADC->CTRLA.bit.ENABLE = 0;
+  while( ADC->STATUS.bit.SYNCBUSY );
+  ADC->REFCTRL.reg = ADC_REFCTRL_REFSEL_INTVCC1;
+  ADC->AVGCTRL.reg = ADC_AVGCTRL_SAMPLENUM_1;
+  ADC->SAMPCTRL.reg = ADC_SAMPCTRL_SAMPLEN(31);
+  ADC->CTRLB.reg = ADC_CTRLB_PRESCALER_DIV64 | ADC_CTRLB_RESSEL_12BIT | ADC_CTRLB_FREERUN;
+  while( ADC->STATUS.bit.SYNCBUSY );
+  ADC->INPUTCTRL.reg = ADC_INPUTCTRL_MUXPOS(lo) | ADC_INPUTCTRL_MUXNEG_GND | ADC_INPUTCTRL_INPUTSCAN(ana_stride - 1) |
+                       ADC_INPUTCTRL_GAIN_DIV2;
+  while( ADC->STATUS.bit.SYNCBUSY );
+
+  PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+  PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+  DMAC->BASEADDR.reg = (uint32_t)&ana_desc;
+  DMAC->WRBADDR.reg = (uint32_t)&ana_desc_wb;
+  DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+  DMAC->CHID.reg = DMAC_CHID_ID(ANA_DMAC_CH);
+  DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+  while( DMAC->CHCTRLA.bit.SWRST );
+  DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGSRC(ADC_DMAC_ID_RESRDY) | DMAC_CHCTRLB_TRIGACT_BEAT;
+  ana_desc.BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_HWORD | DMAC_BTCTRL_DSTINC;
+  ana_desc.BTCNT.reg = ANA_OVERSAMPLE * ana_stride;
+  ana_desc.SRCADDR.reg = (uint32_t)&ADC->RESULT.reg;
+  ana_desc.DSTADDR.reg = (uint32_t)&ana_dma[ANA_OVERSAMPLE * ana_stride]; //End of the block
+  ana_desc.DESCADDR.reg = (uint32_t)&ana_desc;
+  DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+
+  ADC->CTRLA.bit.ENABLE = 1;
+  while( ADC->STATUS.bit.SYNCBUSY );
+  ADC->SWTRIG.bit.START = 1;
+}
+#elif defined(NATIVE_SIM)
+void ana_hw_begin() {
+  int pins[ana_count];
+
+  for( int i = 0; i < ana_count; i++ ) {
+    pins[i] = ana_state[i].def->pin;
+  }
+  sim_adc_begin(pins, ana_count, ana_dma, ANA_OVERSAMPLE * ana_count, ANA_CONV_US);
+}
+#endif
+
+//Oversampled value of a control, 0 to ANA_FULL - 1
+int32_t ana_sample(AnaState_t *state) {
+  int32_t sum = 0;
+
+  for( int i = state->slot; i < ANA_OVERSAMPLE * ana_stride; i += ana_stride ) {
+    sum += ana_dma[i];
+  }
+  return sum * (16 / ANA_OVERSAMPLE);
+}
+
+/***************************************************
+ * ana step
+ * Step of the filtered value, the one sent last while the value is
+ * within the deadband round it
+ */
+int16_t ana_step(AnaState_t *state) {
+  int32_t size = ANA_FULL / state->def->steps;
+  int16_t step = state->filt / size;
+
+  if( (state->step >= 0) && (step != state->step) &&
+      (state->filt >= state->step * size - ANA_DEADBAND(size)) &&
+      (state->filt < (state->step + 1) * size + ANA_DEADBAND(size)) ) {
+    return state->step;
+  }
+  return step;
+}
+
+/***************************************************
+ * analog process
+ * Scan tick, every ANA_PERIOD_MS: filter each control and send the
+ * ones that changed step
+ */
+void analog_process() {
+  AnaState_t *state;
+  KeyMap_t *k_map;
+  int16_t step;
+  int delta;
+  int room;
+
+  if( (uint32_t)(scan_ms - ana_last_ms) < ANA_PERIOD_MS ) {
+    return;
+  }
+  ana_last_ms = scan_ms;
+#if defined(NATIVE_SIM)
+  sim_adc_sync();
+#endif
+  for( int i = 0; i < ana_count; i++ ) {
+    state = &ana_state[i];
+    if( state->step < 0 ) {
+      state->filt = ana_sample(state); //Start where it rests, don't send it
+      state->step = ana_step(state);
+      continue;
+    }
+    state->filt += (ana_sample(state) - state->filt) >> ANA_IIR_SHIFT;
+    step = ana_step(state);
+    k_map = (KeyMap_t *)&state->def->map;
+    if( (step == state->step) || (out_backlog(KEYMAP_ROUTE(k_map)) >= OUT_BACKLOG_HIGH) ) {
+      continue;
+    }
+#if defined(USB_MIDI)
+    if( KEYMAP_ROUTE(k_map) == OUT_MIDI ) {
+      if( midi_cc(k_map->midi_ch, k_map->midi_cc, step) ) {
+        state->step = step;
+      }
+      continue;
+    }
+#endif
+    //No more keys than fit below OUT_BACKLOG_HIGH, the rest next pass
+    room = OUT_BACKLOG_HIGH - out_backlog(KEYMAP_ROUTE(k_map));
+    delta = constrain(step - state->step, -room, room);
+    state->step += delta;
+    for( ; delta > 0; delta-- ) {
+      COMBO_KEY(k_map->key_cw, k_map->mod1_enc, k_map->mod2_enc);
+    }
+    for( ; delta < 0; delta++ ) {
+      COMBO_KEY(k_map->key_ccw, k_map->mod1_enc, k_map->mod2_enc);
+    }
+  }
+}
+
+//A control would change step, for idle_sleep.h while the ticks are stopped
+boolean ana_moved() {
+#if defined(NATIVE_SIM)
+  sim_adc_sync();
+#endif
+  for( int i = 0; i < ana_count; i++ ) {
+    AnaState_t probe = ana_state[i];
+
+    probe.filt = ana_sample(&probe);
+    if( ana_step(&probe) != probe.step ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/***************************************************
+ * analog begin
+ * Dense table of the slots in use, then start the conversions
+ */
+void analog_begin() {
+  int n = 0;
+
+  for( unsigned i = 0; i < sizeof(ana_all) / sizeof(ana_all[0]); i++ ) {
+    if( ana_all[i].pin != PIN_NA ) {
+      ana_state[n].def = &ana_all[i];
+      ana_state[n].slot = n;
+      ana_state[n].step = -1;
+      n++;
+    }
+  }
+  ana_hw_begin();
+}
+
+#define ANALOG_BEGIN()    analog_begin()
+#define ANALOG_PROCESS()  analog_process()
+#define ANALOG_MOVED()    ana_moved()
+#else
+#define ANALOG_BEGIN()
+#define ANALOG_PROCESS()
+#define ANALOG_MOVED()    false
+#endif
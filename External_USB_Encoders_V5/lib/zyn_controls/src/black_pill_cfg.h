@@ -23,6 +23,23 @@
   Btn 3: PA13 c,shift,ctrl
   Btn 4: PB0  v,shift,ctrl
 
+  EXTI lines are shared by pin number across ports, so Enc 4 (PB6/PB7)
+  can't get edge interrupts next to Enc 1 (PA6/PA7) and is sampled
+  from loop() instead (see quad_decoder.h).
+
+  Port expanders (-D EXP_COUNT, see port_expander.h): MCP23017s on
+  I2C1, SCL PB8 and SDA PB9 with 4.7k pull-ups, and their INTA pins
+  together on PA5. PB9 is Enc 3's ground then, so its common goes to
+  GND. With -D EXP_SPI MCP23S17s take Enc 4's pins instead, SPI1
+  moved to SCK PB3, MISO PB4 and MOSI PB5 with CS on PB6; Enc 4 goes
+  onto an expander and PB7 is spare. INT stays on PA5.
+
+  Faders and pots (-D ANALOG_SCAN, see analog_scan.h): wipers on PB1
+  (ADC1 IN9) and PA5 (IN5), between 3.3V and GND. PA5 is the
+  expanders' INT when they are fitted. PA3 and PA4 (IN3, IN4) are
+  the power pins of Enc 2 and could take two more, with Enc 2 on the
+  3.3V and GND rails.
+
   ------
   Boot Switch Run mode - Normal encoders
   |SW1| ON  |
@@ -49,7 +66,6 @@
           -D PIO_FRAMEWORK_ARDUINO_ENABLE_HID
           -D USBCON
           -D HAL_PCD_MODULE_ENABLED
-        lib_deps = mprograms/SimpleRotary@^1.1.3
         upload_protocol = dfu
 */
 
@@ -68,26 +84,61 @@
 #define ENC0_SW   PA8
 #define ENC0_A    PA7
 #define ENC0_B    PA6
+#define ENC0_STEPS 4
 
 #define ENC1_GND  PA4
 #define ENC1_VCC  PA3
 #define ENC1_SW   PA2
 #define ENC1_A    PA1
 #define ENC1_B    PA0
+#define ENC1_STEPS 4
 
+#if EXP_COUNT && !defined(EXP_SPI)
+#define ENC2_GND  PIN_NA /* SDA */
+#else
 #define ENC2_GND  PB9
+#endif
 #define ENC2_VCC  PB10
 #define ENC2_SW   PB12
 #define ENC2_A    PB13
 #define ENC2_B    PB14
+#define ENC2_STEPS 4
 
+#if EXP_COUNT && defined(EXP_SPI)
+#define ENC3_GND  PIN_NA /* SPI1 */
+#define ENC3_VCC  PIN_NA
+#define ENC3_SW   PIN_NA
+#define ENC3_A    PIN_NA
+#define ENC3_B    PIN_NA
+#else
 #define ENC3_GND  PB3
 #define ENC3_VCC  PB4
 #define ENC3_SW   PB5
 #define ENC3_A    PB6
 #define ENC3_B    PB7
+#endif
+#define ENC3_STEPS 4
 
 #define SW0       PA15
 #define SW1       PA14
 #define SW2       PA13
 #define SW3       PB0
+
+//Port expanders
+#define EXP_INT   PA5
+#define EXP_SCL   PB8
+#define EXP_SDA   PB9
+#define EXP_SCK   PB3 /* EXP_SPI */
+#define EXP_MISO  PB4
+#define EXP_MOSI  PB5
+#define EXP_CS    PB6
+
+//Faders and pots
+#define ANA0      PB1
+#if EXP_COUNT
+#define ANA1      PIN_NA /* EXP_INT */
+#else
+#define ANA1      PA5
+#endif
+#define ANA2      PIN_NA
+#define ANA3      PIN_NA
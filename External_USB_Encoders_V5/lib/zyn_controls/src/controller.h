@@ -0,0 +1,31 @@
+/***************************************************************
+ * Controller firmware, first part
+ *
+ * The zyn_controls library is the whole firmware of the controller,
+ * header only, for PlatformIO (src/main.cpp of External_USB_Encoders_V5)
+ * and for Arduino IDE sketches (External_USB_Controller). A sketch
+ *  - sets its behavior flags (-D options, see platformio.ini)
+ *  - includes its board config (black_pill_cfg.h, mkzero_cfg.h, or
+ *    its own from hw_template_cfg.h)
+ *  - includes controller.h, which brings in the stages below
+ *  - lists its controls by hardware slot: enc_all[], btn_all[] and,
+ *    with ANALOG_SCAN, ana_all[] (ENCODER_DEF(), BUTTON_DEF(), ...)
+ *  - includes controller_main.h, which builds the control tables from
+ *    them and defines setup() and loop()
+ */
+#include "usb_device.h"
+#include "scan_profile.h"
+#include "port_expander.h"
+#include "port_scan.h"
+#include "scan_sched.h"
+#include "trace_log.h"
+#include "quad_decoder.h"
+#include "event_queue.h"
+#include "hid_output.h"
+#if( defined(USB_MIDI) )
+#include "midi_output.h"
+#endif
+#include "rate_governor.h"
+#include "encoder_helpers.h"
+#include "sw_gesture.h"
+#include "ctl_policy.h"
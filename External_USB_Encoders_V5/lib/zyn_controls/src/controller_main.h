@@ -0,0 +1,113 @@
+/***************************************************************
+ * Controller firmware, second part
+ *
+ * Include once the sketch has listed its controls, see controller.h.
+ * Defines setup() and loop().
+ */
+#include "controls.h"
+#include "analog_scan.h"
+#include "keymap_store.h"
+#include "usb_boot.h"
+#include "idle_sleep.h"
+
+/***************************************************
+ * scan controls
+ * Run by the scan scheduler after each sample, see scan_sched.h
+ */
+void scan_controls() {
+  TRACE_PORTS();
+  PROF_BEGIN(t_stage);
+
+  for( int i = 0; i < enc_count; i++ ) {
+    enc_table::ops[i]->process(&enc_state[i], &enc_table::maps[i]);
+  }
+  PROF_NEXT(PROF_ENCODERS, t_stage);
+
+  for( int i = 0; i < btn_count; i++ ) {
+    btn_table::ops[i](&btn_state[i], &btn_table::maps[i]);
+  }
+  PROF_END(PROF_BUTTONS, t_stage);
+
+#if defined(ENC_RATE_HZ)
+  //Rotation goes out after the switches, the encoders taking turns
+  for( int n = 0; n < enc_count; n++ ) {
+    int i = (gov_first + n) % enc_count;
+    encoder_flush(&enc_state[i], &enc_table::maps[i], enc_table::ops[i]);
+  }
+  gov_first = (gov_first + 1) % enc_count;
+#endif
+  ANALOG_PROCESS();
+}
+
+/***************************************************
+ * sample encoders
+ * SCAN_DMA only, decode the encoders from a buffered sample in which
+ * a control pin changed
+ */
+void sample_encoders() {
+  TRACE_PORTS();
+  for( int i = 0; i < enc_count; i++ ) {
+    quad_poll(&enc_state[i].quad);
+  }
+}
+
+/***************************************************
+ * setup
+ */
+void setup() {
+  // declare led pin to be an output:
+  if( led != PIN_NA) { 
+    pinMode(led, OUTPUT); 
+    digitalWrite(led,0); //Turn on the LED to indicate that we are running code, not bootloader
+  }
+
+  EXP_BEGIN(); //Expander levels, before the controls take their pins
+  controls_set_gpio();
+  ANALOG_BEGIN();
+  out_init();
+  TRACE_INIT(ctl_pin_mask);
+  keymap_init(); //Maps saved by the host replace the ones above
+
+  //Detect config for inverted rotation encoders
+  invert_encoders = default_invert;
+  if( pin_invert != PIN_NA ) {
+    pinMode(pin_invert, INPUT);
+    if( digitalRead(pin_invert) ) {
+      invert_encoders = true;
+    }
+  }
+  if( invert_encoders ) {
+      cw = 2;
+      ccw = 1;
+  }    
+
+  scan_begin(scan_controls, sample_encoders);
+
+  // initialize control over the keyboard, the controls are scanned
+  // while the host enumerates us and the LED blinks until it's done
+  usb_begin();
+  PROF_INIT();
+  boot_init();
+  idle_init();
+}
+
+/***************************************************
+ * loop
+ */
+void loop() {  
+  usb_service();
+  boot_service();
+  EXP_SERVICE(); //Read the expanders that interrupted
+  if( idle_service() ) {
+    return; //Asleep, see idle_sleep.h
+  }
+  PROF_BEGIN(t_loop);
+  scan_service(); //SCAN_IN_LOOP and SCAN_DMA only
+
+  PROF_BEGIN(t_stage);
+  out_flush();
+  PROF_END(PROF_OUTPUT, t_stage);
+  PROF_END(PROF_LOOP, t_loop);
+
+  keymap_service(idle_busy()); //Flash only written while nothing is going on
+}
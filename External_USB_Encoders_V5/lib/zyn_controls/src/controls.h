@@ -0,0 +1,142 @@
+/***************************************************************
+ * Controller model
+ *
+ * Include after main.cpp has listed its controls by hardware slot:
+ *   constexpr EncDef_t enc_all[] = { ENCODER_DEF(ENC0, ...), ... };
+ *   constexpr BtnDef_t btn_all[] = { BUTTON_DEF(SW0, ...), ... };
+ * Slots the board config leaves at PIN_NA (encoder A, button pin) are
+ * dropped at compile time. What remains becomes dense tables indexed
+ * 0..enc_count-1 and 0..btn_count-1: pins, ISR trampolines and the
+ * default keymaps in flash, the active keymaps (keymap_store.h), the
+ * policies they pick (ctl_policy.h) and run time state in contiguous
+ * RAM arrays. loop()
+ * then walks each array once, with no per pass PIN_NA checks, and
+ * the cost per control doesn't depend on how many a board has.
+ *
+ * The policy tables (ops) are rewritten by ctl_bind() when the host
+ * reprograms the maps. -D KEYMAP_FIXED builds have no keymap store,
+ * there the tables are const and every call target is known when
+ * the firmware is compiled.
+ */
+
+/**************************************************************
+ * Compile time helpers (C++11, the SAMD core builds with gnu++11)
+ */
+template<int... I> struct ctl_seq {};
+template<int N, int... I> struct ctl_make_seq : ctl_make_seq<N - 1, N - 1, I...> {};
+template<int... I> struct ctl_make_seq<0, I...> { typedef ctl_seq<I...> type; };
+
+constexpr int ctl_used(const EncDef_t &def) {
+  return def.pins.a != PIN_NA;
+}
+
+constexpr int ctl_used(const BtnDef_t &def) {
+  return def.pin != PIN_NA;
+}
+
+//Number of slots in use
+template<typename T, int N>
+constexpr int ctl_count(const T (&defs)[N], int i = 0) {
+  return (i >= N) ? 0 : ctl_used(defs[i]) + ctl_count(defs, i + 1);
+}
+
+//Slot of the n-th control in use
+template<typename T, int N>
+constexpr int ctl_slot(const T (&defs)[N], int n, int i = 0) {
+  return !ctl_used(defs[i]) ? ctl_slot(defs, n, i + 1) : (n ? ctl_slot(defs, n - 1, i + 1) : i);
+}
+
+#if defined(KEYMAP_FIXED)
+#define CTL_OPS const  /* Policies never rebound */
+#else
+#define CTL_OPS
+#endif
+
+/**************************************************************
+ * Global Variables
+ */
+constexpr int enc_count = ctl_count(enc_all);
+constexpr int btn_count = ctl_count(btn_all);
+
+EncState_t enc_state[enc_count];
+SwitchState_t btn_state[btn_count];
+uint32_t ctl_pin_mask[PORT_COUNT]; //Pins of all controls, by port
+QuadStats_t quad_stats[enc_count];  //DIAG_OBJ_ENC_STATS
+
+template<int N> void enc_isr(void) {
+  TRACE_PORTS();
+  quad_isr(&enc_state[N].quad);
+}
+
+template<typename S> struct EncTable;
+template<int... I> struct EncTable< ctl_seq<I...> > {
+  static const EncPins_t pins[];
+  static void (*const isr[])(void);
+  static const KeyMap_t defaults[];
+  static KeyMap_t maps[];
+  static const EncOps_t *CTL_OPS ops[];
+};
+template<int... I> const EncPins_t EncTable< ctl_seq<I...> >::pins[] = { enc_all[ctl_slot(enc_all, I)].pins... };
+template<int... I> void (*const EncTable< ctl_seq<I...> >::isr[])(void) = { enc_isr<I>... };
+template<int... I> const KeyMap_t EncTable< ctl_seq<I...> >::defaults[] = { enc_all[ctl_slot(enc_all, I)].map... };
+template<int... I> KeyMap_t EncTable< ctl_seq<I...> >::maps[] = { enc_all[ctl_slot(enc_all, I)].map... };
+template<int... I> const EncOps_t *CTL_OPS EncTable< ctl_seq<I...> >::ops[] = { enc_policy(enc_all[ctl_slot(enc_all, I)].map)... };
+
+template<typename S> struct BtnTable;
+template<int... I> struct BtnTable< ctl_seq<I...> > {
+  static const int pins[];
+  static const KeyMap_t defaults[];
+  static KeyMap_t maps[];
+  static CTL_OPS BtnOp_t ops[];
+};
+template<int... I> const int BtnTable< ctl_seq<I...> >::pins[] = { btn_all[ctl_slot(btn_all, I)].pin... };
+template<int... I> const KeyMap_t BtnTable< ctl_seq<I...> >::defaults[] = { btn_all[ctl_slot(btn_all, I)].map... };
+template<int... I> KeyMap_t BtnTable< ctl_seq<I...> >::maps[] = { btn_all[ctl_slot(btn_all, I)].map... };
+template<int... I> CTL_OPS BtnOp_t BtnTable< ctl_seq<I...> >::ops[] = { btn_policy(btn_all[ctl_slot(btn_all, I)].map)... };
+
+typedef EncTable< ctl_make_seq<enc_count>::type > enc_table;
+typedef BtnTable< ctl_make_seq<btn_count>::type > btn_table;
+
+/******************************************************************
+ * Procedures
+ */
+void quad_command(byte cmd) {
+  if( cmd == DIAG_CMD_RESET ) {
+    noInterrupts();
+    memset(quad_stats, 0, sizeof(quad_stats));
+    interrupts();
+  }
+}
+
+void controls_set_gpio() {
+  for( int i = 0; i < enc_count; i++ ) {
+    enc_state[i].quad.stats = &quad_stats[i];
+    encoder_set_gpio(&enc_state[i], &enc_table::pins[i], enc_table::isr[i]);
+  }
+  for( int i = 0; i < btn_count; i++ ) {
+    button_set_gpio(&btn_state[i], btn_table::pins[i]);
+  }
+  for( byte p = 0; p < PORT_COUNT; p++ ) {
+    ctl_pin_mask[p] = port_used[p]; //The switches
+  }
+  for( int i = 0; i < enc_count; i++ ) {
+    ctl_pin_mask[enc_state[i].quad.port_a.port] |= enc_state[i].quad.port_a.mask;
+    ctl_pin_mask[enc_state[i].quad.port_b.port] |= enc_state[i].quad.port_b.mask;
+  }
+  diag_register(DIAG_OBJ_ENC_STATS, quad_stats, sizeof(quad_stats), false, quad_command);
+}
+
+#if !defined(KEYMAP_FIXED)
+/***************************************************
+ * ctl bind
+ * Policies of the active maps, after they changed
+ */
+void ctl_bind() {
+  for( int i = 0; i < enc_count; i++ ) {
+    enc_table::ops[i] = enc_policy(enc_table::maps[i]);
+  }
+  for( int i = 0; i < btn_count; i++ ) {
+    btn_table::ops[i] = btn_policy(btn_table::maps[i]);
+  }
+}
+#endif
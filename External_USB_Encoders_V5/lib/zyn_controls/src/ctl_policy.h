@@ -0,0 +1,186 @@
+/***************************************************************
+ * Control policies
+ *
+ * What a switch does and how rotation goes out are policies, structs
+ * of static members that the per control code takes as template
+ * parameters:
+ *   switch    SwClassify  short/bold/long by hold time, on release (legacy)
+ *             SwKey       key down on press, key up on release (V5)
+ *             SwGesture   taps and hold by the map's times (sw_gesture.h)
+ *             SwMidi      note on/off, or CC 127/0 (USB_MIDI)
+ *   rotation  EmitKeys    a key with mod1_enc/mod2_enc per step
+ *             EmitMidi    one relative CC per pass (USB_MIDI)
+ * encoder_step<Sw, Emit>() is built for each pair in use, so the scan
+ * tick calls every control through a pointer to code with its
+ * behavior compiled in, without testing a mode or route per pass, and
+ * a table can mix controls of every kind: ENCODER_DEF (legacy) next to
+ * ENCODER_DEF_V5 next to ENCODER_DEF_MIDI.
+ *
+ * The policies of a control follow its map, sw_mode and midi_ch. They
+ * are picked at compile time for the maps built in (controls.h) and
+ * again by ctl_bind() when keymap_store.h loads or the host rewrites
+ * the maps, so a change of mode or route by the host still takes
+ * effect at once. -D KEYMAP_FIXED builds never rebind, their tables
+ * are const.
+ */
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct EncOps_s {
+  void (*process)(EncState_t *state, KeyMap_t *k_map); //Once per scan tick
+  void (*send)(QuadEnc_t *quad, KeyMap_t *k_map, int enc); //Queue steps, +ve = cw
+  byte route;
+}EncOps_t;
+
+typedef void (*BtnOp_t)(SwitchState_t *state, KeyMap_t *b_map);
+
+/******************************************************************
+ * Switch policies
+ */
+struct SwClassify {
+  static void process(SwitchState_t *state, KeyMap_t *k_map) {
+    int sw = btn_pushTime(state);
+    press_process(k_map, sw, &state->pending, &state->long_press);
+  }
+};
+
+struct SwKey {
+  static void process(SwitchState_t *state, KeyMap_t *k_map) {
+    press_key(k_map, state);
+  }
+};
+
+struct SwGesture {
+  static void process(SwitchState_t *state, KeyMap_t *k_map) {
+    press_gesture(k_map, state);
+  }
+};
+
+#if defined(USB_MIDI)
+struct SwMidi {
+  static void process(SwitchState_t *state, KeyMap_t *k_map) {
+    press_midi(k_map, state);
+  }
+};
+#endif
+
+/******************************************************************
+ * Rotation policies
+ */
+struct EmitKeys {
+  static const byte route = OUT_KBD;
+  static void send(KeyMap_t *k_map, int enc) {
+    for( ; enc > 0; enc-- )
+    {
+      COMBO_KEY(k_map->key_cw,k_map->mod1_enc,k_map->mod2_enc);
+    }
+    for( ; enc < 0; enc++ )
+    {
+      COMBO_KEY(k_map->key_ccw,k_map->mod1_enc,k_map->mod2_enc);
+    }
+  }
+};
+
+#if defined(USB_MIDI)
+struct EmitMidi {
+  static const byte route = OUT_MIDI;
+  static void send(KeyMap_t *k_map, int enc) {
+    //The whole turn goes in one relative CC
+    midi_cc_relative(k_map->midi_ch, k_map->midi_cc, enc, k_map->midi_flags);
+  }
+};
+#endif
+
+/******************************************************************
+ * Procedures
+ */
+/***************************************************
+ * encoder send
+ * Queue enc steps (+ve = cw) the way Emit does
+ */
+template<class Emit> void encoder_send(QuadEnc_t *quad, KeyMap_t *k_map, int enc) {
+  (void)quad; //Only SCAN_PROFILE builds time the latency from it
+  if( !enc ) {
+    return;
+  }
+  Emit::send(k_map, enc);
+  PROF_END(PROF_LATENCY_ID, quad->edge_cycles);
+}
+
+/***************************************************
+ * encoder step
+ * Read and handle input from the encoder
+ */
+template<class Sw, class Emit> void encoder_step(EncState_t *state, KeyMap_t *k_map) {
+  QuadEnc_t *quad = &state->quad;
+  uint16_t interval;
+  int enc;
+
+  //Collect data out of the encoder, rotation was counted by the ISR
+  //and is left there while the output stage is backed up, or with
+  //ENC_RATE_HZ held back and netted by the governor instead
+  quad_poll(quad);
+  enc = 0;
+#if defined(ENC_RATE_HZ)
+  enc = quad_drain_timed(quad, &interval);
+  enc = encoder_accel(k_map, enc, interval);
+#else
+  if( out_backlog(Emit::route) < OUT_BACKLOG_HIGH ) {
+    enc = quad_drain_timed(quad, &interval);
+    enc = encoder_accel(k_map, enc, interval);
+  }
+#endif
+  if( cw != 1 ) {
+    enc = -enc; //Inverted encoders
+  }
+
+#if defined(ENC_RATE_HZ)
+  gov_add(&state->gov, enc, GOV_MAX(Emit::route));
+#else
+  encoder_send<Emit>(quad, k_map, enc);
+#endif
+  Sw::process(&state->sw, k_map);
+}
+
+#if defined(ENC_RATE_HZ)
+/***************************************************
+ * encoder flush
+ * Send the net steps the governor let through, after the switches
+ */
+void encoder_flush(EncState_t *state, KeyMap_t *k_map, const EncOps_t *ops) {
+  ops->send(&state->quad, k_map, gov_take(&state->gov, ops->route));
+}
+#endif
+
+template<class Sw, class Emit> struct EncPolicy {
+  static const EncOps_t ops;
+};
+template<class Sw, class Emit> const EncOps_t EncPolicy<Sw, Emit>::ops = { encoder_step<Sw, Emit>, encoder_send<Emit>, Emit::route };
+
+/***************************************************
+ * enc policy / btn policy
+ * The policies of a map, usable in constant expressions
+ */
+#if defined(USB_MIDI)
+constexpr const EncOps_t *enc_policy(const KeyMap_t &map) {
+  return map.midi_ch ? &EncPolicy<SwMidi, EmitMidi>::ops :
+         (map.sw_mode == SW_KEY) ? &EncPolicy<SwKey, EmitKeys>::ops :
+         (map.sw_mode == SW_GESTURE) ? &EncPolicy<SwGesture, EmitKeys>::ops : &EncPolicy<SwClassify, EmitKeys>::ops;
+}
+
+constexpr BtnOp_t btn_policy(const KeyMap_t &map) {
+  return map.midi_ch ? SwMidi::process : (map.sw_mode == SW_KEY) ? SwKey::process :
+         (map.sw_mode == SW_GESTURE) ? SwGesture::process : SwClassify::process;
+}
+#else
+constexpr const EncOps_t *enc_policy(const KeyMap_t &map) {
+  return (map.sw_mode == SW_KEY) ? &EncPolicy<SwKey, EmitKeys>::ops :
+         (map.sw_mode == SW_GESTURE) ? &EncPolicy<SwGesture, EmitKeys>::ops : &EncPolicy<SwClassify, EmitKeys>::ops;
+}
+
+constexpr BtnOp_t btn_policy(const KeyMap_t &map) {
+  return (map.sw_mode == SW_KEY) ? SwKey::process :
+         (map.sw_mode == SW_GESTURE) ? SwGesture::process : SwClassify::process;
+}
+#endif
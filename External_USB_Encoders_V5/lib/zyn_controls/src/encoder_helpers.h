@@ -0,0 +1,322 @@
+/***************************************************************
+ * Constatnts
+ */
+#define KEY_NONE 0x0
+
+//Switch press times in ms according to the zynthian UI Users Guide
+#define sw_short 1
+#define sw_bold  300
+#define sw_long  2000
+
+//Switch modes, KeyMap_t sw_mode
+#define SW_CLASSIFY 0 /* Short/bold/long by hold time, sent on release */
+#define SW_KEY      1 /* Key down on press, key up on release */
+#define SW_GESTURE  2 /* Taps and hold by the map's own times, see sw_gesture.h */
+
+#define PIN_NA   999 /* Indicate HW pin not used */
+
+//Encoder acceleration, accel_max steps per detent at most, 1 is off
+#define accel_off 1
+#define accel_max_steps 16
+/**************************************************************
+ * Typedefs
+ */
+typedef struct KeyMap_s {
+  char key_cw;
+  char key_ccw;
+  char mod1_enc;
+  char mod2_enc;
+  char key_switch;
+  char mod_short;
+  char mod_bold;
+  char mod_long;
+  byte accel_max;  //Steps per detent at full speed, 1 = no acceleration
+  byte accel_ms;   //Detents further apart than this (ms) stay 1:1
+  byte midi_ch;    //USB_MIDI: channel 1-16 sends MIDI, 0 sends keys
+  byte midi_cc;    //Relative CC sent by the encoder
+  byte midi_sw;    //Note (or CC with MIDI_SW_CC) sent by the switch
+  byte midi_flags; //MIDI_REL_64, MIDI_SW_CC, see midi_output.h
+  byte sw_mode;    //SW_CLASSIFY, SW_KEY (held with mod_short) or SW_GESTURE
+  char key_hold;   //SW_GESTURE: repeated while held, KEY_NONE for the tap key
+  byte gest_taps;  //SW_GESTURE: taps told apart, 1-3
+  byte gest_tap;   //SW_GESTURE: most time between taps, 10ms units
+  byte gest_hold;  //SW_GESTURE: press time that makes a hold, 10ms units, 0 none
+  byte gest_repeat;//SW_GESTURE: repeat of the hold key, 10ms units, 0 once
+}KeyMap_t;
+
+typedef struct EncPins_s {
+  int gnd;
+  int vcc;
+  int sw;
+  int a;
+  int b;
+  byte steps;  //Transitions per detent, see quad_decoder.h
+}EncPins_t;
+
+//Compile time definitions, see controls.h
+typedef struct EncDef_s {
+  EncPins_t pins;
+  KeyMap_t map;
+}EncDef_t;
+
+typedef struct BtnDef_s {
+  int pin;
+  KeyMap_t map;
+}BtnDef_t;
+
+//Faders and pots, see analog_scan.h
+typedef struct AnaDef_s {
+  int pin;
+  uint16_t steps;  //Steps over the travel, 128 for MIDI
+  KeyMap_t map;    //key_cw up, key_ccw down, mod1_enc and mod2_enc held, or midi_ch and midi_cc
+}AnaDef_t;
+
+//Run time state
+typedef struct SwitchState_s {
+  PortPin_t pin;
+  uint32_t start;     //scan_ms when pressed
+  int pending;        //Time held as of the last pass
+  boolean long_press; //Long press already sent
+  boolean down;       //Seen pressed
+  boolean held;       //SW_KEY and MIDI: key down, note on (CC 127) queued, its release not yet
+  byte gesture;       //SW_GESTURE state
+  byte taps;          //SW_GESTURE taps so far
+  uint32_t deadline;  //SW_GESTURE scan_ms the state runs out
+}SwitchState_t;
+
+typedef struct EncState_s {
+  QuadEnc_t quad;
+  SwitchState_t sw;
+  GovState_t gov;  //ENC_RATE_HZ, see rate_governor.h
+}EncState_t;
+
+/**************************************************************
+ * Global Variables
+ */
+byte cw = 1;
+byte ccw = 2;
+boolean invert_encoders = false;
+
+/**************************************************************
+ * Macros
+ * Controls are listed by hardware slot, the board config provides
+ * the pins of each slot (ENC0_A, SW0, ...). See controls.h.
+ */
+#define ENCODER_DEF(slot, enc_cw, enc_ccw, enc_mod1, enc_mod2, enc_sw, short_mod, bold_mod, long_mod ) \
+        ENCODER_DEF_ACCEL(slot, enc_cw, enc_ccw, enc_mod1, enc_mod2, enc_sw, short_mod, bold_mod, long_mod, accel_off, 0 )
+
+//Encoders (also uses 2 GPIO pins per for GND/V+) and skip a pin to allow for JST style connectors?
+#define ENCODER_DEF_ACCEL(slot, enc_cw, enc_ccw, enc_mod1, enc_mod2, enc_sw, short_mod, bold_mod, long_mod, enc_accel_max, enc_accel_ms ) \
+        { { slot##_GND, slot##_VCC, slot##_SW, slot##_A, slot##_B, slot##_STEPS }, \
+          { enc_cw, enc_ccw, enc_mod1, enc_mod2, enc_sw, short_mod, bold_mod, long_mod, enc_accel_max, enc_accel_ms, 0, 0, 0, 0, SW_CLASSIFY, KEY_NONE, 0, 0, 0, 0 } }
+
+//V5 encoders, the switch key goes down and up with the switch
+#define ENCODER_DEF_V5(slot, enc_cw, enc_ccw, enc_mod1, enc_mod2, enc_sw, enc_accel_max, enc_accel_ms ) \
+        { { slot##_GND, slot##_VCC, slot##_SW, slot##_A, slot##_B, slot##_STEPS }, \
+          { enc_cw, enc_ccw, enc_mod1, enc_mod2, enc_sw, KEY_NONE, KEY_NONE, KEY_NONE, enc_accel_max, enc_accel_ms, 0, 0, 0, 0, SW_KEY, KEY_NONE, 0, 0, 0, 0 } }
+
+//V5 encoders with the switch taps and hold of BUTTON_DEF_GESTURE
+#define ENCODER_DEF_GESTURE(slot, enc_cw, enc_ccw, enc_mod1, enc_mod2, enc_sw, tap1_mod, tap2_mod, tap3_mod, hold_key, taps, tap_ms, hold_ms, repeat_ms, enc_accel_max, enc_accel_ms ) \
+        { { slot##_GND, slot##_VCC, slot##_SW, slot##_A, slot##_B, slot##_STEPS }, \
+          { enc_cw, enc_ccw, enc_mod1, enc_mod2, enc_sw, tap1_mod, tap2_mod, tap3_mod, enc_accel_max, enc_accel_ms, 0, 0, 0, 0, SW_GESTURE, \
+            hold_key, taps, (tap_ms) / 10, (hold_ms) / 10, (repeat_ms) / 10 } }
+
+//MIDI encoders (USB_MIDI builds), relative CC on channel ch and a note or CC on the switch
+#define ENCODER_DEF_MIDI(slot, ch, enc_cc, sw_num, flags, enc_accel_max, enc_accel_ms ) \
+        { { slot##_GND, slot##_VCC, slot##_SW, slot##_A, slot##_B, slot##_STEPS }, \
+          { 0, 0, 0, 0, 0, 0, 0, 0, enc_accel_max, enc_accel_ms, ch, enc_cc, sw_num, flags, SW_KEY, KEY_NONE, 0, 0, 0, 0 } }
+
+//Encoder n (0-4) of port expander chip, see port_expander.h, the switch
+//key goes down and up with the switch, held with enc_mod
+#define ENCODER_DEF_EXP(chip, n, enc_cw, enc_ccw, enc_mod, enc_sw, enc_accel_max, enc_accel_ms ) \
+        { { PIN_NA, PIN_NA, EXP_ENC_PIN(chip, 3 * (n) + 2), EXP_ENC_PIN(chip, 3 * (n)), EXP_ENC_PIN(chip, 3 * (n) + 1), QUAD_STEPS_PER_DETENT }, \
+          { enc_cw, enc_ccw, enc_mod, KEY_NONE, enc_sw, enc_mod, KEY_NONE, KEY_NONE, enc_accel_max, enc_accel_ms, 0, 0, 0, 0, SW_KEY, KEY_NONE, 0, 0, 0, 0 } }
+
+#define ENCODER_DEF_EXP_MIDI(chip, n, ch, enc_cc, sw_num, flags, enc_accel_max, enc_accel_ms ) \
+        { { PIN_NA, PIN_NA, EXP_ENC_PIN(chip, 3 * (n) + 2), EXP_ENC_PIN(chip, 3 * (n)), EXP_ENC_PIN(chip, 3 * (n) + 1), QUAD_STEPS_PER_DETENT }, \
+          { 0, 0, 0, 0, 0, 0, 0, 0, enc_accel_max, enc_accel_ms, ch, enc_cc, sw_num, flags, SW_KEY, KEY_NONE, 0, 0, 0, 0 } }
+
+//Front panel buttons
+#define BUTTON_DEF(slot, btn_sw, short_mod, bold_mod, long_mod) \
+        { slot, { 0, 0, 0, 0, btn_sw, short_mod, bold_mod, long_mod, accel_off, 0, 0, 0, 0, 0, SW_CLASSIFY, KEY_NONE, 0, 0, 0, 0 } }
+
+#define BUTTON_DEF_KEY(slot, btn_sw, held_mod) \
+        { slot, { 0, 0, 0, 0, btn_sw, held_mod, KEY_NONE, KEY_NONE, accel_off, 0, 0, 0, 0, 0, SW_KEY, KEY_NONE, 0, 0, 0, 0 } }
+
+//Front panel buttons, key_sw with tap1_mod on a tap, tap2_mod on a double
+//and tap3_mod on a triple tap, hold_key repeated while held (sw_gesture.h)
+#define BUTTON_DEF_GESTURE(slot, btn_sw, tap1_mod, tap2_mod, tap3_mod, hold_key, taps, tap_ms, hold_ms, repeat_ms) \
+        { slot, { 0, 0, 0, 0, btn_sw, tap1_mod, tap2_mod, tap3_mod, accel_off, 0, 0, 0, 0, 0, SW_GESTURE, \
+                  hold_key, taps, (tap_ms) / 10, (hold_ms) / 10, (repeat_ms) / 10 } }
+
+#define BUTTON_DEF_MIDI(slot, ch, sw_num, flags) \
+        { slot, { 0, 0, 0, 0, 0, 0, 0, 0, accel_off, 0, ch, 0, sw_num, flags, SW_KEY, KEY_NONE, 0, 0, 0, 0 } }
+
+//Faders and pots, absolute CC 0-127 on channel ch
+#define ANALOG_DEF_MIDI(slot, ch, cc) \
+        { slot, 128, { 0, 0, 0, 0, 0, 0, 0, 0, accel_off, 0, ch, cc, 0, 0, SW_KEY, KEY_NONE, 0, 0, 0, 0 } }
+
+//Faders and pots, the up or down key once per step of steps over the travel
+#define ANALOG_DEF_KEY(slot, key_up, key_down, mod1, mod2, steps) \
+        { slot, steps, { key_up, key_down, mod1, mod2, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, accel_off, 0, 0, 0, 0, 0, SW_KEY, KEY_NONE, 0, 0, 0, 0 } }
+
+/* Keys are queued to the HID output stage, see hid_output.h */
+/* If Caps lock, repress to make sure it's "released" for for other keys */
+#define COMBO_KEY(key,mod1, mod2) { hid_combo(HID_TAP,key,mod1,mod2); if((mod1 == KEY_CAPS_LOCK)||(mod2 == KEY_CAPS_LOCK)){ hid_combo(HID_TAP,KEY_CAPS_LOCK,KEY_NONE,KEY_NONE); } }while(0)
+#define COMBO_PRESS(key,mod1,mod2) hid_combo(HID_DOWN,key,mod1,mod2)
+#define COMBO_RELEASE(key,mod1,mod2) hid_combo(HID_UP,key,mod1,mod2)
+
+/* Output interface of an input, a map with a MIDI channel goes to MIDI */
+#if defined(USB_MIDI)
+#define KEYMAP_ROUTE(k_map) ( (k_map)->midi_ch ? OUT_MIDI : OUT_KBD )
+#else
+#define KEYMAP_ROUTE(k_map) OUT_KBD
+#endif
+
+void press_key(KeyMap_t *k_map, SwitchState_t *state);
+void press_process(KeyMap_t *k_map, int sw, int * sw_pending, boolean * long_press);
+void press_midi(KeyMap_t *k_map, SwitchState_t *state);
+
+/******************************************************************
+ * Procedures
+ */
+int btn_pushTime(SwitchState_t *state) { 
+  uint32_t now = scan_ms; //One time for the whole tick, wraps safely
+  int sw = 0;
+  if( port_pressed(&state->pin) ) {
+    if( !state->down ) {
+      state->down = true;
+      state->start = now; //starting tick of button press
+    }
+    sw = now - state->start;
+  }else
+  {
+    //button was released. calculate elapsed time
+    if( state->down ){
+      state->down = false;
+      sw = now - state->start;
+    }
+  }
+  return sw;
+}
+/***************************************************
+ * encoder accel
+ * Turn detents into steps by rotation speed, interval being the
+ * average time per detent over those drained (quad_drain_timed()), so
+ * one quick detent at the end of a slow turn doesn't scale all of it.
+ * Detents further apart than accel_ms stay 1:1, faster ones ramp
+ * linearly up to accel_max.
+ */
+int encoder_accel(KeyMap_t *k_map, int enc, uint16_t interval) {
+  int mult;
+
+  if( (k_map->accel_max <= 1) || (interval >= k_map->accel_ms) ) {
+    return enc;
+  }
+  mult = 1 + ((k_map->accel_max - 1) * (k_map->accel_ms - interval)) / k_map->accel_ms;
+  if( mult > accel_max_steps ) {
+    mult = accel_max_steps;
+  }
+  return enc * mult;
+}
+
+/***************************************************
+ * encoder set gpio
+ * Power pins, inputs, decoder and switch of one encoder
+ */
+void encoder_set_gpio(EncState_t *state, const EncPins_t *pins, void (*isr)(void)) {
+  if( pins->gnd != PIN_NA ) {
+    pinMode(pins->gnd, OUTPUT);
+    digitalWrite(pins->gnd, 0);
+  }
+  if( pins->vcc != PIN_NA ) {
+    pinMode(pins->vcc, OUTPUT);
+    digitalWrite(pins->vcc, 1);
+  }
+  port_pin_mode(pins->a, INPUT);
+  port_pin_mode(pins->b, INPUT);
+  if( pins->sw != PIN_NA ) {
+    port_pin_mode(pins->sw, INPUT);
+  }
+  state->quad.pin_a = pins->a;
+  state->quad.pin_b = pins->b;
+  state->quad.step_detent = pins->steps;
+  quad_attach(&state->quad, isr);
+  state->sw.pin = port_add(pins->sw, r_polarity == HIGH);
+}
+
+void button_set_gpio(SwitchState_t *state, int pin) {
+  port_pin_mode(pin, INPUT_PULLUP);
+  state->pin = port_add(pin, true);
+}
+
+/************************************************************************
+ * press_key ( map, switch )
+ * Key down on the debounced press, key up on the release, so the host
+ * times the hold itself. mod_short is held with the key.
+ */
+void press_key(KeyMap_t *k_map, SwitchState_t *state) {
+  boolean down = port_pressed(&state->pin);
+
+  if( down && !state->down && !state->held ) {
+    state->held = COMBO_PRESS(k_map->key_switch, k_map->mod_short, KEY_NONE);
+  }
+  state->down = down;
+  //A release that found the queue full goes on the next tick
+  if( !down && state->held ) {
+    state->held = !COMBO_RELEASE(k_map->key_switch, k_map->mod_short, KEY_NONE);
+  }
+}
+
+/************************************************************************
+ * press_process ( map, current, elapsed, long_press)
+ */
+void press_process(KeyMap_t *k_map, int sw, int * sw_pending, boolean * long_press) {
+    
+  /********** Long press, does not require release ***************/
+  if( *sw_pending > sw_long && !*long_press ) {
+    COMBO_KEY(k_map->key_switch, k_map->mod_long, KEY_NONE);
+    *long_press = true;
+  }
+
+  if ( !sw && *sw_pending )
+  {
+    //Button is released, what was its longest value?
+    if( *sw_pending > sw_long ) {
+      *long_press = false; //Already sent the keys, just clear the event
+    }else if ( *sw_pending > sw_bold ) {
+      /************ Bold Press ************/
+    COMBO_KEY(k_map->key_switch, k_map->mod_bold, KEY_NONE);
+    }else if ( *sw_pending > sw_short) {
+      /*********** Short Press ************/
+    COMBO_KEY(k_map->key_switch, k_map->mod_short, KEY_NONE);
+    }
+  }
+  *sw_pending = sw;
+}
+
+#if defined(USB_MIDI)
+/************************************************************************
+ * press_midi ( map, switch )
+ * Note on when pressed and off when released, or CC 127/0 with MIDI_SW_CC
+ */
+boolean midi_switch(KeyMap_t *k_map, boolean on) {
+  if( k_map->midi_flags & MIDI_SW_CC ) {
+    return midi_cc(k_map->midi_ch, k_map->midi_sw, on ? 127 : 0);
+  }
+  return midi_note(k_map->midi_ch, k_map->midi_sw, on);
+}
+
+void press_midi(KeyMap_t *k_map, SwitchState_t *state) {
+  boolean down = port_pressed(&state->pin);
+
+  if( down && !state->down && !state->held ) {
+    state->held = midi_switch(k_map, true);
+  }
+  state->down = down;
+  //A note off that found the queue full goes on the next tick
+  if( !down && state->held ) {
+    state->held = !midi_switch(k_map, false);
+  }
+}
+#endif
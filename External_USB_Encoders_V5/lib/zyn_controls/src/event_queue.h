@@ -0,0 +1,242 @@
+/***************************************************************
+ * Output event queue
+ *
+ * Keystrokes for the keyboard interface and event packets for the
+ * MIDI interface (USB_MIDI builds) wait here in one queue, in the
+ * order the inputs made them. Each event carries the route of the
+ * input map it came from and each output stage takes its own events
+ * out, oldest first, skipping the others. A keyboard report waiting
+ * for its poll slot doesn't hold MIDI back nor the other way round;
+ * the slots they leave behind are reclaimed once the older events in
+ * front of them are taken.
+ *
+ * Events are pushed from the scan tick interrupt (scan_sched.h) and
+ * taken by loop(), which changes the queue under SCAN_LOCK only. Each
+ * is stamped with clock_us() when pushed. A full queue never waits:
+ * while the host hasn't configured us, or has suspended the bus, the
+ * oldest event makes room, otherwise the new one is counted in
+ * out_stats.overflow and dropped (the encoders and faders stop at
+ * OUT_BACKLOG_HIGH, well before that, switches use the room above).
+ *
+ * Releases, a key up or a note off, are never dropped: the host would
+ * keep the key or note on for good. The last OUT_RESERVE slots take
+ * nothing else, no release makes room for another event, and
+ * out_push() says when an event didn't fit, so a switch whose release
+ * doesn't fit tries again on the next tick (press_key()). A press
+ * that didn't fit gets no release.
+ * out_discard() empties it of all but releases, for usb_boot.h, which
+ * also drops presses gone stale while the host was away.
+ *
+ * The counters, the deepest backlog and a histogram of the time events
+ * waited to be sent are diagnostic object DIAG_OBJ_QUEUE, read by
+ * tools/zyn_diag.py queue and tools/bench.py.
+ */
+#define OUT_QUEUE_LEN     64    /* Events, power of 2 */
+#define OUT_BACKLOG_HIGH  (OUT_QUEUE_LEN / 2) /* Per route */
+#define OUT_RESERVE       (OUT_QUEUE_LEN / 4) /* Slots for releases only */
+
+//Routes
+#define OUT_KBD    0
+#define OUT_MIDI   1
+#define OUT_ROUTES 2
+#define OUT_TAKEN  0xFF /* Taken by its output stage, slot not yet reclaimed */
+
+#define OUT_WAIT_BINS 8  /* Wait histogram, bin n < 2^n ms, the last one open */
+
+//HidEvent_t action
+#define HID_TAP   0 /* Press and release */
+#define HID_DOWN  1 /* Press and hold */
+#define HID_UP    2 /* Release a held key */
+
+//MidiEvent_t header, Code Index Numbers; the high nibble is the cable
+#define MIDI_CIN_NOTE_OFF 0x8
+#define MIDI_CIN_NOTE_ON  0x9
+#define MIDI_CIN_CC       0xB
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct HidEvent_s {
+  byte action;  //HID_TAP, HID_DOWN or HID_UP
+  byte mods;    //Modifier bits
+  byte usage;   //Key usage, 0 for none
+  byte usage2;  //Non modifier keys used as modifiers (Caps Lock), 0 for none
+  byte usage3;
+}HidEvent_t;
+
+typedef struct MidiEvent_s {
+  byte header;  //Cable << 4 | CIN
+  byte status;
+  byte data1;
+  byte data2;
+}MidiEvent_t;
+
+typedef struct OutEvent_s {
+  uint32_t t_us; //clock_us() when queued, low 32 bits
+  byte route;   //OUT_KBD, OUT_MIDI or OUT_TAKEN, next to the event to keep it 12 bytes
+  union {
+    HidEvent_t hid;
+    MidiEvent_t midi;
+  };
+}OutEvent_t;
+
+typedef struct OutStats_s {
+  uint32_t pushed;
+  uint32_t sent;         //Taken by the output stages
+  uint32_t dropped;      //Dropped while the host was away
+  uint32_t overflow;     //Dropped with the queue full
+  uint32_t backlog_max;  //Most slots in use at once
+  uint32_t wait_max_us;  //Longest time from queued to sent
+  uint32_t wait[OUT_WAIT_BINS];
+}OutStats_t;
+
+/**************************************************************
+ * Global Variables
+ */
+OutEvent_t out_queue[OUT_QUEUE_LEN];
+volatile byte out_q_head = 0;   //Oldest slot in use
+volatile byte out_q_count = 0;  //Slots in use, taken ones included
+volatile byte out_pending[OUT_ROUTES]; //Events not yet taken, by route
+
+OutStats_t out_stats;
+
+void hid_flush();
+void midi_flush();
+
+/******************************************************************
+ * Procedures
+ */
+int out_backlog(byte route) {
+  return out_pending[route];
+}
+
+//A key up, or a note off (note on or CC at 0 included), that ends a press
+boolean out_is_release(const OutEvent_t *ev) {
+  byte cin = ev->midi.header & 0xF;
+
+  if( ev->route == OUT_MIDI ) {
+    return (cin == MIDI_CIN_NOTE_OFF) || (((cin == MIDI_CIN_NOTE_ON) || (cin == MIDI_CIN_CC)) && !ev->midi.data2);
+  }
+  return ev->hid.action == HID_UP;
+}
+
+//loop(), send what the output stages can
+void out_flush() {
+  hid_flush();
+#if defined(USB_MIDI)
+  midi_flush();
+#endif
+}
+
+/***************************************************
+ * out next
+ * Queue index of the oldest event of a route after index i, the
+ * oldest of all with i < 0. Returns -1 when there is none.
+ */
+int out_next(byte route, int i) {
+  int n = 0;
+
+  if( i >= 0 ) {
+    n = ((i - out_q_head) & (OUT_QUEUE_LEN - 1)) + 1;
+    if( n > out_q_count ) {
+      n = 0; //Slot i was reclaimed, so was everything before it
+    }
+  }
+  for( ; n < out_q_count; n++ ) {
+    i = (out_q_head + n) & (OUT_QUEUE_LEN - 1);
+    if( out_queue[i].route == route ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+//Free the event at index i and reclaim the slots at the head
+void out_release(int i) {
+  SCAN_LOCK();
+  out_pending[out_queue[i].route]--;
+  out_queue[i].route = OUT_TAKEN;
+  while( out_q_count && (out_queue[out_q_head].route == OUT_TAKEN) ) {
+    out_q_head = (out_q_head + 1) & (OUT_QUEUE_LEN - 1);
+    out_q_count--;
+  }
+  SCAN_UNLOCK();
+}
+
+/***************************************************
+ * out take
+ * Mark the event at index i as sent
+ */
+void out_take(int i) {
+  uint32_t wait = (uint32_t)clock_us() - out_queue[i].t_us;
+  uint32_t ms = wait / 1000;
+  byte bin = 0;
+
+  while( ms && (bin < OUT_WAIT_BINS - 1) ) {
+    ms >>= 1;
+    bin++;
+  }
+  out_stats.wait[bin]++;
+  if( wait > out_stats.wait_max_us ) {
+    out_stats.wait_max_us = wait;
+  }
+  out_stats.sent++;
+  out_release(i);
+}
+
+/***************************************************
+ * out push
+ * Queue and stamp an event, returns false when it didn't fit
+ */
+boolean out_push(OutEvent_t *ev) {
+  int room = out_is_release(ev) ? OUT_QUEUE_LEN : OUT_QUEUE_LEN - OUT_RESERVE;
+
+  ev->t_us = (uint32_t)clock_us();
+  if( (out_q_count >= room) && !usb_configured() && !out_is_release(&out_queue[out_q_head]) ) {
+    out_release(out_q_head); //Nothing is taken meanwhile
+    out_stats.dropped++;
+  }
+  if( out_q_count >= room ) {
+    out_stats.overflow++;
+    return false;
+  }
+  SCAN_LOCK();
+  out_queue[(out_q_head + out_q_count) & (OUT_QUEUE_LEN - 1)] = *ev;
+  out_q_count++;
+  out_pending[ev->route]++;
+  SCAN_UNLOCK();
+  out_stats.pushed++;
+  if( out_q_count > out_stats.backlog_max ) {
+    out_stats.backlog_max = out_q_count;
+  }
+  return true;
+}
+
+/***************************************************
+ * out discard
+ * Drop every queued event but the releases, returns how many
+ */
+int out_discard() {
+  int n = 0;
+
+  for( byte route = 0; route < OUT_ROUTES; route++ ) {
+    for( int i = out_next(route, -1); i >= 0; i = out_next(route, i) ) {
+      if( !out_is_release(&out_queue[i]) ) {
+        out_release(i);
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+void out_command(byte cmd) {
+  if( cmd == DIAG_CMD_RESET ) {
+    memset(&out_stats, 0, sizeof(out_stats));
+  }
+}
+
+void out_init() {
+  memset(&out_stats, 0, sizeof(out_stats));
+  diag_register(DIAG_OBJ_QUEUE, &out_stats, sizeof(out_stats), false, out_command);
+}
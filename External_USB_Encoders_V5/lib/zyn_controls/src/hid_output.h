@@ -0,0 +1,357 @@
+/***************************************************************
+ * HID output stage
+ *
+ * Driving the Keyboard library directly makes every press() and
+ * releaseAll() a HID report of its own, each costing a USB poll.
+ * Keystrokes are queued as logical events instead (event_queue.h) and
+ * hid_flush() sends at most one report per USB frame, packing into it
+ * as much as is valid:
+ *  - the modifiers go out in the same report as the key
+ *  - taps with the same modifiers and different keys share a report
+ *  - the release of a tap is merged with the press of the next one
+ *    when the modifiers match and the keys differ
+ *  - a key up passes a tap that can't go out yet, when the held keys
+ *    fill the report or hold the tap's key, so the tap gets its room
+ *
+ * The boot report holds 6 keys. Built with HID_NKRO the keyboard
+ * interface sends a bitmap instead, a bit for each usage hid_usage()
+ * can make, so every tap that fits the modifiers goes into the same
+ * report however many controls made one; boot protocol hosts get the
+ * first 6 keys of it in the boot report. Taps with other modifiers
+ * still wait for a report of their own, the modifiers being one byte
+ * for the whole report either way.
+ *
+ * out_backlog(OUT_KBD) tells the input side how much is still queued,
+ * so it can leave rotation counted in the decoder rather than overfill
+ * us. Nothing is sent until the host is ready to take a report.
+ */
+#if defined(HID_NKRO)
+#define HID_SEND_REPORT(rep) hid_send_nkro(rep)
+#else
+#define HID_SEND_REPORT(rep) usb_kbd_send((const byte *)(rep), sizeof(HidReport_t))
+#endif
+
+#define HID_FRAME_US      1000  /* One report per full speed frame */
+#define HID_BOOT_KEYS     6
+#if defined(HID_NKRO)
+#define HID_NKRO_USAGES   0x78  /* Usages 0-119, all hid_usage() makes */
+#define HID_REPORT_KEYS   (HID_NKRO_USAGES - 1) /* Usage 0 is no key */
+#else
+#define HID_REPORT_KEYS   HID_BOOT_KEYS
+#endif
+
+#define HID_SHIFT 0x80 /* Shift flag in hid_ascii */
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct HidReport_s {
+  byte mods;
+#if defined(HID_NKRO)
+  byte keys[HID_NKRO_USAGES / 8]; //Bit per usage
+#else
+  byte reserved;
+  byte keys[HID_REPORT_KEYS];
+#endif
+}HidReport_t;
+
+#if defined(USB_KBD_REPORT_LEN)
+static_assert(sizeof(HidReport_t) == USB_KBD_REPORT_LEN, "HidReport_t doesn't match the keyboard report descriptor");
+#endif
+
+/**************************************************************
+ * Global Variables
+ */
+//US layout usages for ASCII 0x20-0x7E, same mapping as the Keyboard library
+const byte hid_ascii[95] = {
+  0x2C, 0x1E|HID_SHIFT, 0x34|HID_SHIFT, 0x20|HID_SHIFT, 0x21|HID_SHIFT, 0x22|HID_SHIFT, 0x24|HID_SHIFT, 0x34,       // !"#$%&'
+  0x26|HID_SHIFT, 0x27|HID_SHIFT, 0x25|HID_SHIFT, 0x2E|HID_SHIFT, 0x36, 0x2D, 0x37, 0x38,                            //()*+,-./
+  0x27, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26,                                                        //0-9
+  0x33|HID_SHIFT, 0x33, 0x36|HID_SHIFT, 0x2E, 0x37|HID_SHIFT, 0x38|HID_SHIFT, 0x1F|HID_SHIFT,                        //:;<=>?@
+  0x04|HID_SHIFT, 0x05|HID_SHIFT, 0x06|HID_SHIFT, 0x07|HID_SHIFT, 0x08|HID_SHIFT, 0x09|HID_SHIFT, 0x0A|HID_SHIFT,    //A-G
+  0x0B|HID_SHIFT, 0x0C|HID_SHIFT, 0x0D|HID_SHIFT, 0x0E|HID_SHIFT, 0x0F|HID_SHIFT, 0x10|HID_SHIFT, 0x11|HID_SHIFT,    //H-N
+  0x12|HID_SHIFT, 0x13|HID_SHIFT, 0x14|HID_SHIFT, 0x15|HID_SHIFT, 0x16|HID_SHIFT, 0x17|HID_SHIFT, 0x18|HID_SHIFT,    //O-U
+  0x19|HID_SHIFT, 0x1A|HID_SHIFT, 0x1B|HID_SHIFT, 0x1C|HID_SHIFT, 0x1D|HID_SHIFT,                                    //V-Z
+  0x2F, 0x31, 0x30, 0x23|HID_SHIFT, 0x2D|HID_SHIFT, 0x35,                                                            //[\]^_`
+  0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10,                                      //a-m
+  0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D,                                      //n-z
+  0x2F|HID_SHIFT, 0x31|HID_SHIFT, 0x30|HID_SHIFT, 0x35|HID_SHIFT                                                     //{|}~
+};
+
+HidReport_t hid_held;   //Keys held down by HID_DOWN events
+HidReport_t hid_tapped; //Keys of the taps that are down in the last report
+boolean hid_tap_down = false;
+uint32_t hid_last_us = 0;
+
+//Statistics
+uint32_t hid_reports = 0;
+
+/******************************************************************
+ * Procedures
+ */
+/***************************************************
+ * hid usage
+ * Translate a Keyboard library key code into a usage and modifier bits
+ */
+byte hid_usage(byte k, byte *mods) {
+  byte u;
+
+  if( k >= 0x88 ) {
+    return k - 0x88;              //Non printing key
+  }else if( k >= 0x80 ) {
+    *mods |= 1 << (k - 0x80);     //Modifier
+    return 0;
+  }else if( k == '\n' ) {
+    return 0x28;
+  }else if( k == '\t' ) {
+    return 0x2B;
+  }else if( k == '\b' ) {
+    return 0x2A;
+  }else if( (k < 0x20) || (k > 0x7E) ) {
+    return 0;
+  }
+  u = hid_ascii[k - 0x20];
+  if( u & HID_SHIFT ) {
+    *mods |= 0x02;                //Left shift
+  }
+  return u & ~HID_SHIFT;
+}
+
+#if defined(HID_NKRO)
+boolean hid_report_has(HidReport_t *rep, byte usage) {
+  return usage && (usage < HID_NKRO_USAGES) && (rep->keys[usage >> 3] & (1 << (usage & 7)));
+}
+
+byte hid_report_free(HidReport_t *rep) {
+  byte n = HID_REPORT_KEYS;
+  for( byte u = 1; u < HID_NKRO_USAGES; u++ ) {
+    if( hid_report_has(rep, u) ) {
+      n--;
+    }
+  }
+  return n;
+}
+
+void hid_report_add(HidReport_t *rep, byte usage) {
+  if( usage && (usage < HID_NKRO_USAGES) ) {
+    rep->keys[usage >> 3] |= 1 << (usage & 7);
+  }
+}
+
+void hid_report_remove(HidReport_t *rep, byte usage) {
+  if( usage < HID_NKRO_USAGES ) {
+    rep->keys[usage >> 3] &= ~(1 << (usage & 7));
+  }
+}
+
+void hid_report_merge(HidReport_t *rep, HidReport_t *from) {
+  rep->mods |= from->mods;
+  for( byte i = 0; i < sizeof(rep->keys); i++ ) {
+    rep->keys[i] |= from->keys[i];
+  }
+}
+
+/***************************************************
+ * hid send nkro
+ * Send the bitmap, or the first keys of it to a boot protocol host
+ */
+void hid_send_nkro(HidReport_t *rep) {
+  byte boot[2 + HID_BOOT_KEYS];
+  byte n = 2;
+
+  if( !usb_kbd_boot() ) {
+    usb_kbd_send((const byte *)rep, sizeof(HidReport_t));
+    return;
+  }
+  memset(boot, 0, sizeof(boot));
+  boot[0] = rep->mods;
+  for( byte u = 1; (u < HID_NKRO_USAGES) && (n < sizeof(boot)); u++ ) {
+    if( hid_report_has(rep, u) ) {
+      boot[n++] = u;
+    }
+  }
+  usb_kbd_send(boot, sizeof(boot));
+}
+#else
+boolean hid_report_has(HidReport_t *rep, byte usage) {
+  for( byte i = 0; i < HID_REPORT_KEYS; i++ ) {
+    if( usage && rep->keys[i] == usage ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+byte hid_report_free(HidReport_t *rep) {
+  byte n = 0;
+  for( byte i = 0; i < HID_REPORT_KEYS; i++ ) {
+    if( !rep->keys[i] ) {
+      n++;
+    }
+  }
+  return n;
+}
+
+void hid_report_add(HidReport_t *rep, byte usage) {
+  for( byte i = 0; usage && (i < HID_REPORT_KEYS); i++ ) {
+    if( rep->keys[i] == usage ) {
+      return;
+    }
+    if( !rep->keys[i] ) {
+      rep->keys[i] = usage;
+      return;
+    }
+  }
+}
+
+void hid_report_remove(HidReport_t *rep, byte usage) {
+  for( byte i = 0; usage && (i < HID_REPORT_KEYS); i++ ) {
+    if( rep->keys[i] == usage ) {
+      rep->keys[i] = 0;
+    }
+  }
+}
+
+void hid_report_merge(HidReport_t *rep, HidReport_t *from) {
+  rep->mods |= from->mods;
+  for( byte i = 0; i < HID_REPORT_KEYS; i++ ) {
+    hid_report_add(rep, from->keys[i]);
+  }
+}
+#endif
+
+//The keys of an event, its key and the non modifier keys used as modifiers
+byte hid_event_keys(HidEvent_t *ev) {
+  return (ev->usage != 0) + (ev->usage2 != 0) + (ev->usage3 != 0);
+}
+
+boolean hid_event_in(HidReport_t *rep, HidEvent_t *ev) {
+  return hid_report_has(rep, ev->usage) || hid_report_has(rep, ev->usage2) || hid_report_has(rep, ev->usage3);
+}
+
+void hid_event_add(HidReport_t *rep, HidEvent_t *ev) {
+  hid_report_add(rep, ev->usage);
+  hid_report_add(rep, ev->usage2);
+  hid_report_add(rep, ev->usage3);
+}
+
+/***************************************************
+ * hid tap fits
+ * Can a tap be added to the taps of the report being built
+ */
+boolean hid_tap_fits(HidReport_t *taps, byte n, HidEvent_t *ev) {
+  if( n && (ev->mods != taps->mods) ) {
+    return false;
+  }
+  if( !n && hid_tap_down && (ev->mods != hid_tapped.mods) ) {
+    return false; //Modifiers must not change while keys are released
+  }
+  if( hid_event_in(taps, ev) || hid_event_in(&hid_tapped, ev) || hid_event_in(&hid_held, ev) ) {
+    return false; //Same key again needs a release in between
+  }
+  return hid_event_keys(ev) <= hid_report_free(taps) - (HID_REPORT_KEYS - hid_report_free(&hid_held));
+}
+
+//The held keys leave no room for a tap or hold its key, only a key
+//up can let it out
+boolean hid_tap_held_out(HidEvent_t *ev) {
+  return hid_event_in(&hid_held, ev) || (hid_event_keys(ev) > hid_report_free(&hid_held));
+}
+
+/***************************************************
+ * hid flush
+ * Send the next report if a USB frame has passed since the last one
+ */
+void hid_flush() {
+  HidReport_t rep;
+  HidReport_t taps;
+  HidReport_t downs; //Held keys pressed in this report
+  HidEvent_t *ev;
+  byte n = 0;
+  boolean blocked = false; //A tap that didn't fit is still queued
+  int i;
+
+  if( !out_backlog(OUT_KBD) && !hid_tap_down ) {
+    return;
+  }
+  if( (uint32_t)(micros() - hid_last_us) < HID_FRAME_US ) {
+    return;
+  }
+  if( !usb_kbd_ready() ) {
+    return;
+  }
+
+  memset(&taps, 0, sizeof(taps));
+  memset(&downs, 0, sizeof(downs));
+  for( i = out_next(OUT_KBD, -1); i >= 0; i = out_next(OUT_KBD, i) ) {
+    ev = &out_queue[i].hid;
+    if( ev->action == HID_TAP ) {
+      if( blocked ) {
+        continue;
+      }
+      if( !hid_tap_fits(&taps, n, ev) ) {
+        if( n || !hid_tap_held_out(ev) ) {
+          break;
+        }
+        blocked = true; //Look for the key ups making room for it
+        continue;
+      }
+      taps.mods = ev->mods;
+      hid_event_add(&taps, ev);
+      n++;
+    }else {
+      //Held keys keep their order against the taps around them, only
+      //a key up goes ahead of the taps that wait for it, and never in
+      //the report its key down is in
+      if( n || (blocked && (ev->action != HID_UP)) || hid_event_in(&hid_tapped, ev) ) {
+        break;
+      }
+      if( (ev->action == HID_UP) && ((ev->mods & downs.mods) || hid_event_in(&downs, ev)) ) {
+        break;
+      }
+      if( ev->action == HID_DOWN ) {
+        downs.mods |= ev->mods;
+        hid_event_add(&downs, ev);
+        hid_held.mods |= ev->mods;
+        hid_event_add(&hid_held, ev);
+      }else {
+        hid_held.mods &= ~ev->mods;
+        hid_report_remove(&hid_held, ev->usage);
+        hid_report_remove(&hid_held, ev->usage2);
+        hid_report_remove(&hid_held, ev->usage3);
+      }
+    }
+    out_take(i);
+  }
+
+  rep = hid_held;
+  hid_report_merge(&rep, &taps);
+  hid_tapped = taps;
+  hid_tap_down = (n != 0);
+
+  HID_SEND_REPORT(&rep);
+  TRACE_REPORT(&rep, sizeof(rep));
+  hid_last_us = micros();
+  hid_reports++;
+}
+
+/***************************************************
+ * hid combo
+ * Queue a key with up to two modifiers, as used by the KeyMap_t. A
+ * modifier may be any key (Caps Lock), both go out with the key.
+ * Returns false when it didn't fit in the queue.
+ */
+boolean hid_combo(byte action, byte key, byte mod1, byte mod2) {
+  OutEvent_t ev;
+
+  ev.route = OUT_KBD;
+  ev.hid.action = action;
+  ev.hid.mods = 0;
+  ev.hid.usage = hid_usage(key, &ev.hid.mods);
+  ev.hid.usage2 = hid_usage(mod1, &ev.hid.mods);
+  ev.hid.usage3 = hid_usage(mod2, &ev.hid.mods);
+  if( ev.hid.mods || hid_event_keys(&ev.hid) ) {
+    return out_push(&ev);
+  }
+  return true;
+}
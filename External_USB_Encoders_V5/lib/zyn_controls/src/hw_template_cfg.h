@@ -9,6 +9,10 @@
  * using PIN_NA and setting default_invert to true/false to achieve the desired
  * behavior.
  * 
+ * An encoder whose ENCn_A is PIN_NA, or a button whose SWn is, is left out
+ * of the build entirely. Boards with more controls add ENC4_..., SW4 and up,
+ * and list the extra slots in enc_all[] / btn_all[] in main.cpp.
+ * 
  */
 
 //LED Indicator pin 
@@ -26,26 +30,45 @@
 #define ENC0_SW   PIN_NA
 #define ENC0_A    PIN_NA
 #define ENC0_B    PIN_NA
+#define ENC0_STEPS 4 /* Transitions per detent: 4, 2 or 1 */
 
 #define ENC1_GND  PIN_NA
 #define ENC1_VCC  PIN_NA
 #define ENC1_SW   PIN_NA
 #define ENC1_A    PIN_NA
 #define ENC1_B    PIN_NA
+#define ENC1_STEPS 4
 
 #define ENC2_GND  PIN_NA
 #define ENC2_VCC  PIN_NA
 #define ENC2_SW   PIN_NA
 #define ENC2_A    PIN_NA
 #define ENC2_B    PIN_NA
+#define ENC2_STEPS 4
 
 #define ENC3_GND  PIN_NA
 #define ENC3_VCC  PIN_NA
 #define ENC3_SW   PIN_NA
 #define ENC3_A    PIN_NA
 #define ENC3_B    PIN_NA
+#define ENC3_STEPS 4
 
 #define SW0        PIN_NA
 #define SW1        PIN_NA
 #define SW2        PIN_NA
 #define SW3        PIN_NA
+
+//Faders and pots, only with -D ANALOG_SCAN (ADC pins)
+#define ANA0       PIN_NA
+#define ANA1       PIN_NA
+#define ANA2       PIN_NA
+#define ANA3       PIN_NA
+
+//Port expanders, only with -D EXP_COUNT (see port_expander.h)
+//#define EXP_INT    PIN_NA /* INTA of every chip, open drain */
+//#define EXP_SCL    PIN_NA /* STM32 only, else the core's Wire pins */
+//#define EXP_SDA    PIN_NA
+//#define EXP_CS     PIN_NA /* With -D EXP_SPI */
+//#define EXP_SCK    PIN_NA /* EXP_SPI on the STM32 only, else the core's SPI pins */
+//#define EXP_MISO   PIN_NA
+//#define EXP_MOSI   PIN_NA
@@ -0,0 +1,201 @@
+/***************************************************************
+ * Idle sleep
+ *
+ * Once no control has moved for IDLE_MS and nothing is left to send,
+ * loop() stops the scan ticks (scan_sched.h) and sleeps in WFI
+ * between interrupts instead of spinning at full clock. The switch
+ * pins and the A/B pins of the polled encoders get a wake interrupt
+ * (EXTI on the Black Pill, EIC on the MKZERO) on every line the
+ * decoder hasn't claimed; the interrupt driven encoders wake us from
+ * their own ISR, which counts the detent as always. A pin left without
+ * a line of its own is caught by comparing the levels of all control
+ * pins at each SysTick wake, 1ms later at worst. Faders and pots
+ * (analog_scan.h) have no wake line, their DMA buffer is looked at on
+ * the SysTick wakes as well.
+ *
+ * On waking the first scan tick runs at once from loop(), with the
+ * decoder state kept from before the sleep, so the edge that woke us
+ * is the first transition sampled and the detent it starts isn't
+ * lost. The time from the wake to that tick and the time spent asleep
+ * against the uptime, from which tools/zyn_diag.py idle works out the
+ * average current, are kept in diagnostic object DIAG_OBJ_IDLE.
+ *
+ * Sleep is WFI only: STOP would stop the USB clock too, which the host
+ * expects to keep running while it hasn't suspended the bus.
+ * -D IDLE_MS=0 turns the idle mode off.
+ */
+#if !defined(IDLE_MS)
+#define IDLE_MS        30000 /* Inactivity before sleeping */
+#endif
+#define IDLE_PINS_MAX  (btn_count + 3 * enc_count + 1)
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct IdleStats_s {
+  uint32_t sleeps;       //Times loop() went to sleep
+  uint32_t wakes_line;   //Woken by a wake interrupt
+  uint32_t wakes_level;  //Woken by anything else, change found in the pin levels
+  uint32_t wfi;          //WFI instructions executed
+  uint32_t asleep_ms;    //Total time asleep
+  uint32_t uptime_ms;    //millis() when last updated
+  uint32_t wake_last_us; //Wake to the first scan tick, last wake
+  uint32_t wake_max_us;
+  uint32_t no_line;      //Control pins without a wake line
+}IdleStats_t;
+
+/**************************************************************
+ * Global Variables
+ */
+IdleStats_t idle_stats;
+uint32_t idle_mask[PORT_COUNT];   //Pins of all controls
+uint32_t idle_levels[PORT_COUNT]; //Their levels at the last look
+int idle_pins[IDLE_PINS_MAX];     //Pins given a wake interrupt
+byte idle_pin_count = 0;
+boolean idle_asleep = false;
+uint32_t idle_last_ms = 0;        //Last activity
+uint32_t idle_start_ms = 0;
+volatile uint64_t idle_wake_us = 0; //Wake interrupt time, 0 for none yet
+
+/******************************************************************
+ * Procedures
+ */
+void idle_wake_isr() {
+  if( !idle_wake_us ) {
+    idle_wake_us = clock_us();
+  }
+}
+
+void idle_command(byte cmd) {
+  if( cmd == DIAG_CMD_RESET ) {
+    uint32_t no_line = idle_stats.no_line;
+
+    memset(&idle_stats, 0, sizeof(idle_stats));
+    idle_stats.no_line = no_line;
+  }
+}
+
+//Claim a wake line for a pin the decoder doesn't interrupt on, pins
+//sharing a line (quad_irq_line()) get one ISR between them
+void idle_add_pin(int pin, uint32_t *lines) {
+  int line = quad_irq_line(pin);
+
+  if( (line < 0) || (*lines & (1UL << line)) ) {
+    idle_stats.no_line++;
+    return;
+  }
+  *lines |= 1UL << line;
+  idle_pins[idle_pin_count++] = pin;
+}
+
+/***************************************************
+ * idle init
+ * After controls_set_gpio(), once the decoder has its lines
+ */
+void idle_init() {
+  uint32_t lines = quad_irq_lines;
+
+  memset(&idle_stats, 0, sizeof(idle_stats));
+  memcpy(idle_mask, ctl_pin_mask, sizeof(idle_mask));
+  for( int i = 0; i < enc_count; i++ ) {
+    if( enc_state[i].quad.polled ) {
+      idle_add_pin(enc_state[i].quad.pin_a, &lines);
+      idle_add_pin(enc_state[i].quad.pin_b, &lines);
+    }
+    if( enc_table::pins[i].sw != PIN_NA ) {
+      idle_add_pin(enc_table::pins[i].sw, &lines);
+    }
+  }
+  for( int i = 0; i < btn_count; i++ ) {
+    idle_add_pin(btn_table::pins[i], &lines);
+  }
+  diag_register(DIAG_OBJ_IDLE, &idle_stats, sizeof(idle_stats), false, idle_command);
+}
+
+//Any control pin changed level since the last look
+boolean idle_changed() {
+  boolean changed = false;
+  uint32_t levels;
+
+  for( byte p = 0; p < PORT_COUNT; p++ ) {
+    levels = port_read(p) & idle_mask[p];
+    if( levels != idle_levels[p] ) {
+      idle_levels[p] = levels;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+//Work left that needs the scan ticks or loop()
+boolean idle_busy() {
+  for( byte p = 0; p < PORT_COUNT; p++ ) {
+    if( port_state[p] ) {
+      return true; //A switch is held
+    }
+  }
+  return out_q_count || hid_tap_down || (boot_state != BOOT_RUNNING);
+}
+
+void idle_sleep() {
+  scan_stop();
+  idle_changed();
+  idle_wake_us = 0;
+  for( byte i = 0; i < idle_pin_count; i++ ) {
+    attachInterrupt(digitalPinToInterrupt(idle_pins[i]), idle_wake_isr, CHANGE);
+  }
+  idle_start_ms = millis();
+  idle_stats.sleeps++;
+  idle_asleep = true;
+}
+
+void idle_wake() {
+  uint64_t now = clock_us();
+  uint32_t lat = (uint32_t)(now - idle_wake_us);
+
+  for( byte i = 0; i < idle_pin_count; i++ ) {
+    detachInterrupt(digitalPinToInterrupt(idle_pins[i]));
+  }
+  scan_resume();
+  idle_stats.wake_last_us = lat;
+  if( lat > idle_stats.wake_max_us ) {
+    idle_stats.wake_max_us = lat;
+  }
+  idle_stats.asleep_ms += millis() - idle_start_ms;
+  idle_last_ms = millis();
+  idle_asleep = false;
+}
+
+/***************************************************
+ * idle service
+ * Call on every pass, returns true while asleep, when the rest of
+ * loop() has nothing to do
+ */
+boolean idle_service() {
+#if IDLE_MS
+  uint32_t now = millis();
+
+  idle_stats.uptime_ms = now;
+  if( !idle_asleep ) {
+    if( idle_changed() || idle_busy() || keymap_pending() ) {
+      idle_last_ms = now;
+    }else if( (uint32_t)(now - idle_last_ms) >= IDLE_MS ) {
+      idle_sleep();
+    }
+    return idle_asleep;
+  }
+
+  __WFI();
+  idle_stats.wfi++;
+  if( idle_wake_us ) {
+    idle_stats.wakes_line++;
+  }else if( idle_changed() || idle_busy() || keymap_pending() || ANALOG_MOVED() ) {
+    idle_wake_us = clock_us(); //Just woken by it, or at the SysTick after
+    idle_stats.wakes_level++;
+  }else {
+    return true;
+  }
+  idle_wake();
+#endif
+  return false;
+}
@@ -0,0 +1,340 @@
+/***************************************************************
+ * Keymap store
+ *
+ * The scan reads the active keymaps straight from the RAM arrays
+ * enc_table::maps and btn_table::maps (controls.h). At boot
+ * keymap_load() replaces the compiled in maps with the image saved in
+ * flash, when that image was written by a build with the same
+ * controls and KeyMap_t layout.
+ *
+ * The host reads and writes copies of the maps, keymap_enc_edit[] and
+ * keymap_btn_edit[], as diagnostic objects DIAG_OBJ_ENC_MAPS and
+ * DIAG_OBJ_BTN_MAPS (usb_diag.h); DIAG_CMD_DEFAULTS puts the compiled
+ * in maps in them. The USB interrupt only flags the change, the next
+ * loop() pass applies it (keymap_apply()) under SCAN_LOCK: a switch
+ * whose map changed lets go of the key or note it holds under the old
+ * map first, then the map is copied and ctl_bind() picks the policies
+ * of the new ones, so a change of mode or route is live at once and
+ * never leaves a key down on the host. A map with a field out of
+ * range (keymap_valid()) isn't applied and is counted in
+ * keymap_rejected; written over in parts, it is applied once the rest
+ * of it makes it whole. DIAG_CMD_COMMIT stores the applied maps.
+ *
+ * Flash is only written from loop(), by keymap_service(), once no
+ * switch has been held and nothing queued for KEYMAP_QUIET_MS
+ * (idle_busy()). On the Black Pill the save erases the 128 KB last
+ * sector of the F401, and code fetches from flash stall until the
+ * erase is done, 1-2 s: no scan tick, decoder edge or USB interrupt
+ * runs in between, so detents and switch edges of that time are lost
+ * and the host sees no report. A SAMD row erase takes a few ms.
+ *
+ * Flash:
+ *   STM32  the core's EEPROM emulation in the last flash sector,
+ *          through its buffered API so a save is a single erase
+ *   SAMD   NVM rows reserved by a flash array, as FlashStorage does
+ *   native RAM
+ *
+ * -D KEYMAP_FIXED leaves the store out: the compiled in maps are the
+ * only ones, the host can't read or write them, and controls.h keeps
+ * the policy tables const.
+ */
+#if !defined(KEYMAP_FIXED)
+#define KEYMAP_MAGIC   0x4B5A /* "ZK" */
+#define KEYMAP_VERSION 2
+#define KEYMAP_QUIET_MS 1000 /* Idle before flash is written */
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct KeymapHdr_s {
+  uint16_t magic;
+  byte version;
+  byte map_size;   //sizeof(KeyMap_t)
+  byte enc_count;
+  byte btn_count;
+  uint16_t sum;    //Fletcher-16 of the maps
+}KeymapHdr_t;
+
+/**************************************************************
+ * Global Variables
+ */
+constexpr uint16_t keymap_image_size = sizeof(KeymapHdr_t) + (enc_count + btn_count) * sizeof(KeyMap_t);
+KeyMap_t keymap_enc_edit[enc_count]; //Maps as the host last wrote them
+KeyMap_t keymap_btn_edit[btn_count];
+volatile boolean keymap_apply_pending = false;
+volatile boolean keymap_save_pending = false;
+uint32_t keymap_busy_ms = 0; //millis() when last idle_busy()
+uint16_t keymap_saves = 0;
+uint16_t keymap_rejected = 0;
+
+/******************************************************************
+ * Flash backends
+ */
+#if defined(ARDUINO_ARCH_STM32)
+#include <EEPROM.h>
+
+void keymap_flash_read(byte *dst, uint16_t n) {
+  eeprom_buffer_fill();
+  for( uint16_t i = 0; i < n; i++ ) {
+    dst[i] = eeprom_buffered_read_byte(i);
+  }
+}
+
+void keymap_flash_write(const byte *src, uint16_t n) {
+  eeprom_buffer_fill();
+  for( uint16_t i = 0; i < n; i++ ) {
+    eeprom_buffered_write_byte(i, src[i]);
+  }
+  eeprom_buffer_flush();
+}
+
+#elif defined(ARDUINO_ARCH_SAMD)
+#define KEYMAP_PAGE_SIZE 64                      /* SAMD21 NVM page */
+#define KEYMAP_ROW_SIZE  (4 * KEYMAP_PAGE_SIZE)  /* Erase unit */
+
+__attribute__((__aligned__(KEYMAP_ROW_SIZE)))
+const byte keymap_nvm[(keymap_image_size + KEYMAP_ROW_SIZE - 1) / KEYMAP_ROW_SIZE * KEYMAP_ROW_SIZE] = { };
+
+void keymap_nvm_cmd(uint32_t cmd) {
+  NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | cmd;
+  while( !NVMCTRL->INTFLAG.bit.READY ) {
+  }
+}
+
+void keymap_flash_read(byte *dst, uint16_t n) {
+  const volatile byte *src = keymap_nvm;
+
+  for( uint16_t i = 0; i < n; i++ ) {
+    dst[i] = src[i];
+  }
+}
+
+void keymap_flash_write(const byte *src, uint16_t n) {
+  uint32_t addr = (uint32_t)keymap_nvm;
+  volatile uint32_t *dst;
+  uint32_t word;
+
+  NVMCTRL->CTRLB.bit.MANW = 1;
+  for( uint16_t row = 0; row < n; row += KEYMAP_ROW_SIZE ) {
+    NVMCTRL->ADDR.reg = (addr + row) / 2;
+    keymap_nvm_cmd(NVMCTRL_CTRLA_CMD_ER);
+  }
+  for( uint16_t page = 0; page < n; page += KEYMAP_PAGE_SIZE ) {
+    keymap_nvm_cmd(NVMCTRL_CTRLA_CMD_PBC);
+    dst = (volatile uint32_t *)(addr + page);
+    for( uint16_t i = page; i < page + KEYMAP_PAGE_SIZE; i += 4 ) {
+      word = 0;
+      for( byte b = 0; b < 4; b++ ) {
+        word |= (uint32_t)((i + b < n) ? src[i + b] : 0xFF) << (8 * b);
+      }
+      *dst++ = word; //Page buffer only takes 32 bit writes
+    }
+    keymap_nvm_cmd(NVMCTRL_CTRLA_CMD_WP);
+  }
+}
+
+#elif defined(NATIVE_SIM)
+byte keymap_sim_flash[keymap_image_size];
+
+void keymap_flash_read(byte *dst, uint16_t n) {
+  memcpy(dst, keymap_sim_flash, n);
+}
+
+void keymap_flash_write(const byte *src, uint16_t n) {
+  memcpy(keymap_sim_flash, src, n);
+}
+#endif
+
+/******************************************************************
+ * Procedures
+ */
+uint16_t keymap_sum(const byte *data, uint16_t n) {
+  uint16_t s1 = 0;
+  uint16_t s2 = 0;
+
+  for( uint16_t i = 0; i < n; i++ ) {
+    s1 = (s1 + data[i]) % 255;
+    s2 = (s2 + s1) % 255;
+  }
+  return (s2 << 8) | s1;
+}
+
+/***************************************************
+ * keymap load
+ * Take the maps stored in flash if they fit this build
+ */
+boolean keymap_load() {
+  byte image[keymap_image_size];
+  KeymapHdr_t hdr;
+  byte *maps = &image[sizeof(KeymapHdr_t)];
+
+  keymap_flash_read(image, sizeof(image));
+  memcpy(&hdr, image, sizeof(hdr));
+  if( (hdr.magic != KEYMAP_MAGIC) || (hdr.version != KEYMAP_VERSION) || (hdr.map_size != sizeof(KeyMap_t)) ||
+      (hdr.enc_count != enc_count) || (hdr.btn_count != btn_count) ||
+      (hdr.sum != keymap_sum(maps, sizeof(image) - sizeof(hdr))) ) {
+    return false;
+  }
+  memcpy(enc_table::maps, maps, enc_count * sizeof(KeyMap_t));
+  memcpy(btn_table::maps, maps + enc_count * sizeof(KeyMap_t), btn_count * sizeof(KeyMap_t));
+  return true;
+}
+
+void keymap_save() {
+  byte image[keymap_image_size];
+  KeymapHdr_t hdr = { KEYMAP_MAGIC, KEYMAP_VERSION, sizeof(KeyMap_t), enc_count, btn_count, 0 };
+  byte *maps = &image[sizeof(KeymapHdr_t)];
+
+  memcpy(maps, enc_table::maps, enc_count * sizeof(KeyMap_t));
+  memcpy(maps + enc_count * sizeof(KeyMap_t), btn_table::maps, btn_count * sizeof(KeyMap_t));
+  hdr.sum = keymap_sum(maps, sizeof(image) - sizeof(hdr));
+  memcpy(image, &hdr, sizeof(hdr));
+  keymap_flash_write(image, sizeof(image));
+  keymap_saves++;
+}
+
+//Diagnostic object commands, from the USB interrupt
+void keymap_command(byte cmd) {
+  if( cmd == DIAG_CMD_COMMIT ) {
+    keymap_save_pending = true;
+  }else if( cmd == DIAG_CMD_DEFAULTS ) {
+    memcpy(keymap_enc_edit, enc_table::defaults, sizeof(keymap_enc_edit));
+    memcpy(keymap_btn_edit, btn_table::defaults, sizeof(keymap_btn_edit));
+    keymap_apply_pending = true;
+  }else if( cmd == DIAG_CMD_WRITTEN ) {
+    keymap_apply_pending = true;
+  }
+}
+
+void keymap_init() {
+  if( keymap_load() ) {
+    ctl_bind();
+  }
+  memcpy(keymap_enc_edit, enc_table::maps, sizeof(keymap_enc_edit));
+  memcpy(keymap_btn_edit, btn_table::maps, sizeof(keymap_btn_edit));
+  diag_register(DIAG_OBJ_ENC_MAPS, keymap_enc_edit, sizeof(keymap_enc_edit), true, keymap_command);
+  diag_register(DIAG_OBJ_BTN_MAPS, keymap_btn_edit, sizeof(keymap_btn_edit), true, keymap_command);
+}
+
+/***************************************************
+ * keymap valid
+ * Every field of a host written map in the range the scan expects
+ */
+boolean keymap_valid(const KeyMap_t *k_map) {
+  if( (k_map->accel_max > accel_max_steps) || (k_map->sw_mode > SW_GESTURE) ) {
+    return false;
+  }
+#if defined(USB_MIDI)
+  if( (k_map->midi_ch > 16) || (k_map->midi_cc > 127) || (k_map->midi_sw > 127) ||
+      (k_map->midi_flags & ~(MIDI_REL_64 | MIDI_SW_CC)) ) {
+    return false;
+  }
+#else
+  if( k_map->midi_ch ) {
+    return false; //MIDI maps need a USB_MIDI build
+  }
+#endif
+  if( (k_map->sw_mode == SW_GESTURE) &&
+      ((k_map->gest_taps < 1) || (k_map->gest_taps > GEST_TAPS_MAX) || !k_map->gest_tap) ) {
+    return false;
+  }
+  return true;
+}
+
+//Key up or note off of a switch held under k_map
+boolean keymap_release(KeyMap_t *k_map) {
+#if defined(USB_MIDI)
+  if( k_map->midi_ch ) {
+    return midi_switch(k_map, false);
+  }
+#endif
+  return COMBO_RELEASE(k_map->key_switch, k_map->mod_short, KEY_NONE);
+}
+
+/***************************************************
+ * keymap rebind
+ * Let go of what the switch holds under its old map and take the new
+ * one. Returns false, the map left as it was, when the release didn't
+ * fit in the queue.
+ */
+boolean keymap_rebind(KeyMap_t *k_map, const KeyMap_t *edit, SwitchState_t *state) {
+  if( state->held ) {
+    state->held = !keymap_release(k_map);
+    if( state->held ) {
+      return false;
+    }
+  }
+  memcpy(k_map, edit, sizeof(KeyMap_t));
+  state->pending = 0;
+  state->long_press = false;
+  state->gesture = GEST_IDLE;
+  state->taps = 0;
+  return true;
+}
+
+/***************************************************
+ * keymap apply
+ * Make the maps the host wrote the active ones, from loop()
+ */
+void keymap_apply() {
+  boolean done = true;
+
+  SCAN_LOCK();
+  keymap_apply_pending = false;
+  for( int i = 0; i < enc_count; i++ ) {
+    if( !memcmp(&enc_table::maps[i], &keymap_enc_edit[i], sizeof(KeyMap_t)) ) {
+      continue;
+    }
+    if( !keymap_valid(&keymap_enc_edit[i]) ) {
+      keymap_rejected++;
+    }else if( !keymap_rebind(&enc_table::maps[i], &keymap_enc_edit[i], &enc_state[i].sw) ) {
+      done = false;
+    }
+  }
+  for( int i = 0; i < btn_count; i++ ) {
+    if( !memcmp(&btn_table::maps[i], &keymap_btn_edit[i], sizeof(KeyMap_t)) ) {
+      continue;
+    }
+    if( !keymap_valid(&keymap_btn_edit[i]) ) {
+      keymap_rejected++;
+    }else if( !keymap_rebind(&btn_table::maps[i], &keymap_btn_edit[i], &btn_state[i]) ) {
+      done = false;
+    }
+  }
+  ctl_bind();
+  if( !done ) {
+    keymap_apply_pending = true; //Again on the next pass
+  }
+  SCAN_UNLOCK();
+}
+
+/***************************************************
+ * keymap service
+ * Called from loop() with idle_busy(), applies what the host wrote
+ * and writes the flash when the host asked for it and all is quiet
+ */
+void keymap_service(boolean busy) {
+  if( keymap_apply_pending ) {
+    keymap_apply();
+  }
+  if( busy ) {
+    keymap_busy_ms = millis();
+    return;
+  }
+  if( keymap_save_pending && !keymap_apply_pending &&
+      ((uint32_t)(millis() - keymap_busy_ms) >= KEYMAP_QUIET_MS) ) {
+    keymap_save_pending = false;
+    keymap_save();
+  }
+}
+
+//Work for keymap_service(), keeps idle_sleep.h awake
+inline boolean keymap_pending() {
+  return keymap_apply_pending || keymap_save_pending;
+}
+
+#else
+inline void keymap_init() {}
+inline void keymap_service(boolean busy) { (void)busy; }
+inline boolean keymap_pending() { return false; }
+#endif
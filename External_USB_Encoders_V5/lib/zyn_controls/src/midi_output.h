@@ -0,0 +1,92 @@
+/***************************************************************
+ * MIDI output stage
+ *
+ * Inputs whose map has a MIDI channel (USB_MIDI builds) are sent to
+ * the MIDI interface instead of as keystrokes. Encoders send relative
+ * Control Change, the value being the signed number of steps since the
+ * last pass, so a fast turn costs one message rather than one per
+ * detent. Two encodings are in common use:
+ *   two's complement  1..63 up, 127..65 down (zynthian, Bitwig, ...)
+ *   offset 64         65..127 up, 63..1 down (MIDI_REL_64)
+ * Steps beyond 63 are split over more messages. Switches send a note,
+ * or CC 127/0 with MIDI_SW_CC.
+ *
+ * Event packets share the queue of event_queue.h with the keystrokes,
+ * midi_flush() packs as many as fit into one bulk transfer whenever
+ * the endpoint is free.
+ */
+#define MIDI_CABLE        0
+#define MIDI_REL_MAX      63    /* Steps one relative CC can carry */
+#define MIDI_VELOCITY     127
+
+//KeyMap_t midi_flags
+#define MIDI_REL_64       0x01 /* Offset 64 relative CC, default two's complement */
+#define MIDI_SW_CC        0x02 /* Switch sends CC 127/0 instead of a note */
+
+/**************************************************************
+ * Global Variables
+ */
+uint32_t midi_transfers = 0;
+
+/******************************************************************
+ * Procedures
+ */
+/***************************************************
+ * midi flush
+ * Send the queued events, as many as fit in one transfer
+ */
+void midi_flush() {
+  MidiEvent_t buf[USB_MIDI_EP_SIZE / sizeof(MidiEvent_t)];
+  byte n = 0;
+  int i;
+
+  if( !out_backlog(OUT_MIDI) || !usb_midi_ready() ) {
+    return;
+  }
+  for( i = out_next(OUT_MIDI, -1); (i >= 0) && (n < USB_MIDI_EP_SIZE / sizeof(MidiEvent_t)); i = out_next(OUT_MIDI, i) ) {
+    buf[n] = out_queue[i].midi;
+    TRACE_MIDI(&buf[n]);
+    n++;
+    out_take(i);
+  }
+  usb_midi_send((const byte *)buf, n * sizeof(MidiEvent_t));
+  midi_transfers++;
+}
+
+//Code Index Numbers are in event_queue.h; false when it didn't fit
+boolean midi_push(byte cin, byte status, byte data1, byte data2) {
+  OutEvent_t ev;
+
+  ev.route = OUT_MIDI;
+  ev.midi.header = (MIDI_CABLE << 4) | cin;
+  ev.midi.status = status;
+  ev.midi.data1 = data1 & 0x7F;
+  ev.midi.data2 = data2 & 0x7F;
+  return out_push(&ev);
+}
+
+//Channels are 1-16 as in the keymaps
+boolean midi_cc(byte ch, byte cc, byte value) {
+  return midi_push(MIDI_CIN_CC, 0xB0 | ((ch - 1) & 0xF), cc, value);
+}
+
+boolean midi_note(byte ch, byte note, boolean on) {
+  if( on ) {
+    return midi_push(MIDI_CIN_NOTE_ON, 0x90 | ((ch - 1) & 0xF), note, MIDI_VELOCITY);
+  }
+  return midi_push(MIDI_CIN_NOTE_OFF, 0x80 | ((ch - 1) & 0xF), note, 0);
+}
+
+/***************************************************
+ * midi cc relative
+ * Send steps (+ve = cw) as relative CC in the encoding of flags
+ */
+void midi_cc_relative(byte ch, byte cc, int steps, byte flags) {
+  int n;
+
+  while( steps ) {
+    n = constrain(steps, -MIDI_REL_MAX, MIDI_REL_MAX);
+    midi_cc(ch, cc, (flags & MIDI_REL_64) ? 64 + n : n & 0x7F);
+    steps -= n;
+  }
+}
@@ -23,6 +23,21 @@
 | D20 | PB Switch  | 3 | - |
 | D21 | PB Switch  | 4 | - |
 
+|Faders and pots, -D ANALOG_SCAN
+| A1  | Analog     | 1 | AIN10 |
+| A2  | Analog     | 2 | AIN11 |
+| A3  | Analog     | 3 | AIN4  |
+| A4  | Analog     | 4 | AIN5  |
+
+|Port expanders, -D EXP_COUNT with -D EXP_SPI (see port_expander.h)
+| D8  | MOSI       | - | Select's B moves to an expander |
+| D9  | SCK        | - | L/S switch moves to D14 |
+| D10 | MISO       | - | Select's switch moves to an expander |
+| D7  | CS         | - | - |
+| A0  | INT        | - | INTA of every MCP23S17, open drain |
+The I2C pins are L/S's B and front panel switch 2, so the expanders
+are only offered on SPI.
+
 ***************************************************/
 
 //LED Indicator pin 
@@ -40,26 +55,55 @@
 #define ENC0_SW   D5
 #define ENC0_A    D3
 #define ENC0_B    D4
+#define ENC0_STEPS 4
 
 #define ENC1_GND  PIN_NA
 #define ENC1_VCC  PIN_NA
 #define ENC1_SW   D2
 #define ENC1_A    D1
 #define ENC1_B    D0
+#define ENC1_STEPS 4
+
+#if EXP_COUNT && !defined(EXP_SPI)
+#error "The MKZERO's I2C pins are taken, its expanders need -D EXP_SPI"
+#endif
 
 #define ENC2_GND  PIN_NA
 #define ENC2_VCC  PIN_NA
+#if EXP_COUNT
+#define ENC2_SW   D14 /* D9 is SCK */
+#else
 #define ENC2_SW   D9
+#endif
 #define ENC2_A    D6
 #define ENC2_B    D11
+#define ENC2_STEPS 4
 
+#if EXP_COUNT
+#define ENC3_GND  PIN_NA /* SPI */
+#define ENC3_VCC  PIN_NA
+#define ENC3_SW   PIN_NA
+#define ENC3_A    PIN_NA
+#define ENC3_B    PIN_NA
+#else
 #define ENC3_GND  PIN_NA
 #define ENC3_VCC  PIN_NA
 #define ENC3_SW   D10
 #define ENC3_A    D7
 #define ENC3_B    D8
+#endif
+#define ENC3_STEPS 4
 
 #define SW0       D13
 #define SW1       D12
 #define SW2       D20
 #define SW3       D21
+
+#define ANA0      A1
+#define ANA1      A2
+#define ANA2      A3
+#define ANA3      A4
+
+//Port expanders, the core's SPI pins
+#define EXP_INT   A0
+#define EXP_CS    D7
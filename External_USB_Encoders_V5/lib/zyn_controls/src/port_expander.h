@@ -0,0 +1,289 @@
+/***************************************************************
+ * Port expanders
+ *
+ * MCP23017 (I2C) or, built with EXP_SPI, MCP23S17 (SPI) expanders
+ * add a 16 pin port each after the GPIO ports of the controller, so
+ * the encoders and switches wired to them go through the same port
+ * snapshot debounce (port_scan.h) and quadrature decoder as native
+ * pins. Their pins are numbered EXP_PIN(chip, bit), bits 0-7 on
+ * GPA0-7 and 8-15 on GPB0-7; ENCODER_DEF_EXP() puts encoder n (0-4)
+ * of a chip on bits 3n (A), 3n + 1 (B) and 3n + 2 (switch), common to
+ * ground, so one chip carries five encoders and bit 15 is spare.
+ *
+ * Every pin of a chip has its pull-up on and interrupts on change.
+ * The chips run with INTA/INTB mirrored and open drain, so all of them
+ * share the one EXP_INT line of the board config, whose ISR only
+ * marks them pending. loop() then reads GPIOA and GPIOB of each chip
+ * in one sequential transaction, which also clears its INT, into
+ * exp_bank[], and runs the decoder of the encoders on that chip over
+ * the new levels. A line still low after the reads keeps its chips
+ * pending. port_read() of an expander port returns exp_bank[] and
+ * never touches the bus, so the scan tick stays short; the switches
+ * are debounced from it at the tick as usual. An EXP_INT pin without
+ * an interrupt line of its own (quad_irq_line()) is polled from
+ * loop() instead.
+ *
+ * A chip counts as fitted when its IOCON reads back as written at
+ * exp_begin(); I2C would NAK, but SPI has no acknowledge and MISO
+ * reads whatever it floats to. Chips that aren't fitted are never read
+ * and keep their idle 0xFFFF levels. Give MISO a pull-up (10k) all the
+ * same, so an empty bus reads high rather than as presses.
+ *
+ * -D EXP_COUNT=<1-8> chips, at I2C addresses 0x20 up or the same
+ * hardware addresses behind one EXP_CS with EXP_SPI. Without it
+ * nothing of this is built. The native simulator models the chips on
+ * its I2C bus or its SPI stand-in (lib/native_sim/sim_mcp.cpp).
+ */
+#if !defined(EXP_COUNT)
+#define EXP_COUNT      0
+#endif
+#if (EXP_COUNT < 0) || (EXP_COUNT > 8)
+#error "EXP_COUNT must be 0-8"
+#endif
+#if EXP_COUNT && !defined(EXP_INT)
+#error "EXP_COUNT needs the EXP_INT pin in the board config"
+#endif
+#if EXP_COUNT && defined(EXP_SPI) && !defined(EXP_CS)
+#error "EXP_SPI needs the EXP_CS pin in the board config"
+#endif
+
+#define EXP_PIN_BASE   512  /* Above the GPIO pins, below PIN_NA */
+#define EXP_PIN(chip, bit) (EXP_PIN_BASE + 16 * (chip) + (bit))
+#define EXP_ENC_PIN(chip, bit) ( ((chip) < EXP_COUNT) ? EXP_PIN(chip, bit) : PIN_NA )
+#define EXP_WATCH_MAX  8    /* Decoders run after a read, per chip */
+#define EXP_I2C_ADDR   0x20
+#define EXP_I2C_HZ     400000
+#define EXP_SPI_HZ     10000000
+
+//MCP23x17 registers, IOCON.BANK = 0
+#define EXP_IODIRA     0x00
+#define EXP_IOCON      0x0A
+#define EXP_GPIOA      0x12
+#define EXP_IOCON_MIRROR 0x40
+#define EXP_IOCON_HAEN 0x08 /* MCP23S17 hardware address */
+#define EXP_IOCON_ODR  0x04
+
+#if EXP_COUNT
+#if defined(EXP_SPI)
+#include <SPI.h>
+#elif !defined(NATIVE_SIM)
+#include <Wire.h>
+#endif
+
+/**************************************************************
+ * Global Variables
+ */
+volatile uint16_t exp_bank[EXP_COUNT]; //Levels of the last read
+volatile byte exp_pending = 0;        //Chips to read, by bit
+byte exp_present = 0;                 //Chips that answered at exp_begin()
+boolean exp_int_polled = false;       //EXP_INT has no interrupt line
+void (*exp_watch_isr[EXP_COUNT][EXP_WATCH_MAX])(void);
+byte exp_watch_count[EXP_COUNT];
+
+extern uint32_t quad_irq_lines;
+int quad_irq_line(int pin);
+
+/******************************************************************
+ * Procedures
+ */
+inline boolean exp_pin(int pin) {
+  return (pin >= EXP_PIN_BASE) && (pin < EXP_PIN(EXP_COUNT, 0));
+}
+
+inline byte exp_chip(int pin) {
+  return (pin - EXP_PIN_BASE) / 16;
+}
+
+/***************************************************
+ * exp write / exp read
+ * Registers of a chip from reg up, one transaction. Return false when
+ * the chip didn't answer.
+ */
+boolean exp_write(byte chip, byte reg, const byte *data, byte n) {
+#if defined(EXP_SPI)
+  SPI.beginTransaction(SPISettings(EXP_SPI_HZ, MSBFIRST, SPI_MODE0));
+  digitalWrite(EXP_CS, LOW);
+  SPI.transfer(0x40 | (chip << 1));
+  SPI.transfer(reg);
+  for( byte i = 0; i < n; i++ ) {
+    SPI.transfer(data[i]);
+  }
+  digitalWrite(EXP_CS, HIGH);
+  SPI.endTransaction();
+  return true;
+#elif defined(NATIVE_SIM)
+  return sim_mcp_write(EXP_I2C_ADDR + chip, reg, data, n);
+#else
+  Wire.beginTransmission(EXP_I2C_ADDR + chip);
+  Wire.write(reg);
+  Wire.write(data, n);
+  return Wire.endTransmission() == 0;
+#endif
+}
+
+boolean exp_read(byte chip, byte reg, byte *buf, byte n) {
+#if defined(EXP_SPI)
+  SPI.beginTransaction(SPISettings(EXP_SPI_HZ, MSBFIRST, SPI_MODE0));
+  digitalWrite(EXP_CS, LOW);
+  SPI.transfer(0x41 | (chip << 1));
+  SPI.transfer(reg);
+  for( byte i = 0; i < n; i++ ) {
+    buf[i] = SPI.transfer(0);
+  }
+  digitalWrite(EXP_CS, HIGH);
+  SPI.endTransaction();
+  return true;
+#elif defined(NATIVE_SIM)
+  return sim_mcp_read(EXP_I2C_ADDR + chip, reg, buf, n);
+#else
+  Wire.beginTransmission(EXP_I2C_ADDR + chip);
+  Wire.write(reg);
+  if( Wire.endTransmission(false) != 0 ) {
+    return false;
+  }
+  if( Wire.requestFrom((uint8_t)(EXP_I2C_ADDR + chip), n) != n ) {
+    return false;
+  }
+  for( byte i = 0; i < n; i++ ) {
+    buf[i] = Wire.read();
+  }
+  return true;
+#endif
+}
+
+//Both ports of a chip into exp_bank[], clears its INT
+void exp_read_bank(byte chip) {
+  byte buf[2];
+
+  if( exp_read(chip, EXP_GPIOA, buf, 2) ) {
+    exp_bank[chip] = buf[0] | (buf[1] << 8);
+  }
+}
+
+void exp_int_isr() {
+  exp_pending = exp_present;
+}
+
+/***************************************************
+ * exp watch
+ * Run isr after every read of the chip carrying pins a and b, for the
+ * quadrature decoder. Returns false when it can't, the encoder is then
+ * sampled on the scan ticks like any polled one.
+ */
+boolean exp_watch(int pin_a, int pin_b, void (*isr)(void)) {
+  byte chip = exp_chip(pin_a);
+
+  if( !exp_pin(pin_a) || !exp_pin(pin_b) || (exp_chip(pin_b) != chip) ||
+      (exp_watch_count[chip] >= EXP_WATCH_MAX) ) {
+    return false;
+  }
+  exp_watch_isr[chip][exp_watch_count[chip]++] = isr;
+  return true;
+}
+
+/***************************************************
+ * exp begin
+ * Set the chips up and take their levels, before controls_set_gpio()
+ */
+void exp_begin() {
+  //IODIR to GPPU of both ports: inputs, not inverted, interrupt on any
+  //change from the last level, mirrored open drain INT, pull-ups on
+  const byte config[14] = { 0xFF, 0xFF, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00,
+                            EXP_IOCON_MIRROR | EXP_IOCON_HAEN | EXP_IOCON_ODR,
+                            EXP_IOCON_MIRROR | EXP_IOCON_HAEN | EXP_IOCON_ODR, 0xFF, 0xFF };
+  byte iocon;
+  int line = quad_irq_line(EXP_INT);
+
+#if defined(NATIVE_SIM)
+  for( byte c = 0; c < EXP_COUNT; c++ ) {
+    sim_mcp_begin(EXP_I2C_ADDR + c, EXP_INT);
+  }
+#endif
+#if defined(EXP_SPI)
+  pinMode(EXP_CS, OUTPUT);
+  digitalWrite(EXP_CS, HIGH);
+#if defined(ARDUINO_ARCH_STM32) && defined(EXP_SCK)
+  SPI.setMOSI(EXP_MOSI);
+  SPI.setMISO(EXP_MISO);
+  SPI.setSCLK(EXP_SCK);
+#endif
+  SPI.begin();
+  //Until HAEN is set every chip answers to address 0
+  exp_write(0, EXP_IOCON, &config[EXP_IOCON], 1);
+#elif !defined(NATIVE_SIM)
+#if defined(ARDUINO_ARCH_STM32) && defined(EXP_SCL)
+  Wire.setSCL(EXP_SCL);
+  Wire.setSDA(EXP_SDA);
+#endif
+  Wire.begin();
+  Wire.setClock(EXP_I2C_HZ);
+#endif
+  for( byte c = 0; c < EXP_COUNT; c++ ) {
+    exp_bank[c] = 0xFFFF; //Idle levels, for a chip that doesn't answer
+    exp_watch_count[c] = 0;
+    if( exp_write(c, EXP_IODIRA, config, sizeof(config)) && exp_read(c, EXP_IOCON, &iocon, 1) &&
+        (iocon == config[EXP_IOCON]) ) {
+      exp_present |= 1 << c;
+      exp_read_bank(c);
+    }
+  }
+  pinMode(EXP_INT, INPUT_PULLUP);
+  exp_int_polled = (line < 0) || (quad_irq_lines & (1UL << line));
+  if( !exp_int_polled ) {
+    quad_irq_lines |= 1UL << line;
+    attachInterrupt(digitalPinToInterrupt(EXP_INT), exp_int_isr, FALLING);
+  }
+}
+
+/***************************************************
+ * exp service
+ * loop(), read the chips that interrupted and decode their encoders,
+ * or all of them while a polled EXP_INT is low
+ */
+void exp_service() {
+  byte pending;
+
+  if( exp_int_polled && !digitalRead(EXP_INT) ) {
+    exp_pending = exp_present;
+  }
+  if( !exp_pending ) {
+    return;
+  }
+  noInterrupts();
+  pending = exp_pending;
+  exp_pending = 0;
+  interrupts();
+  for( byte c = 0; c < EXP_COUNT; c++ ) {
+    if( !(pending & (1 << c)) ) {
+      continue;
+    }
+    exp_read_bank(c);
+    noInterrupts(); //The scan tick drains the same decoders
+    for( byte i = 0; i < exp_watch_count[c]; i++ ) {
+      exp_watch_isr[c][i]();
+    }
+    interrupts();
+  }
+  if( !digitalRead(EXP_INT) ) {
+    exp_pending |= exp_present; //Changed again during the reads
+  }
+}
+
+#define EXP_BEGIN()    exp_begin()
+#define EXP_SERVICE()  exp_service()
+#else
+inline boolean exp_pin(int) {
+  return false;
+}
+
+inline byte exp_chip(int) {
+  return 0;
+}
+
+inline boolean exp_watch(int, int, void (*)(void)) {
+  return false;
+}
+
+#define EXP_BEGIN()
+#define EXP_SERVICE()
+#endif
@@ -0,0 +1,156 @@
+/***************************************************************
+ * Port snapshot scanner
+ *
+ * The switches are sampled by reading whole GPIO input registers
+ * (GPIOx->IDR on the STM32, PORT IN on the SAMD) every PORT_SCAN_US,
+ * paced by the scan scheduler (scan_sched.h), rather than a
+ * digitalRead() per pin. All inputs of a port are
+ * debounced at once with a 2 bit vertical counter per bit: a switch
+ * only changes state after PORT_SCAN_AGREE samples in a row disagree
+ * with it. port_state[] holds the result, 1 = pressed, whatever level
+ * the switch is active at.
+ *
+ * port_read() is also used by the quadrature decoder, whose Gray code
+ * table rejects bounce on its own. The banks of port expanders
+ * (port_expander.h) are ports PORT_NATIVE and up. With SCAN_DMA the
+ * first PORT_DMA ports read the buffered sample being processed
+ * (scan_sched.h) rather than the register, while the DMA runs.
+ */
+#define PORT_SCAN_US    1000 /* Sample period */
+#define PORT_SCAN_AGREE 4    /* Samples, fixed by the 2 bit counters */
+
+#if defined(ARDUINO_ARCH_STM32)
+#define PORT_NATIVE 3        /* GPIOA-GPIOC */
+#elif defined(ARDUINO_ARCH_SAMD)
+#define PORT_NATIVE 2        /* PORTA, PORTB */
+#elif defined(NATIVE_SIM)
+#define PORT_NATIVE SIM_NUM_PORTS
+#endif
+#define PORT_COUNT (PORT_NATIVE + EXP_COUNT)
+#define PORT_DMA   2         /* GPIOA, GPIOB, SCAN_DMA */
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct PortPin_s {
+  byte port;
+  uint32_t mask;           //0 for PIN_NA
+}PortPin_t;
+
+/**************************************************************
+ * Global Variables
+ */
+#if defined(ARDUINO_ARCH_STM32)
+GPIO_TypeDef *const port_regs[PORT_NATIVE] = { GPIOA, GPIOB, GPIOC };
+#endif
+
+uint32_t port_used[PORT_COUNT];   //Bits being debounced
+uint32_t port_invert[PORT_COUNT]; //Bits pressed when low
+uint32_t port_state[PORT_COUNT];  //Debounced, 1 = pressed
+uint32_t port_ct0[PORT_COUNT];    //Vertical counter, low bit
+uint32_t port_ct1[PORT_COUNT];    //Vertical counter, high bit
+#if defined(SCAN_DMA)
+uint32_t port_snap[PORT_DMA];     //Sample being processed
+boolean port_dma = false;         //Read the ports from port_snap[]
+#endif
+
+/******************************************************************
+ * Procedures
+ */
+inline uint32_t port_read(byte port) {
+#if defined(SCAN_DMA)
+  if( port_dma && (port < PORT_DMA) ) {
+    return port_snap[port];
+  }
+#endif
+#if EXP_COUNT
+  if( port >= PORT_NATIVE ) {
+    return exp_bank[port - PORT_NATIVE];
+  }
+#endif
+#if defined(ARDUINO_ARCH_STM32)
+  return port_regs[port]->IDR;
+#elif defined(ARDUINO_ARCH_SAMD)
+  return PORT->Group[port].IN.reg;
+#elif defined(NATIVE_SIM)
+  return sim_port_read(port);
+#endif
+}
+
+PortPin_t port_pin(int pin) {
+  PortPin_t pp = { 0, 0 };
+
+  if( exp_pin(pin) ) {
+    pp.port = PORT_NATIVE + exp_chip(pin);
+    pp.mask = 1ul << ((pin - EXP_PIN_BASE) % 16);
+    return pp;
+  }
+  if( (pin < 0) || (pin >= (int)NUM_DIGITAL_PINS) ) {
+    return pp; //PIN_NA
+  }
+#if defined(ARDUINO_ARCH_STM32)
+  pp.port = STM_PORT(digitalPinToPinName(pin));
+  pp.mask = STM_GPIO_PIN(digitalPinToPinName(pin));
+#elif defined(ARDUINO_ARCH_SAMD)
+  pp.port = g_APinDescription[pin].ulPort;
+  pp.mask = 1ul << g_APinDescription[pin].ulPin;
+#elif defined(NATIVE_SIM)
+  pp.port = pin / 16;
+  pp.mask = 1ul << (pin % 16);
+#endif
+  if( pp.port >= PORT_NATIVE ) {
+    pp.mask = 0;
+  }
+  return pp;
+}
+
+inline boolean port_level(PortPin_t *pp) {
+  return (port_read(pp->port) & pp->mask) != 0;
+}
+
+//pinMode() of a control input, expander inputs are set up by exp_begin()
+void port_pin_mode(int pin, uint32_t mode) {
+  if( !exp_pin(pin) ) {
+    pinMode(pin, mode);
+  }
+}
+
+/***************************************************
+ * port add
+ * Debounce a switch from now on. Pin must already be configured.
+ */
+PortPin_t port_add(int pin, boolean active_low) {
+  PortPin_t pp = port_pin(pin);
+
+  port_used[pp.port] |= pp.mask;
+  if( active_low ) {
+    port_invert[pp.port] |= pp.mask;
+  }
+  return pp;
+}
+
+inline boolean port_pressed(PortPin_t *pp) {
+  return (port_state[pp->port] & pp->mask) != 0;
+}
+
+/***************************************************
+ * port scan
+ * Take a snapshot of all ports and debounce it, once per PORT_SCAN_US
+ */
+void port_scan() {
+  uint32_t sample;
+  uint32_t delta;
+
+  for( byte p = 0; p < PORT_COUNT; p++ ) {
+    if( !port_used[p] ) {
+      continue;
+    }
+    sample = (port_read(p) ^ port_invert[p]) & port_used[p];
+    delta = sample ^ port_state[p];
+    //Count samples that disagree, a bit that agrees resets its count
+    port_ct1[p] = (port_ct1[p] ^ port_ct0[p]) & delta;
+    port_ct0[p] = ~port_ct0[p] & delta;
+    //Toggle the bits whose count wrapped
+    port_state[p] ^= delta & ~(port_ct0[p] | port_ct1[p]);
+  }
+}
@@ -0,0 +1,255 @@
+/***************************************************************
+ * Quadrature decoder
+ *
+ * The A/B lines of every encoder are decoded from edge interrupts
+ * (EXTI on the Black Pill, EIC on the MKZERO) instead of being
+ * sampled from loop(). The ISR owns the transition state and keeps
+ * a signed count of whole detents; loop() drains that count with
+ * quad_drain(), so no detent is lost however long the output path
+ * keeps loop() busy.
+ *
+ * An encoder whose A or B pin has no free interrupt line (on the
+ * STM32 EXTI lines are shared by pin number across ports, e.g. PA6
+ * and PB6) falls back to being sampled by quad_poll() on each pass.
+ * One on a port expander is decoded by exp_service() after each read
+ * of the chip instead (port_expander.h). Built with SCAN_DMA every
+ * encoder is polled, from each buffered sample (scan_sched.h).
+ *
+ * The ISR also times the detents, for speed dependent acceleration.
+ * A and B are read straight from the port input register (port_scan.h).
+ *
+ * The board config gives each encoder its transitions per detent next
+ * to its pins, ENCn_STEPS: 4 for the usual encoder with a detent every
+ * full Gray cycle, counted on reaching the rest state, rounded so one
+ * missed transition doesn't lose the detent; 2 for one with a detent
+ * at both 00 and 11; 1 counts every transition (x4). Those two start
+ * counting over at the rest state as well. Each encoder also
+ * counts its valid transitions, the invalid ones (both lines changed
+ * between two samples, so a transition was missed) and the reversals
+ * (a transition the other way than the one before, bounce or a real
+ * change of direction) in quad_stats[], diagnostic object
+ * DIAG_OBJ_ENC_STATS, shown by tools/zyn_diag.py encoders.
+ */
+#define QUAD_STEPS_PER_DETENT 4   /* Gray code transitions per detent, default */
+#define QUAD_REST_STATE       0x3 /* A and B both at r_polarity at a detent */
+#define QUAD_COUNT_MAX        0x7FFF
+#define QUAD_INTERVAL_MAX     0xFFFF /* ms, also used after a reversal */
+
+#if !defined(ENC0_STEPS)
+#define ENC0_STEPS QUAD_STEPS_PER_DETENT
+#endif
+#if !defined(ENC1_STEPS)
+#define ENC1_STEPS QUAD_STEPS_PER_DETENT
+#endif
+#if !defined(ENC2_STEPS)
+#define ENC2_STEPS QUAD_STEPS_PER_DETENT
+#endif
+#if !defined(ENC3_STEPS)
+#define ENC3_STEPS QUAD_STEPS_PER_DETENT
+#endif
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct QuadStats_s {
+  uint32_t transitions; //Valid ones
+  uint32_t invalid;     //Both lines changed at once
+  uint32_t reversals;   //Against the direction of the transition before
+  uint32_t detents;
+}QuadStats_t;
+
+typedef struct QuadEnc_s {
+  int pin_a;
+  int pin_b;
+  volatile byte state;     //Last sample, bit1 = A, bit0 = B, 1 = at r_polarity
+  volatile int8_t steps;   //Transitions since the last rest position
+  volatile int8_t last_step; //Direction of the last valid transition
+  byte step_detent;        //Transitions per detent, ENCn_STEPS
+  QuadStats_t *stats;
+  volatile int16_t count;  //Detents not yet drained by loop(), +ve = cw as SimpleRotary had it
+  volatile int8_t dir;     //Direction of the last detent
+  volatile uint16_t interval_ms; //Time between the last two detents
+  volatile uint32_t last_ms;     //Time of the last detent
+  volatile uint32_t span_ms;     //Intervals of the detents not yet drained, summed
+  volatile uint16_t span_n;      //and how many there are
+  volatile uint32_t edge_cycles; //First detent not yet drained, SCAN_PROFILE only
+  boolean polled;          //No interrupt line available, sampled from loop()
+  PortPin_t port_a;
+  PortPin_t port_b;
+}QuadEnc_t;
+
+/**************************************************************
+ * Global Variables
+ */
+//Indexed by (previous state << 2) | current state
+const int8_t quad_table[16] = { 0, -1,  1,  0,
+                                1,  0,  0, -1,
+                               -1,  0,  0,  1,
+                                0,  1, -1,  0 };
+
+uint32_t quad_irq_lines = 0; //Interrupt lines claimed so far
+
+/******************************************************************
+ * Procedures
+ */
+byte quad_sample(QuadEnc_t *quad) {
+  return ((port_level(&quad->port_a) == r_polarity) << 1) | (port_level(&quad->port_b) == r_polarity);
+}
+
+/***************************************************
+ * quad isr
+ * Called on every A or B edge. Also used by loop() for polled encoders.
+ */
+void quad_isr(QuadEnc_t *quad) {
+  byte cur = quad_sample(quad);
+  int8_t step = quad_table[(quad->state << 2) | cur];
+  int8_t steps = quad->steps + step;
+  int8_t dir = 0;
+
+  if( (quad->state ^ cur) == 0x3 ) {
+    quad->stats->invalid++;
+  }else if( step ) {
+    quad->stats->transitions++;
+    if( step == -quad->last_step ) {
+      quad->stats->reversals++;
+    }
+    quad->last_step = step;
+  }
+  quad->state = cur;
+  if( quad->step_detent < QUAD_STEPS_PER_DETENT ) {
+    //x2 and x4, a detent every step_detent transitions, counted afresh
+    //from each rest state so a missed transition doesn't shift every
+    //detent after it
+    if( steps >= quad->step_detent ) {
+      dir = 1;
+    }else if( steps <= -quad->step_detent ) {
+      dir = -1;
+    }
+    if( dir || (cur == QUAD_REST_STATE) ) {
+      steps = 0;
+    }
+  }else if( cur == QUAD_REST_STATE ) {
+    //Back on a detent, round the travel to a whole click and resync
+    if( steps >= QUAD_STEPS_PER_DETENT / 2 ) {
+      dir = 1;
+    }else if( steps <= -QUAD_STEPS_PER_DETENT / 2 ) {
+      dir = -1;
+    }
+    steps = 0;
+  }
+  quad->steps = steps;
+  if( abs(quad->count + dir) > QUAD_COUNT_MAX ) {
+    dir = 0; //Not drained for a long while, drop the detent
+  }
+
+  if( dir ) {
+    uint32_t now = millis();
+    uint32_t interval = now - quad->last_ms;
+
+    quad->count += dir;
+    quad->stats->detents++;
+    quad->interval_ms = ( (dir != quad->dir) || (interval > QUAD_INTERVAL_MAX) ) ? QUAD_INTERVAL_MAX : interval;
+    quad->last_ms = now;
+    quad->dir = dir;
+    if( quad->span_n < 0xFFFF ) {
+      quad->span_ms += quad->interval_ms;
+      quad->span_n++;
+    }
+    if( quad->count == dir ) {
+      PROF_STAMP(quad->edge_cycles); //First detent since the last drain
+    }
+  }
+}
+
+/***************************************************
+ * quad irq line
+ * Return the hardware interrupt line used by a pin, -1 if none
+ */
+int quad_irq_line(int pin) {
+  if( exp_pin(pin) ) {
+    return -1; //Behind the expander's INT
+  }
+#if defined(ARDUINO_ARCH_STM32)
+  return STM_PIN(digitalPinToPinName(pin));
+#elif defined(NATIVE_SIM)
+  return sim_irq_line(pin);
+#else
+  //digitalPinToInterrupt() hands the pin number back on the SAMD cores,
+  //the EIC line it shares with other pins is in the pin table
+  int irq = g_APinDescription[pin].ulExtInt;
+  return ( (irq < EXTERNAL_INT_0) || (irq > EXTERNAL_INT_15) ) ? -1 : irq; //NMI can't be attached
+#endif
+}
+
+/***************************************************
+ * quad attach
+ * Hook the A/B edges of an encoder. Pins must already be configured.
+ */
+void quad_attach(QuadEnc_t *quad, void (*isr)(void)) {
+  int line_a = quad_irq_line(quad->pin_a);
+  int line_b = quad_irq_line(quad->pin_b);
+
+  quad->port_a = port_pin(quad->pin_a);
+  quad->port_b = port_pin(quad->pin_b);
+  quad->state = quad_sample(quad);
+  quad->steps = 0;
+  quad->last_step = 0;
+  quad->count = 0;
+  if( (quad->step_detent < 1) || (quad->step_detent > QUAD_STEPS_PER_DETENT) ) {
+    quad->step_detent = QUAD_STEPS_PER_DETENT;
+  }
+  quad->dir = 0;
+  quad->interval_ms = QUAD_INTERVAL_MAX;
+  quad->span_ms = 0;
+  quad->span_n = 0;
+  if( exp_pin(quad->pin_a) || exp_pin(quad->pin_b) ) {
+    quad->polled = !exp_watch(quad->pin_a, quad->pin_b, isr);
+    return;
+  }
+#if defined(SCAN_DMA)
+  quad->polled = true;
+#else
+  quad->polled = (line_a < 0) || (line_b < 0) ||
+                 (quad_irq_lines & ((1UL << line_a) | (1UL << line_b)));
+#endif
+  if( quad->polled ) {
+    return;
+  }
+  quad_irq_lines |= (1UL << line_a) | (1UL << line_b);
+  attachInterrupt(digitalPinToInterrupt(quad->pin_a), isr, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(quad->pin_b), isr, CHANGE);
+}
+
+/***************************************************
+ * quad poll
+ * Sample encoders that have no interrupt line, call on every pass
+ */
+void quad_poll(QuadEnc_t *quad) {
+  if( quad->polled ) {
+    quad_isr(quad);
+  }
+}
+
+/***************************************************
+ * quad drain timed
+ * Return and clear the detents accumulated since the last call, with
+ * the average interval between them
+ */
+int quad_drain_timed(QuadEnc_t *quad, uint16_t *interval) {
+  int count;
+
+  noInterrupts();
+  count = quad->count;
+  *interval = quad->span_n ? quad->span_ms / quad->span_n : QUAD_INTERVAL_MAX;
+  quad->count = 0;
+  quad->span_ms = 0;
+  quad->span_n = 0;
+  interrupts();
+  return count;
+}
+
+int quad_drain(QuadEnc_t *quad) {
+  uint16_t interval;
+
+  return quad_drain_timed(quad, &interval);
+}
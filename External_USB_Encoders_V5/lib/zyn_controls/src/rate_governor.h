@@ -0,0 +1,99 @@
+/***************************************************************
+ * Encoder rate governor
+ *
+ * Without it every detent the decoder counts goes out as soon as the
+ * output queue has room, one keystroke per step. A host that redraws
+ * for each one (the zynthian UI) falls behind a fast or wiggled
+ * encoder and keeps catching up for seconds after it stopped.
+ *
+ * Built with -D ENC_RATE_HZ=<flushes per second> each encoder instead
+ * adds its steps, after acceleration and inversion, to a pending count
+ * on every tick, so turns in opposite directions cancel before
+ * anything is sent. The net count is sent at most ENC_RATE_HZ times a
+ * second per encoder, and only while nothing of its route is still
+ * queued; ENC_FLUSH_STEPS bounds both the pending count and so what one
+ * flush sends (MIDI_REL_MAX for MIDI, one relative CC). Steps beyond it
+ * are dropped, the host couldn't have shown them in time anyway.
+ *
+ * The flushes run after every switch and button of the tick has been
+ * processed, one encoder per route and tick, taking turns. A switch
+ * event therefore waits behind at most one flush of rotation, never
+ * behind a backlog of it. The first detent after a pause goes out on
+ * its own tick as before.
+ */
+#if defined(ENC_RATE_HZ)
+#if (ENC_RATE_HZ < 1) || (ENC_RATE_HZ > 1000)
+#error "ENC_RATE_HZ must be 1-1000"
+#endif
+#define GOV_PERIOD_MS   (1000 / ENC_RATE_HZ)
+#if !defined(ENC_FLUSH_STEPS)
+#define ENC_FLUSH_STEPS 4   /* Most steps pending and sent at once, keys */
+#endif
+#if defined(USB_MIDI)
+#define GOV_MAX(route)  ( ((route) == OUT_MIDI) ? MIDI_REL_MAX : ENC_FLUSH_STEPS )
+#else
+#define GOV_MAX(route)  ENC_FLUSH_STEPS
+#endif
+#endif
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct GovState_s {
+  int pending;      //Net steps not yet sent, +ve = cw
+  uint32_t sent_ms; //scan_ms of the last flush
+}GovState_t;
+
+typedef struct GovStats_s {
+  uint32_t flushes;
+  uint32_t sent;      //Steps sent
+  uint32_t cancelled; //Steps cancelled by a turn the other way
+  uint32_t clipped;   //Steps dropped beyond ENC_FLUSH_STEPS
+}GovStats_t;
+
+#if defined(ENC_RATE_HZ)
+/**************************************************************
+ * Global Variables
+ */
+GovStats_t gov_stats;
+int gov_first = 0; //Encoder that gets the first turn at flushing
+
+/******************************************************************
+ * Procedures
+ */
+/***************************************************
+ * gov add
+ * Add steps to the pending count, held to +/- max
+ */
+void gov_add(GovState_t *gov, int steps, int max) {
+  int sum = gov->pending + steps;
+
+  if( !steps ) {
+    return;
+  }
+  gov_stats.cancelled += (abs(gov->pending) + abs(steps) - abs(sum)) / 2;
+  if( abs(sum) > max ) {
+    gov_stats.clipped += abs(sum) - max;
+    sum = constrain(sum, -max, max);
+  }
+  gov->pending = sum;
+}
+
+/***************************************************
+ * gov take
+ * Net steps to send now, 0 while the encoder's period hasn't passed
+ * or its route still has events queued
+ */
+int gov_take(GovState_t *gov, byte route) {
+  int steps = gov->pending;
+
+  if( !steps || ((uint32_t)(scan_ms - gov->sent_ms) < GOV_PERIOD_MS) || out_backlog(route) ) {
+    return 0;
+  }
+  gov->pending = 0;
+  gov->sent_ms = scan_ms;
+  gov_stats.flushes++;
+  gov_stats.sent += abs(steps);
+  return steps;
+}
+#endif
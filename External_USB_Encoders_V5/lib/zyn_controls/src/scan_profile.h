@@ -0,0 +1,153 @@
+/***************************************************************
+ * Scan loop profiler
+ *
+ * Build with -D SCAN_PROFILE to time each stage of loop() and of the
+ * scan ticks (scan_sched.h), the period of the ticks, and the latency
+ * from an encoder edge to its keys being queued. Without it the PROF_
+ * macros compile to nothing.
+ *
+ * Times are in CPU cycles: the DWT cycle counter on the Cortex-M4,
+ * SysTick and millis() on the Cortex-M0+, which has no DWT, and
+ * virtual microseconds in the native simulator. Each stage keeps
+ * count/min/max/total and a log2 histogram, bucket i counting times
+ * below 2^(i+PROF_HIST_SHIFT+1) cycles that didn't fit bucket i-1,
+ * the last bucket open ended. The whole Profile_t is readable and
+ * resettable from the host as diagnostic object DIAG_OBJ_PROFILE
+ * (tools/zyn_diag.py).
+ */
+#define PROF_BUCKETS    16
+#define PROF_HIST_SHIFT 6   /* First bucket ends at 128 cycles */
+
+//Stages
+#define PROF_LOOP       0   /* Whole loop() pass */
+#define PROF_ENCODERS   1
+#define PROF_BUTTONS    2
+#define PROF_OUTPUT     3   /* hid_flush() */
+#define PROF_LATENCY_ID 4   /* Encoder edge to keys queued */
+#define PROF_SCAN       5   /* port_scan() */
+#define PROF_TICK       6   /* Scan tick to tick, the sampling jitter */
+#define PROF_STAGES     7
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct ProfStage_s {
+  uint64_t total;
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint32_t reserved;
+  uint32_t hist[PROF_BUCKETS];
+}ProfStage_t;
+
+typedef struct Profile_s {
+  uint32_t cycles_per_us;
+  uint32_t stages;
+  ProfStage_t stage[PROF_STAGES];
+}Profile_t;
+
+#if defined(SCAN_PROFILE)
+/**************************************************************
+ * Global Variables
+ */
+Profile_t profile;
+
+/******************************************************************
+ * Procedures
+ */
+#if defined(ARDUINO_ARCH_STM32)
+inline uint32_t prof_cycles() {
+  return DWT->CYCCNT;
+}
+
+void prof_clock_init() {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  profile.cycles_per_us = SystemCoreClock / 1000000;
+}
+#elif defined(ARDUINO_ARCH_SAMD)
+uint32_t prof_cycles() {
+  uint32_t ms;
+  uint32_t val;
+  boolean pend;
+
+  do {
+    ms = millis();
+    val = SysTick->VAL;
+    pend = (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) != 0;
+  } while( ms != millis() );
+  if( pend && (val > SysTick->LOAD / 2) ) {
+    ms++; //Wrapped, but the tick interrupt hasn't run yet
+  }
+  return ms * (SysTick->LOAD + 1) + (SysTick->LOAD - val);
+}
+
+void prof_clock_init() {
+  profile.cycles_per_us = SystemCoreClock / 1000000;
+}
+#elif defined(NATIVE_SIM)
+uint32_t prof_cycles() {
+  return (uint32_t)sim_now_us;
+}
+
+void prof_clock_init() {
+  profile.cycles_per_us = 1;
+}
+#endif
+
+void prof_reset() {
+  uint32_t cycles_per_us = profile.cycles_per_us;
+
+  memset(&profile, 0, sizeof(profile));
+  profile.cycles_per_us = cycles_per_us;
+  profile.stages = PROF_STAGES;
+  for( byte i = 0; i < PROF_STAGES; i++ ) {
+    profile.stage[i].min = 0xFFFFFFFF;
+  }
+}
+
+void prof_command(byte cmd) {
+  if( cmd == DIAG_CMD_RESET ) {
+    prof_reset();
+  }
+}
+
+void prof_add(byte stage, uint32_t cycles) {
+  ProfStage_t *s = &profile.stage[stage];
+  int bucket = cycles ? (31 - __builtin_clz(cycles)) - PROF_HIST_SHIFT : 0;
+
+  s->total += cycles;
+  s->count++;
+  if( cycles < s->min ) {
+    s->min = cycles;
+  }
+  if( cycles > s->max ) {
+    s->max = cycles;
+  }
+  if( bucket < 0 ) {
+    bucket = 0;
+  }else if( bucket >= PROF_BUCKETS ) {
+    bucket = PROF_BUCKETS - 1;
+  }
+  s->hist[bucket]++;
+}
+
+void prof_init() {
+  prof_clock_init();
+  prof_reset();
+  diag_register(DIAG_OBJ_PROFILE, &profile, sizeof(profile), false, prof_command);
+}
+
+#define PROF_INIT()           prof_init()
+#define PROF_BEGIN(t)         uint32_t t = prof_cycles()
+#define PROF_NEXT(stage, t)   { uint32_t now = prof_cycles(); prof_add((stage), now - (t)); (t) = now; }
+#define PROF_END(stage, t)    prof_add((stage), prof_cycles() - (t))
+#define PROF_STAMP(t)         (t) = prof_cycles()
+#else
+#define PROF_INIT()
+#define PROF_BEGIN(t)
+#define PROF_NEXT(stage, t)
+#define PROF_END(stage, t)
+#define PROF_STAMP(t)
+#endif
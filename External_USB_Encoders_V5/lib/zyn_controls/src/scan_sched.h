@@ -0,0 +1,393 @@
+/***************************************************************
+ * Scan scheduler and clock
+ *
+ * The controls are scanned from a hardware timer interrupt at a
+ * fixed SCAN_RATE_HZ (1-8 kHz), so the sampling no longer jitters
+ * with the time loop() spends on USB. Each tick samples the polled
+ * encoders, debounces the switches every PORT_SCAN_US and queues the
+ * events; loop() is left with the output stages, which take the
+ * events out of the queue in the background.
+ *   STM32  HardwareTimer on SCAN_TIM (TIM3)
+ *   SAMD   TC4, from the 48 MHz GCLK0
+ *   native sim_timer_begin()
+ * Built with SCAN_IN_LOOP the ticks are run from loop() instead,
+ * whenever a tick period has passed. scan_stop() and scan_resume()
+ * hold the ticks while the controller sleeps (idle_sleep.h).
+ *
+ * Built with SCAN_DMA (STM32F401) no code runs per sample: TIM1
+ * requests DMA2 at SCAN_DMA_HZ, stream 5 copying GPIOA->IDR on the
+ * update and stream 1 GPIOB->IDR on compare 1, round a buffer of two
+ * halves of one tick each. The half and full transfer interrupt only
+ * flags the half as ready, and loop() takes it as a batch: port_read()
+ * returns each buffered sample in turn, the encoders are decoded from
+ * every one in which a control pin changed (all of them are sampled
+ * then, none has an edge interrupt), and the tick runs once on the
+ * last, debouncing the switches from it as usual. A half not taken
+ * before the DMA is through the other is counted in scan_dma_overruns.
+ * Events are stamped when loop() takes the batch, a tick late at most.
+ *
+ * clock_us() extends micros() to a monotonic 64 bit count of
+ * microseconds, which doesn't wrap while the unit is up. It must be
+ * called at least once per wrap of micros() (71 minutes), each tick
+ * does. Events are stamped from it, and the switches are timed from
+ * scan_ms, the tick's time in ms, with unsigned differences only.
+ */
+#if !defined(SCAN_RATE_HZ)
+#define SCAN_RATE_HZ   1000
+#endif
+#define SCAN_TICK_US   (1000000UL / SCAN_RATE_HZ)
+#define SCAN_PORT_DIV  (PORT_SCAN_US / SCAN_TICK_US) /* Ticks per debounce sample */
+#define SCAN_TIM       TIM3
+#define SCAN_IRQ_PRIO  2    /* SAMD, below USB and the encoder EIC */
+
+#if (SCAN_RATE_HZ < 1000) || (SCAN_RATE_HZ > 8000) || (1000000UL % SCAN_RATE_HZ) || (PORT_SCAN_US % SCAN_TICK_US)
+#error "SCAN_RATE_HZ must be 1000-8000 and divide PORT_SCAN_US evenly"
+#endif
+
+#if defined(SCAN_DMA)
+#if !defined(SCAN_DMA_HZ)
+#define SCAN_DMA_HZ    50000
+#endif
+#define SCAN_DMA_HALF  (SCAN_DMA_HZ / SCAN_RATE_HZ) /* Samples per tick */
+#define SCAN_DMA_CHSEL 6    /* TIM1 requests on DMA2 */
+#if !defined(ARDUINO_ARCH_STM32) && !defined(NATIVE_SIM)
+#error "SCAN_DMA is for the STM32F401"
+#endif
+#if defined(SCAN_IN_LOOP)
+#error "SCAN_DMA and SCAN_IN_LOOP don't go together"
+#endif
+#if (SCAN_DMA_HZ % SCAN_RATE_HZ) || (SCAN_DMA_HALF < 2) || (SCAN_DMA_HZ > 500000)
+#error "SCAN_DMA_HZ must be a multiple of SCAN_RATE_HZ, twice it at least and 500 kHz at most"
+#endif
+#endif
+
+//Critical sections that may also be entered from an interrupt
+#if defined(NATIVE_SIM)
+#define SCAN_LOCK()
+#define SCAN_UNLOCK()
+#else
+#define SCAN_LOCK()    uint32_t scan_primask = __get_PRIMASK(); __disable_irq()
+#define SCAN_UNLOCK()  __set_PRIMASK(scan_primask)
+#endif
+
+/**************************************************************
+ * Global Variables
+ */
+uint32_t clock_last = 0;      //micros() at the last clock_us()
+uint32_t clock_high = 0;      //Wraps of micros() so far
+volatile uint32_t scan_ms = 0; //Time of the current tick
+volatile uint32_t scan_ticks = 0;
+byte scan_port_div = 0;
+boolean scan_restart = true;  //No tick period to time until the next one
+void (*scan_callback)(void) = NULL;
+#if defined(ARDUINO_ARCH_STM32) && !defined(SCAN_IN_LOOP)
+HardwareTimer *scan_tim = NULL;
+#endif
+#if defined(SCAN_IN_LOOP)
+uint64_t scan_next_us = 0;
+#endif
+#if defined(SCAN_PROFILE)
+uint32_t scan_prof_last = 0;
+#endif
+#if defined(SCAN_DMA)
+volatile uint16_t scan_dma_buf[PORT_DMA][2 * SCAN_DMA_HALF];
+volatile byte scan_dma_ready = 0; //Halves filled, by bit
+byte scan_dma_next = 0;          //Half taken next
+uint32_t scan_dma_mask[PORT_DMA]; //Control pins, a change runs scan_sample_callback
+uint32_t scan_dma_overruns = 0;
+void (*scan_sample_callback)(void) = NULL;
+#if defined(NATIVE_SIM)
+uint16_t scan_dma_pos = 0;
+#endif
+extern uint32_t ctl_pin_mask[];
+#endif
+
+/******************************************************************
+ * Procedures
+ */
+uint64_t clock_us() {
+  uint32_t now;
+  uint64_t t;
+
+  SCAN_LOCK();
+  now = micros();
+  if( now < clock_last ) {
+    clock_high++;
+  }
+  clock_last = now;
+  t = ((uint64_t)clock_high << 32) | now;
+  SCAN_UNLOCK();
+  return t;
+}
+
+/***************************************************
+ * scan tick
+ * Timer interrupt, or loop() with SCAN_IN_LOOP
+ */
+void scan_tick() {
+  scan_ms = (uint32_t)(clock_us() / 1000);
+  if( !scan_restart ) {
+    PROF_NEXT(PROF_TICK, scan_prof_last);
+  }else {
+    PROF_STAMP(scan_prof_last);
+    scan_restart = false;
+  }
+  scan_ticks++;
+  if( ++scan_port_div >= SCAN_PORT_DIV ) {
+    PROF_BEGIN(t_scan);
+    scan_port_div = 0;
+    port_scan();
+    PROF_END(PROF_SCAN, t_scan);
+  }
+  scan_callback();
+}
+
+#if defined(ARDUINO_ARCH_SAMD) && !defined(SCAN_IN_LOOP)
+void TC4_Handler() {
+  TC4->COUNT16.INTFLAG.reg = TC_INTFLAG_MC0;
+  scan_tick();
+}
+#endif
+
+#if defined(SCAN_DMA)
+#if defined(ARDUINO_ARCH_STM32)
+//Half and full transfer of the GPIOA stream, GPIOB's is a compare behind
+extern "C" void DMA2_Stream5_IRQHandler(void) {
+  uint32_t isr = DMA2->HISR;
+
+  DMA2->HIFCR = DMA_HIFCR_CHTIF5 | DMA_HIFCR_CTCIF5 | DMA_HIFCR_CTEIF5 | DMA_HIFCR_CDMEIF5 | DMA_HIFCR_CFEIF5;
+  if( isr & DMA_HISR_HTIF5 ) {
+    scan_dma_ready |= 1;
+  }
+  if( isr & DMA_HISR_TCIF5 ) {
+    scan_dma_ready |= 2;
+  }
+}
+
+//Circular, one IDR to a buffer, half words
+void scan_dma_stream(DMA_Stream_TypeDef *stream, volatile uint32_t *src, volatile uint16_t *dst, uint32_t irqs) {
+  stream->CR = 0;
+  while( stream->CR & DMA_SxCR_EN );
+  stream->PAR = (uint32_t)src;
+  stream->M0AR = (uint32_t)dst;
+  stream->NDTR = 2 * SCAN_DMA_HALF;
+  stream->FCR = 0; //Direct mode
+  stream->CR = (SCAN_DMA_CHSEL << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PL_1 | DMA_SxCR_MSIZE_0 | DMA_SxCR_PSIZE_0 |
+               DMA_SxCR_MINC | DMA_SxCR_CIRC | irqs | DMA_SxCR_EN;
+}
+#elif defined(NATIVE_SIM)
+//The DMA requests of TIM1, on the simulator's timer
+void scan_dma_request() {
+  scan_dma_buf[0][scan_dma_pos] = sim_port_read(0);
+  scan_dma_buf[1][scan_dma_pos] = sim_port_read(1);
+  if( ++scan_dma_pos == SCAN_DMA_HALF ) {
+    scan_dma_ready |= 1;
+  }else if( scan_dma_pos == 2 * SCAN_DMA_HALF ) {
+    scan_dma_ready |= 2;
+    scan_dma_pos = 0;
+  }
+}
+#endif
+
+//port_read() of the sampled ports from the snapshot, starting with their levels now
+void scan_dma_live(boolean on) {
+  port_dma = false;
+  for( byte p = 0; p < PORT_DMA; p++ ) {
+    port_snap[p] = port_read(p);
+  }
+  port_dma = on;
+}
+
+void scan_dma_begin() {
+  for( byte p = 0; p < PORT_DMA; p++ ) {
+    scan_dma_mask[p] = ctl_pin_mask[p];
+  }
+  scan_dma_live(true);
+#if defined(ARDUINO_ARCH_STM32)
+  uint32_t clk = HAL_RCC_GetPCLK2Freq();
+
+  if( (RCC->CFGR & RCC_CFGR_PPRE2) != RCC_CFGR_PPRE2_DIV1 ) {
+    clk *= 2; //Timers run at twice a divided APB clock
+  }
+  __HAL_RCC_TIM1_CLK_ENABLE();
+  __HAL_RCC_DMA2_CLK_ENABLE();
+  DMA2->LIFCR = DMA_LIFCR_CTCIF1 | DMA_LIFCR_CHTIF1 | DMA_LIFCR_CTEIF1 | DMA_LIFCR_CDMEIF1 | DMA_LIFCR_CFEIF1;
+  DMA2->HIFCR = DMA_HIFCR_CTCIF5 | DMA_HIFCR_CHTIF5 | DMA_HIFCR_CTEIF5 | DMA_HIFCR_CDMEIF5 | DMA_HIFCR_CFEIF5;
+  scan_dma_stream(DMA2_Stream5, &GPIOA->IDR, scan_dma_buf[0], DMA_SxCR_HTIE | DMA_SxCR_TCIE);
+  scan_dma_stream(DMA2_Stream1, &GPIOB->IDR, scan_dma_buf[1], 0);
+  NVIC_SetPriority(DMA2_Stream5_IRQn, SCAN_IRQ_PRIO);
+  NVIC_EnableIRQ(DMA2_Stream5_IRQn);
+
+  TIM1->CR1 = 0;
+  TIM1->PSC = 0;
+  TIM1->ARR = clk / SCAN_DMA_HZ - 1;
+  TIM1->CCMR1 = 0; //Compare 1 frozen, for its DMA request only
+  TIM1->CCR1 = 1;
+  TIM1->CNT = 0;
+  TIM1->DIER = TIM_DIER_UDE | TIM_DIER_CC1DE;
+  TIM1->CR1 = TIM_CR1_CEN;
+#elif defined(NATIVE_SIM)
+  sim_timer_begin(1000000UL / SCAN_DMA_HZ, scan_dma_request);
+#endif
+}
+
+void scan_dma_stop() {
+#if defined(ARDUINO_ARCH_STM32)
+  TIM1->CR1 &= ~TIM_CR1_CEN;
+#elif defined(NATIVE_SIM)
+  sim_timer_end();
+#endif
+  scan_dma_live(false);
+}
+
+void scan_dma_resume() {
+#if defined(ARDUINO_ARCH_STM32)
+  TIM1->CNT = 0;
+  TIM1->CR1 |= TIM_CR1_CEN;
+#elif defined(NATIVE_SIM)
+  sim_timer_begin(1000000UL / SCAN_DMA_HZ, scan_dma_request);
+#endif
+}
+
+/***************************************************
+ * scan dma batch
+ * loop(), the samples of a half in order, then its tick
+ */
+void scan_dma_batch(byte half) {
+  const volatile uint16_t *a = &scan_dma_buf[0][half * SCAN_DMA_HALF];
+  const volatile uint16_t *b = &scan_dma_buf[1][half * SCAN_DMA_HALF];
+
+  for( int i = 0; i < SCAN_DMA_HALF; i++ ) {
+    if( ((a[i] ^ port_snap[0]) & scan_dma_mask[0]) | ((b[i] ^ port_snap[1]) & scan_dma_mask[1]) ) {
+      port_snap[0] = a[i];
+      port_snap[1] = b[i];
+      scan_sample_callback();
+    }
+  }
+  port_snap[0] = a[SCAN_DMA_HALF - 1];
+  port_snap[1] = b[SCAN_DMA_HALF - 1];
+  scan_tick();
+}
+#endif
+
+/***************************************************
+ * scan begin
+ * Start ticking, callback processes the controls after each sample.
+ * With SCAN_DMA sample decodes the encoders from each buffered sample
+ * in which a control pin changed.
+ */
+void scan_begin(void (*callback)(void), void (*sample)(void)) {
+  scan_callback = callback;
+#if !defined(SCAN_DMA)
+  (void)sample; //Only sampled ticks have it
+#endif
+#if defined(SCAN_DMA)
+  scan_sample_callback = sample;
+  scan_dma_begin();
+#elif defined(SCAN_IN_LOOP)
+  scan_next_us = clock_us();
+#elif defined(ARDUINO_ARCH_STM32)
+  scan_tim = new HardwareTimer(SCAN_TIM);
+  scan_tim->setOverflow(SCAN_RATE_HZ, HERTZ_FORMAT);
+  scan_tim->attachInterrupt(scan_tick);
+  scan_tim->resume();
+#elif defined(ARDUINO_ARCH_SAMD)
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_ID_TC4_TC5;
+  while( GCLK->STATUS.bit.SYNCBUSY );
+  TC4->COUNT16.CTRLA.reg = TC_CTRLA_SWRST;
+  while( TC4->COUNT16.CTRLA.bit.SWRST );
+  TC4->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_WAVEGEN_MFRQ | TC_CTRLA_PRESCALER_DIV16;
+  TC4->COUNT16.CC[0].reg = (F_CPU / 16) / SCAN_RATE_HZ - 1;
+  while( TC4->COUNT16.STATUS.bit.SYNCBUSY );
+  TC4->COUNT16.INTENSET.reg = TC_INTENSET_MC0;
+  NVIC_SetPriority(TC4_IRQn, SCAN_IRQ_PRIO);
+  NVIC_EnableIRQ(TC4_IRQn);
+  TC4->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+  while( TC4->COUNT16.STATUS.bit.SYNCBUSY );
+#elif defined(NATIVE_SIM)
+  sim_timer_begin(SCAN_TICK_US, scan_tick);
+#endif
+}
+
+/***************************************************
+ * scan stop
+ * Hold the ticks, scan_resume() starts them again
+ */
+void scan_stop() {
+#if defined(SCAN_DMA)
+  scan_dma_stop();
+#elif defined(SCAN_IN_LOOP)
+  //Nothing runs, loop() doesn't call scan_service() while asleep
+#elif defined(ARDUINO_ARCH_STM32)
+  scan_tim->pause();
+#elif defined(ARDUINO_ARCH_SAMD)
+  TC4->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE;
+  while( TC4->COUNT16.STATUS.bit.SYNCBUSY );
+#elif defined(NATIVE_SIM)
+  sim_timer_end();
+#endif
+}
+
+/***************************************************
+ * scan resume
+ * Tick now, from loop(), then from the timer again a period later
+ */
+void scan_resume() {
+  scan_restart = true;
+#if defined(SCAN_DMA)
+  scan_dma_live(true); //The tick below samples the ports as they are now
+#endif
+  scan_tick();
+#if defined(SCAN_DMA)
+  scan_dma_resume();
+#elif defined(SCAN_IN_LOOP)
+  scan_next_us = clock_us() + SCAN_TICK_US;
+#elif defined(ARDUINO_ARCH_STM32)
+  scan_tim->setCount(0);
+  scan_tim->resume();
+#elif defined(ARDUINO_ARCH_SAMD)
+  TC4->COUNT16.COUNT.reg = 0;
+  while( TC4->COUNT16.STATUS.bit.SYNCBUSY );
+  TC4->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+  while( TC4->COUNT16.STATUS.bit.SYNCBUSY );
+#elif defined(NATIVE_SIM)
+  sim_timer_begin(SCAN_TICK_US, scan_tick);
+#endif
+}
+
+/***************************************************
+ * scan service
+ * SCAN_IN_LOOP, run the ticks that are due, at most one per pass.
+ * SCAN_DMA, take the half the DMA has filled.
+ */
+void scan_service() {
+#if defined(SCAN_DMA)
+  byte ready = scan_dma_ready;
+
+  if( !ready ) {
+    return;
+  }
+  if( !(ready & (1 << scan_dma_next)) ) {
+    scan_dma_next ^= 1; //Resync, after a sleep
+  }
+  noInterrupts();
+  scan_dma_ready &= ~(1 << scan_dma_next);
+  interrupts();
+  if( ready == 3 ) {
+    scan_dma_overruns++; //The DMA is through the other half, into this one
+  }
+  scan_dma_batch(scan_dma_next);
+  scan_dma_next ^= 1;
+#elif defined(SCAN_IN_LOOP)
+  uint64_t now = clock_us();
+
+  if( now < scan_next_us ) {
+    return;
+  }
+  scan_next_us += SCAN_TICK_US;
+  if( now >= scan_next_us ) {
+    scan_next_us = now + SCAN_TICK_US; //Fell behind, don't burst to catch up
+  }
+  scan_tick();
+#endif
+}
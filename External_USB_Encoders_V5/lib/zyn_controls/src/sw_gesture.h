@@ -0,0 +1,109 @@
+/***************************************************************
+ * Switch gestures
+ *
+ * SW_CLASSIFY tells short, bold and long presses apart by the global
+ * sw_bold/sw_long times and only knows which it was on the release.
+ * A map with SW_GESTURE carries its own times instead and sends
+ *   tap          key_switch with mod_short
+ *   double tap   key_switch with mod_bold
+ *   triple tap   key_switch with mod_long
+ *   hold         key_hold (or the tap key), again every gest_repeat
+ *                while held
+ * gest_taps says how many taps the map tells apart. The last press
+ * of a tap is held shorter than gest_hold, and the next one starts
+ * within gest_tap of its release.
+ *
+ * Each state has a deadline, the scan_ms at which it runs out, and a
+ * gesture is sent as soon as nothing else can still follow: on the
+ * release of the gest_taps-th tap (at once for a single tap map, as
+ * fast as SW_KEY), when gest_tap passes after the release of fewer
+ * taps, or when gest_hold passes while the first press is still down.
+ * A press held past gest_hold after other taps sends their count at
+ * that deadline and nothing on the release. The wait is never longer
+ * than gest_tap or gest_hold, whichever applies.
+ */
+#define GEST_TAPS_MAX  3
+
+//SwitchState_t gesture
+#define GEST_IDLE      0
+#define GEST_DOWN      1 /* Pressed, until released or gest_hold */
+#define GEST_UP        2 /* Released, until pressed again or gest_tap */
+#define GEST_HELD      3 /* Held past gest_hold, until released */
+
+/******************************************************************
+ * Procedures
+ */
+inline boolean gesture_due(SwitchState_t *state) {
+  return (int32_t)(scan_ms - state->deadline) >= 0;
+}
+
+void gesture_send(KeyMap_t *k_map, byte taps) {
+  char mod = (taps >= 3) ? k_map->mod_long : (taps == 2) ? k_map->mod_bold : k_map->mod_short;
+
+  COMBO_KEY(k_map->key_switch, mod, KEY_NONE);
+}
+
+void gesture_hold(KeyMap_t *k_map) {
+  if( k_map->key_hold != KEY_NONE ) {
+    COMBO_KEY(k_map->key_hold, KEY_NONE, KEY_NONE);
+  }else {
+    gesture_send(k_map, 1);
+  }
+}
+
+/************************************************************************
+ * press_gesture ( map, switch )
+ * Run the gesture state of a switch one scan tick on
+ */
+void press_gesture(KeyMap_t *k_map, SwitchState_t *state) {
+  boolean down = port_pressed(&state->pin);
+  byte taps_max = constrain(k_map->gest_taps, 1, GEST_TAPS_MAX);
+
+  switch( state->gesture ) {
+  case GEST_DOWN:
+    if( !down ) {
+      if( state->taps >= taps_max ) {
+        gesture_send(k_map, state->taps); //Nothing more to wait for
+        state->gesture = GEST_IDLE;
+      }else {
+        state->gesture = GEST_UP;
+        state->deadline = scan_ms + 10 * k_map->gest_tap;
+      }
+    }else if( k_map->gest_hold && gesture_due(state) ) {
+      if( state->taps == 1 ) {
+        gesture_hold(k_map);
+      }else {
+        gesture_send(k_map, state->taps);
+      }
+      state->gesture = GEST_HELD;
+      state->deadline = scan_ms + 10 * k_map->gest_repeat;
+    }
+    break;
+  case GEST_UP:
+    if( down ) {
+      state->taps++;
+      state->gesture = GEST_DOWN;
+      state->deadline = scan_ms + 10 * k_map->gest_hold;
+    }else if( gesture_due(state) ) {
+      gesture_send(k_map, state->taps);
+      state->gesture = GEST_IDLE;
+    }
+    break;
+  case GEST_HELD:
+    if( !down ) {
+      state->gesture = GEST_IDLE;
+    }else if( (state->taps == 1) && k_map->gest_repeat && gesture_due(state) ) {
+      gesture_hold(k_map);
+      state->deadline += 10 * k_map->gest_repeat;
+    }
+    break;
+  default:
+    if( down ) {
+      state->taps = 1;
+      state->gesture = GEST_DOWN;
+      state->deadline = scan_ms + 10 * k_map->gest_hold;
+    }
+    break;
+  }
+  state->down = down;
+}
@@ -0,0 +1,214 @@
+/***************************************************************
+ * Input trace recorder
+ *
+ * Keeps the last TRACE_LEN events in a RAM ring, so what a unit in the
+ * field did can be read back and replayed:
+ *   TRACE_REC_PORT    levels of the control pins of a port (ENCx_A/B/SW,
+ *                     SWx and the rotation strap) whenever one of
+ *                     them changed, taken on every scan tick and in
+ *                     the encoder ISRs, so the edges of interrupt
+ *                     driven encoders are exact
+ *   TRACE_REC_REPORT  4 bytes of a keyboard report as sent, arg is the
+ *                     offset, a report takes len / 4 records
+ *   TRACE_REC_MIDI    a MIDI event packet as sent
+ * Each record is stamped with the low 32 bits of clock_us().
+ *
+ * The log is diagnostic object DIAG_OBJ_TRACE. The host freezes it
+ * (TRACE_CMD_FREEZE) while reading it, so the ring doesn't move under
+ * the reads, and runs it again after; DIAG_CMD_RESET empties it.
+ * tools/zyn_diag.py trace save stores it, tools/trace_replay.py turns
+ * it into a timeline for the native simulator and checks the reports
+ * the firmware makes of it against the ones recorded.
+ *
+ * -D TRACE_LEN=0 leaves the recorder out.
+ */
+#if !defined(TRACE_LEN)
+#define TRACE_LEN      256  /* Records, power of 2 */
+#endif
+#if (TRACE_LEN & (TRACE_LEN - 1)) || (TRACE_LEN > 4096)
+#error "TRACE_LEN must be a power of 2, 4096 at most"
+#endif
+
+//Record types
+#define TRACE_REC_PORT   1
+#define TRACE_REC_REPORT 2
+#define TRACE_REC_MIDI   3
+
+//Commands, besides DIAG_CMD_RESET
+#define TRACE_CMD_FREEZE 4
+#define TRACE_CMD_RUN    5
+
+//Where the log was taken, for the replay's pin names
+#define TRACE_ARCH_STM32  1
+#define TRACE_ARCH_SAMD   2
+#define TRACE_ARCH_NATIVE 3
+#if defined(ARDUINO_ARCH_STM32)
+#define TRACE_ARCH     TRACE_ARCH_STM32
+#elif defined(ARDUINO_ARCH_SAMD)
+#define TRACE_ARCH     TRACE_ARCH_SAMD
+#else
+#define TRACE_ARCH     TRACE_ARCH_NATIVE
+#endif
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct TraceRec_s {
+  uint32_t t_us;  //clock_us(), low 32 bits
+  byte type;      //TRACE_REC_
+  byte arg;       //Port, or offset into the report
+  byte len;       //Report length
+  byte reserved;
+  uint32_t data;  //Pin levels, or 4 bytes of the report or packet
+}TraceRec_t;
+
+typedef struct TraceLog_s {
+  byte arch;                //TRACE_ARCH_
+  byte ports;               //PORT_COUNT
+  byte frozen;
+  byte exps;                //EXP_COUNT, the last ports are expanders
+  uint32_t len;             //TRACE_LEN
+  uint32_t head;            //Next record to write
+  uint32_t count;           //Records held
+  uint32_t lost;            //Records overwritten
+  uint32_t mask[PORT_COUNT];  //Control pins
+  uint32_t base[PORT_COUNT];  //Their levels before the oldest record
+  TraceRec_t rec[TRACE_LEN];
+}TraceLog_t;
+
+#if TRACE_LEN
+/**************************************************************
+ * Global Variables
+ */
+TraceLog_t trace;
+uint32_t trace_levels[PORT_COUNT]; //Levels last recorded
+
+/******************************************************************
+ * Procedures
+ */
+//Caller holds SCAN_LOCK
+void trace_store(byte type, byte arg, byte len, uint32_t data) {
+  TraceRec_t *rec;
+
+  if( trace.frozen ) {
+    return;
+  }
+  rec = &trace.rec[trace.head];
+  if( trace.count == TRACE_LEN ) {
+    if( rec->type == TRACE_REC_PORT ) {
+      trace.base[rec->arg] = rec->data;
+    }
+    trace.lost++;
+  }else {
+    trace.count++;
+  }
+  rec->t_us = (uint32_t)clock_us();
+  rec->type = type;
+  rec->arg = arg;
+  rec->len = len;
+  rec->reserved = 0;
+  rec->data = data;
+  trace.head = (trace.head + 1) & (TRACE_LEN - 1);
+}
+
+void trace_push(byte type, byte arg, byte len, uint32_t data) {
+  SCAN_LOCK();
+  trace_store(type, arg, len, data);
+  SCAN_UNLOCK();
+}
+
+/***************************************************
+ * trace ports
+ * Record the ports whose control pins changed, scan tick and ISRs.
+ * The ports are read, compared and recorded in one go, an edge ISR
+ * can't slip in between and leave trace_levels behind the records.
+ * Frozen, trace_levels stays with the last record, the first tick
+ * after TRACE_CMD_RUN records what changed meanwhile.
+ */
+void trace_ports() {
+  uint32_t levels;
+
+  SCAN_LOCK();
+  if( trace.frozen ) {
+    SCAN_UNLOCK();
+    return;
+  }
+  for( byte p = 0; p < PORT_COUNT; p++ ) {
+    levels = port_read(p) & trace.mask[p];
+    if( levels != trace_levels[p] ) {
+      trace_levels[p] = levels;
+      trace_store(TRACE_REC_PORT, p, 0, levels);
+    }
+  }
+  SCAN_UNLOCK();
+}
+
+void trace_report(const byte *rep, byte len) {
+  uint32_t data;
+
+  for( byte i = 0; i < len; i += 4 ) {
+    data = 0;
+    memcpy(&data, rep + i, (len - i < 4) ? len - i : 4);
+    trace_push(TRACE_REC_REPORT, i, len, data);
+  }
+}
+
+//From the USB interrupt, trace_levels moves with the scan tick and
+//the edge ISRs
+void trace_reset() {
+  SCAN_LOCK();
+  trace.head = 0;
+  trace.count = 0;
+  trace.lost = 0;
+  memcpy(trace.base, trace_levels, sizeof(trace.base));
+  trace.frozen = false;
+  SCAN_UNLOCK();
+}
+
+void trace_command(byte cmd) {
+  switch( cmd ) {
+  case DIAG_CMD_RESET:
+    trace_reset();
+    break;
+  case TRACE_CMD_FREEZE:
+    trace.frozen = true;
+    break;
+  case TRACE_CMD_RUN:
+    trace.frozen = false;
+    break;
+  }
+}
+
+/***************************************************
+ * trace init
+ * After controls_set_gpio(), mask holds the control pins of each port
+ */
+void trace_init(const uint32_t *mask) {
+  PortPin_t strap = port_pin(pin_invert);
+
+  memset(&trace, 0, sizeof(trace));
+  trace.arch = TRACE_ARCH;
+  trace.ports = PORT_COUNT;
+  trace.exps = EXP_COUNT;
+  trace.len = TRACE_LEN;
+  for( byte p = 0; p < PORT_COUNT; p++ ) {
+    trace.mask[p] = mask[p];
+  }
+  trace.mask[strap.port] |= strap.mask; //The rotation strap, for the replay
+  for( byte p = 0; p < PORT_COUNT; p++ ) {
+    trace_levels[p] = port_read(p) & trace.mask[p];
+  }
+  memcpy(trace.base, trace_levels, sizeof(trace.base));
+  diag_register(DIAG_OBJ_TRACE, &trace, sizeof(trace), false, trace_command);
+}
+
+#define TRACE_PORTS()             trace_ports()
+#define TRACE_REPORT(rep, len)    trace_report((const byte *)(rep), (len))
+#define TRACE_MIDI(pkt)           { uint32_t d; memcpy(&d, (pkt), 4); trace_push(TRACE_REC_MIDI, 0, 4, d); }
+#define TRACE_INIT(mask)          trace_init(mask)
+#else
+#define TRACE_PORTS()
+#define TRACE_REPORT(rep, len)
+#define TRACE_MIDI(pkt)
+#define TRACE_INIT(mask)
+#endif
@@ -0,0 +1,198 @@
+/***************************************************************
+ * USB boot state
+ *
+ * setup() no longer sleeps before and after bringing USB up: the
+ * controls are scanned from reset and whatever they make waits in the
+ * output queue (event_queue.h) and the decoders until the host has
+ * configured us. boot_service() follows the enumeration from loop():
+ *
+ *   BOOT_ENUMERATING  not configured (yet, or again after a reset or
+ *                     unplug of the bus), LED blinking, events held
+ *   BOOT_CONFIGURED   just configured, the backlog is sent or, built
+ *                     with BOOT_DISCARD, thrown away with the detents
+ *                     still counted in the decoders
+ *   BOOT_RUNNING      configured, LED off
+ *   BOOT_SUSPENDED    the host suspended the bus, LED off, events held;
+ *                     new input signals remote wakeup, again every
+ *                     BOOT_WAKEUP_MS while the host doesn't resume
+ *
+ * The queue stays bounded through all of them, while the host is away
+ * the oldest event makes room for a new one. When the host comes back
+ * from a suspend, or configures us again after a bus reset (the
+ * zynthian rebooted), presses and detents older than OUT_MAX_AGE_MS
+ * are dropped rather than replayed long after the fact; anything more
+ * recent, the first turn made while the host was still booting, goes
+ * out at once. A reset and new configuration between two passes is
+ * caught by usb_configs().
+ *
+ * The times from reset to the first configuration and to the first
+ * report sent are kept, with the backlog figures and the suspend
+ * counters, in diagnostic object DIAG_OBJ_BOOT (tools/zyn_diag.py boot).
+ */
+#define BOOT_ENUMERATING 0
+#define BOOT_CONFIGURED  1
+#define BOOT_RUNNING     2
+#define BOOT_SUSPENDED   3
+
+#define BOOT_BLINK_MS    125 /* LED half period while enumerating */
+#define BOOT_LED_ON      0   /* LED driven as setup() always had it */
+#define BOOT_LED_OFF     1
+#define BOOT_WAKEUP_MS   1000 /* Remote wakeup retried while not resumed */
+
+#if !defined(OUT_MAX_AGE_MS)
+#define OUT_MAX_AGE_MS   1000 /* Oldest press sent when the host is back, 0 = any */
+#endif
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct BootStats_s {
+  uint32_t configured_ms;   //Reset to the first configuration
+  uint32_t first_report_ms; //Reset to the first report sent, 0 until then
+  uint32_t configures;      //Times the host configured us
+  uint32_t backlog;         //Events queued when first configured
+  uint32_t discarded;       //Events thrown away by BOOT_DISCARD
+  uint32_t suspends;        //Times the host suspended the bus
+  uint32_t wakeups;         //Remote wakeups signalled
+  uint32_t expired;         //Events older than OUT_MAX_AGE_MS dropped
+  uint32_t stale;           //Detents older than that dropped
+}BootStats_t;
+
+/**************************************************************
+ * Global Variables
+ */
+BootStats_t boot_stats;
+byte boot_state = BOOT_ENUMERATING;
+uint32_t boot_configs = 0;  //usb_configs() when last configured
+boolean boot_woken = false; //Remote wakeup tried during this suspend
+uint32_t boot_wake_ms = 0;  //millis() of the last try
+
+/******************************************************************
+ * Procedures
+ */
+void boot_init() {
+  memset(&boot_stats, 0, sizeof(boot_stats));
+  diag_register(DIAG_OBJ_BOOT, &boot_stats, sizeof(boot_stats), false, NULL);
+}
+
+//Anything sent yet, on either interface
+boolean boot_reported() {
+#if defined(USB_MIDI)
+  return hid_reports || midi_transfers;
+#else
+  return hid_reports;
+#endif
+}
+
+/***************************************************
+ * boot expire
+ * Drop the queued presses and the detents counted in the decoders
+ * that are older than OUT_MAX_AGE_MS. Releases go out whatever their
+ * age, the press may have been sent before the host went away.
+ */
+void boot_expire() {
+#if OUT_MAX_AGE_MS
+  uint32_t now_us = (uint32_t)clock_us();
+  QuadEnc_t *quad;
+
+  for( byte route = 0; route < OUT_ROUTES; route++ ) {
+    for( int i = out_next(route, -1); i >= 0; i = out_next(route, i) ) {
+      if( ((now_us - out_queue[i].t_us) > OUT_MAX_AGE_MS * 1000UL) && !out_is_release(&out_queue[i]) ) {
+        out_release(i);
+        boot_stats.expired++;
+      }
+    }
+  }
+  for( int i = 0; i < enc_count; i++ ) {
+    quad = &enc_state[i].quad;
+    if( quad->count && ((uint32_t)(millis() - quad->last_ms) > OUT_MAX_AGE_MS) ) {
+      boot_stats.stale += abs(quad_drain(quad));
+    }
+  }
+#endif
+}
+
+/***************************************************
+ * boot configured
+ * The host configured us, the first time or again after a reset
+ */
+void boot_configured(uint32_t configs) {
+  if( !boot_stats.configures ) {
+    boot_stats.configured_ms = millis();
+    boot_stats.backlog = out_q_count;
+#if defined(BOOT_DISCARD)
+    boot_stats.discarded = out_discard();
+    for( int i = 0; i < enc_count; i++ ) {
+      quad_drain(&enc_state[i].quad);
+    }
+#endif
+  }else {
+    boot_expire(); //Back after a reset of the bus
+  }
+  boot_stats.configures++;
+  boot_configs = configs;
+  if( led != PIN_NA ) {
+    digitalWrite(led, BOOT_LED_OFF);
+  }
+  boot_state = BOOT_RUNNING;
+}
+
+/***************************************************
+ * boot service
+ * Call on every pass, before the controls are processed
+ */
+void boot_service() {
+  boolean up = usb_configured();
+  uint32_t configs = usb_configs();
+
+  switch( boot_state ) {
+  case BOOT_ENUMERATING:
+    if( !up ) {
+      if( led != PIN_NA ) {
+        //Dark while a host that never configured us suspends the bus
+        digitalWrite(led, (usb_suspended() || ((millis() / BOOT_BLINK_MS) & 1)) ? BOOT_LED_OFF : BOOT_LED_ON);
+      }
+      break;
+    }
+    boot_configured(configs); //Before anything can be sent
+    break;
+
+  case BOOT_CONFIGURED:
+    boot_configured(configs);
+    break;
+
+  case BOOT_RUNNING:
+    if( usb_suspended() ) {
+      boot_stats.suspends++;
+      boot_woken = false;
+      boot_state = BOOT_SUSPENDED;
+    }else if( !up ) {
+      boot_state = BOOT_ENUMERATING;
+    }else if( configs != boot_configs ) {
+      boot_state = BOOT_CONFIGURED; //Reset and configured again since the last pass
+    }else if( !boot_stats.first_report_ms && boot_reported() ) {
+      boot_stats.first_report_ms = millis();
+    }
+    break;
+
+  case BOOT_SUSPENDED:
+    if( usb_suspended() ) {
+      //Anything queued is input made during the suspend
+      if( out_q_count && (!boot_woken || ((uint32_t)(millis() - boot_wake_ms) >= BOOT_WAKEUP_MS)) ) {
+        if( usb_wakeup() ) {
+          boot_stats.wakeups++;
+        }
+        boot_woken = true;
+        boot_wake_ms = millis();
+      }
+    }else if( !up ) {
+      boot_state = BOOT_ENUMERATING; //Reset out of the suspend
+    }else if( configs != boot_configs ) {
+      boot_state = BOOT_CONFIGURED;
+    }else {
+      boot_expire(); //Resumed
+      boot_state = BOOT_RUNNING;
+    }
+    break;
+  }
+}
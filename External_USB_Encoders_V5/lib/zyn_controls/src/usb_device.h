@@ -0,0 +1,92 @@
+/***************************************************************
+ * USB device
+ *
+ * One interface to the USB stack of each board:
+ *   usb_begin()       bring the device up, replaces Keyboard.begin()
+ *   usb_service()     call on every pass, for what the stack leaves
+ *                     to loop()
+ *   usb_configured()  the host has configured us, and the bus isn't
+ *                     suspended
+ *   usb_suspended()   the host suspended the bus
+ *   usb_configs()     times the host configured us since reset, a new
+ *                     one after every bus reset
+ *   usb_wakeup()      signal remote wakeup while suspended, if the host
+ *                     allows it
+ *   usb_kbd_ready()   a keyboard report can be sent now
+ *   usb_kbd_boot()    the host wants boot protocol reports
+ *   usb_kbd_send()    send a keyboard report, 8 byte boot or HID_NKRO
+ *   usb_midi_ready()  USB_MIDI builds, a MIDI transfer can be sent now
+ *   usb_midi_send()   send USB MIDI event packets, 64 bytes at most
+ * The diagnostic HID interface of usb_diag.h comes with it.
+ */
+#include "usb_diag.h"
+#if defined(USB_MIDI)
+#include "usb_midi.h"
+#endif
+
+/***************************************************
+ * usb desc input bits
+ * Size of the Input items of a report descriptor from offset i on,
+ * in bits, for checking a report against its struct at compile time.
+ * Report Size and Report Count are the only globals followed.
+ */
+constexpr uint16_t usb_desc_input_bits(const byte *desc, uint16_t len, uint16_t i = 0, uint16_t size = 0, uint16_t count = 0) {
+  return (i >= len) ? 0 :
+         (desc[i] == 0x75) ? usb_desc_input_bits(desc, len, i + 2, desc[i + 1], count) :
+         (desc[i] == 0x95) ? usb_desc_input_bits(desc, len, i + 2, size, desc[i + 1]) :
+         size * count * ((desc[i] & 0xFC) == 0x80) +
+         usb_desc_input_bits(desc, len, i + 1 + ((desc[i] & 3) == 3 ? 4 : desc[i] & 3), size, count);
+}
+
+#if defined(ARDUINO_ARCH_STM32)
+#include "usb_stm32.h"
+#elif defined(ARDUINO_ARCH_SAMD)
+#include "usb_samd.h"
+#elif defined(NATIVE_SIM)
+#include <sim.h>
+
+void usb_begin() {
+  sim_usb_begin();
+}
+
+void usb_service() {
+}
+
+boolean usb_configured() {
+  return sim_usb_configured();
+}
+
+boolean usb_suspended() {
+  return sim_usb_suspended();
+}
+
+uint32_t usb_configs() {
+  return sim_usb_configs();
+}
+
+boolean usb_wakeup() {
+  return sim_usb_wakeup();
+}
+
+boolean usb_kbd_ready() {
+  return sim_hid_ready();
+}
+
+boolean usb_kbd_boot() {
+  return false;
+}
+
+void usb_kbd_send(const byte *rep, uint16_t len) {
+  sim_hid_report(rep, len);
+}
+
+#if defined(USB_MIDI)
+boolean usb_midi_ready() {
+  return sim_midi_ready();
+}
+
+void usb_midi_send(const byte *buf, uint16_t len) {
+  sim_midi_send(buf, len);
+}
+#endif
+#endif
@@ -0,0 +1,164 @@
+/***************************************************************
+ * Diagnostic channel
+ *
+ * A vendor defined HID interface (usage page 0xFF00) next to the
+ * keyboard, carrying two feature reports:
+ *   ID 1, host -> device, 7 bytes: obj, cmd, offset (16 bit LE), arg[3]
+ *   ID 2, both ways, 63 bytes:      obj, n, offset (16 bit LE),
+ *                                   size (16 bit LE), data[57]
+ * Each subsystem registers the RAM objects it exposes with
+ * diag_register(), into the slot of the object's ID; an ID past
+ * DIAG_MAX_OBJS fails the build. A host selects an object and offset with report 1
+ * (DIAG_CMD_SELECT), then every GET of report 2 returns the next chunk
+ * of it. A SET of report 2 writes its data at the offset it carries,
+ * if the object is writable, then calls the object's command hook
+ * with DIAG_CMD_WRITTEN. Any other command is passed to the
+ * object's command hook, e.g. DIAG_CMD_RESET.
+ *
+ * Reads are not atomic against loop(), a chunk may mix two passes.
+ * tools/zyn_diag.py is the host side.
+ */
+#define DIAG_MAX_OBJS    16 /* Object IDs 1-16 */
+#define DIAG_CMD_LEN     7
+#define DIAG_DATA_LEN    63
+#define DIAG_CHUNK       (DIAG_DATA_LEN - 6)
+
+#define DIAG_REPORT_CMD  1
+#define DIAG_REPORT_DATA 2
+
+#define DIAG_CMD_SELECT   0
+#define DIAG_CMD_RESET    1 /* Clear statistics */
+#define DIAG_CMD_COMMIT   2 /* Store to flash */
+#define DIAG_CMD_DEFAULTS 3 /* Back to the compiled in values */
+#define DIAG_CMD_WRITTEN  0x80 /* Device side, after a host write */
+
+//Object IDs
+#define DIAG_OBJ_PROFILE  1
+#define DIAG_OBJ_ENC_MAPS 2
+#define DIAG_OBJ_BTN_MAPS 3
+#define DIAG_OBJ_BOOT     4
+#define DIAG_OBJ_IDLE     5
+#define DIAG_OBJ_TRACE    6
+#define DIAG_OBJ_QUEUE    7
+#define DIAG_OBJ_ENC_STATS 8
+#define DIAG_OBJ_LAST     DIAG_OBJ_ENC_STATS /* Move along with new IDs */
+
+static_assert(DIAG_OBJ_LAST <= DIAG_MAX_OBJS, "Raise DIAG_MAX_OBJS for the new diagnostic objects");
+
+/**************************************************************
+ * Typedefs
+ */
+typedef struct DiagObj_s {
+  void *data;
+  uint16_t size;
+  boolean writable;
+  void (*command)(byte cmd); //Called from the USB interrupt
+}DiagObj_t;
+
+/**************************************************************
+ * Global Variables
+ */
+const byte diag_report_desc[] = {
+  0x06, 0x00, 0xFF,        //Usage Page (Vendor 0xFF00)
+  0x09, 0x01,              //Usage (1)
+  0xA1, 0x01,              //Collection (Application)
+  0x15, 0x00,              //  Logical Minimum (0)
+  0x26, 0xFF, 0x00,        //  Logical Maximum (255)
+  0x75, 0x08,              //  Report Size (8)
+  0x85, DIAG_REPORT_CMD,   //  Report ID (1)
+  0x95, DIAG_CMD_LEN,      //  Report Count (7)
+  0x09, 0x02,              //  Usage (2)
+  0xB1, 0x02,              //  Feature (Data,Var,Abs)
+  0x85, DIAG_REPORT_DATA,  //  Report ID (2)
+  0x95, DIAG_DATA_LEN,     //  Report Count (63)
+  0x09, 0x03,              //  Usage (3)
+  0xB1, 0x02,              //  Feature (Data,Var,Abs)
+  0xC0                     //End Collection
+};
+
+DiagObj_t diag_objs[DIAG_MAX_OBJS]; //By ID - 1, unregistered ones have no data
+byte diag_sel_obj = 0;
+uint16_t diag_sel_offset = 0;
+
+/******************************************************************
+ * Procedures
+ */
+void diag_register(byte id, void *data, uint16_t size, boolean writable, void (*command)(byte cmd)) {
+  DiagObj_t *obj = &diag_objs[id - 1]; //IDs are checked against DIAG_MAX_OBJS above
+
+  obj->data = data;
+  obj->size = size;
+  obj->writable = writable;
+  obj->command = command;
+}
+
+DiagObj_t *diag_find(byte id) {
+  if( !id || (id > DIAG_MAX_OBJS) || !diag_objs[id - 1].data ) {
+    return NULL;
+  }
+  return &diag_objs[id - 1];
+}
+
+/***************************************************
+ * diag get feature
+ * Fill a GET_REPORT, buf has room for the report ID too.
+ * Returns the length to send, 0 to stall.
+ */
+uint16_t diag_get_feature(byte id, byte *buf) {
+  DiagObj_t *obj = diag_find(diag_sel_obj);
+  uint16_t n = 0;
+
+  if( id != DIAG_REPORT_DATA ) {
+    return 0;
+  }
+  memset(buf, 0, DIAG_DATA_LEN + 1);
+  buf[0] = id;
+  buf[1] = diag_sel_obj;
+  if( obj && (diag_sel_offset < obj->size) ) {
+    n = obj->size - diag_sel_offset;
+    if( n > DIAG_CHUNK ) {
+      n = DIAG_CHUNK;
+    }
+    memcpy(&buf[7], (byte *)obj->data + diag_sel_offset, n);
+  }
+  buf[2] = n;
+  buf[3] = diag_sel_offset & 0xFF;
+  buf[4] = diag_sel_offset >> 8;
+  buf[5] = obj ? (obj->size & 0xFF) : 0;
+  buf[6] = obj ? (obj->size >> 8) : 0;
+  diag_sel_offset += n;
+  return DIAG_DATA_LEN + 1;
+}
+
+/***************************************************
+ * diag set feature
+ * Handle a SET_REPORT, buf starts with the report ID
+ */
+void diag_set_feature(const byte *buf, uint16_t len) {
+  DiagObj_t *obj;
+  uint16_t offset;
+  byte n;
+
+  if( len < 5 ) {
+    return;
+  }
+  obj = diag_find(buf[1]);
+  offset = buf[3] | (buf[4] << 8);
+
+  if( buf[0] == DIAG_REPORT_CMD ) {
+    diag_sel_obj = buf[1];
+    diag_sel_offset = offset;
+    if( (buf[2] != DIAG_CMD_SELECT) && obj && obj->command ) {
+      obj->command(buf[2]);
+    }
+  }else if( buf[0] == DIAG_REPORT_DATA ) {
+    n = buf[2];
+    if( !obj || !obj->writable || (n > DIAG_CHUNK) || (len < 7 + n) || (offset + n > obj->size) ) {
+      return;
+    }
+    memcpy((byte *)obj->data + offset, &buf[7], n);
+    if( obj->command ) {
+      obj->command(DIAG_CMD_WRITTEN);
+    }
+  }
+}
@@ -0,0 +1,42 @@
+/***************************************************************
+ * USB MIDI interface
+ *
+ * Class compliant USB MIDI 1.0: an Audio Control interface and a
+ * MIDIStreaming interface with one embedded jack each way, a bulk OUT
+ * endpoint (incoming MIDI is taken and dropped) and a bulk IN
+ * endpoint. Included by the USB backends when built with USB_MIDI.
+ * USB_MIDI_DESC() is the whole interface block, as bytes.
+ */
+#define USB_MIDI_EP_SIZE      64
+#define USB_MIDI_DESC_LEN     92
+#define USB_MIDI_CS_LEN       65   /* Class specific MS descriptors */
+
+#define USB_AUDIO_CLASS       0x01
+#define USB_AUDIO_CONTROL     0x01
+#define USB_AUDIO_STREAMING   0x03
+#define USB_CS_INTERFACE      0x24
+#define USB_CS_ENDPOINT       0x25
+
+//Jack IDs
+#define USB_MIDI_JACK_IN_EMB  1
+#define USB_MIDI_JACK_IN_EXT  2
+#define USB_MIDI_JACK_OUT_EMB 3
+#define USB_MIDI_JACK_OUT_EXT 4
+
+#define USB_MIDI_DESC(if_ac, ep_out, ep_in) \
+  /* Audio Control */ \
+  0x09, 0x04, (if_ac), 0x00, 0x00, USB_AUDIO_CLASS, USB_AUDIO_CONTROL, 0x00, 0x00, \
+  0x09, USB_CS_INTERFACE, 0x01, 0x00, 0x01, 0x09, 0x00, 0x01, (byte)((if_ac) + 1), \
+  /* MIDIStreaming */ \
+  0x09, 0x04, (byte)((if_ac) + 1), 0x00, 0x02, USB_AUDIO_CLASS, USB_AUDIO_STREAMING, 0x00, 0x00, \
+  0x07, USB_CS_INTERFACE, 0x01, 0x00, 0x01, USB_MIDI_CS_LEN, 0x00, \
+  0x06, USB_CS_INTERFACE, 0x02, 0x01, USB_MIDI_JACK_IN_EMB, 0x00, \
+  0x06, USB_CS_INTERFACE, 0x02, 0x02, USB_MIDI_JACK_IN_EXT, 0x00, \
+  0x09, USB_CS_INTERFACE, 0x03, 0x01, USB_MIDI_JACK_OUT_EMB, 0x01, USB_MIDI_JACK_IN_EXT, 0x01, 0x00, \
+  0x09, USB_CS_INTERFACE, 0x03, 0x02, USB_MIDI_JACK_OUT_EXT, 0x01, USB_MIDI_JACK_IN_EMB, 0x01, 0x00, \
+  /* Bulk OUT, host to embedded IN jack */ \
+  0x09, 0x05, (ep_out), 0x02, USB_MIDI_EP_SIZE, 0x00, 0x00, 0x00, 0x00, \
+  0x05, USB_CS_ENDPOINT, 0x01, 0x01, USB_MIDI_JACK_IN_EMB, \
+  /* Bulk IN, embedded OUT jack to host */ \
+  0x09, 0x05, (ep_in), 0x02, USB_MIDI_EP_SIZE, 0x00, 0x00, 0x00, 0x00, \
+  0x05, USB_CS_ENDPOINT, 0x01, 0x01, USB_MIDI_JACK_OUT_EMB
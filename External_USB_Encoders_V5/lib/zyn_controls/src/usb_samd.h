@@ -0,0 +1,295 @@
+/***************************************************************
+ * SAMD USB device
+ *
+ * The keyboard stays on the core's HID library. HID_NKRO builds add
+ * the bitmap report of hid_output.h to its report descriptor, as
+ * report USB_KBD_NKRO_ID, and send that one instead of the library's
+ * 6 key report; the core's HID endpoint is already polled every 1ms
+ * and never offers boot protocol. The diagnostic
+ * interface (usb_diag.h) is a second HID interface plugged in next to
+ * it, answering feature reports on EP0; its IN endpoint is never used.
+ * USB_MIDI builds plug in the MIDI interfaces of usb_midi.h as well.
+ *
+ * The core stays configured through a suspend of the bus, its reports
+ * would wait for a poll that doesn't come, so the device counts as
+ * unconfigured while the port's state machine is in SUSPEND. The core
+ * answers SET_FEATURE and CLEAR_FEATURE(DEVICE_REMOTE_WAKEUP) itself and
+ * never hands standard device requests to a plugged module, so
+ * usb_begin() puts usb_samd_isr() in front of the core's USB interrupt.
+ * It reads those requests out of EP0's setup buffer before the core
+ * answers them, and forgets the feature on a bus reset; usb_wakeup()
+ * only signals resume while the host has it enabled. Configurations are
+ * counted as usb_configs() sees them come up, the core doesn't report
+ * them.
+ */
+#include <HID.h>
+
+#define USB_DIAG_EP_SIZE  8
+#define USB_DIAG_INTERVAL 10   /* ms */
+#define USB_KBD_ID        2    /* Keyboard library report */
+#define USB_KBD_NKRO_ID   3
+
+#if defined(HID_NKRO)
+/**************************************************************
+ * NKRO keyboard report, appended to the HID library's descriptor
+ */
+static constexpr byte usb_nkro_report_desc[] = {
+  0x05, 0x01,        //Usage Page (Generic Desktop)
+  0x09, 0x06,        //Usage (Keyboard)
+  0xA1, 0x01,        //Collection (Application)
+  0x85, USB_KBD_NKRO_ID, //  Report ID
+  0x05, 0x07,        //  Usage Page (Key Codes)
+  0x19, 0xE0,        //  Usage Minimum (224)
+  0x29, 0xE7,        //  Usage Maximum (231)
+  0x15, 0x00,        //  Logical Minimum (0)
+  0x25, 0x01,        //  Logical Maximum (1)
+  0x75, 0x01,        //  Report Size (1)
+  0x95, 0x08,        //  Report Count (8)
+  0x81, 0x02,        //  Input (Data,Var,Abs) modifiers
+  0x95, 0x78,        //  Report Count (120)
+  0x19, 0x00,        //  Usage Minimum (0)
+  0x29, 0x77,        //  Usage Maximum (119)
+  0x81, 0x02,        //  Input (Data,Var,Abs) key bitmap
+  0xC0               //End Collection
+};
+//Checked against HidReport_t by hid_output.h, the ID goes in front
+#define USB_KBD_REPORT_LEN (usb_desc_input_bits(usb_nkro_report_desc, sizeof(usb_nkro_report_desc)) / 8)
+
+//Appended from a constructor like the Keyboard library's own, before
+//the core attaches to the bus
+class NkroHID_ {
+  public:
+    NkroHID_() : node(usb_nkro_report_desc, sizeof(usb_nkro_report_desc)) {
+      HID().AppendDescriptor(&node);
+    }
+
+  private:
+    HIDSubDescriptor node;
+};
+#endif
+
+/**************************************************************
+ * Diagnostic HID interface
+ */
+class DiagHID_ : public PluggableUSBModule {
+  public:
+    DiagHID_() : PluggableUSBModule(1, 1, epType) {
+      epType[0] = USB_ENDPOINT_TYPE_INTERRUPT | USB_ENDPOINT_IN(0);
+      PluggableUSB().plug(this);
+    }
+
+  protected:
+    int getInterface(uint8_t *interfaceCount) {
+      *interfaceCount += 1;
+      HIDDescriptor desc = {
+        D_INTERFACE(pluggedInterface, 1, USB_DEVICE_CLASS_HUMAN_INTERFACE, 0, 0),
+        D_HIDREPORT(sizeof(diag_report_desc)),
+        D_ENDPOINT(USB_ENDPOINT_IN(pluggedEndpoint), USB_ENDPOINT_TYPE_INTERRUPT, USB_DIAG_EP_SIZE, USB_DIAG_INTERVAL)
+      };
+      return USBDevice.sendControl(&desc, sizeof(desc));
+    }
+
+    int getDescriptor(USBSetup &setup) {
+      if( (setup.bmRequestType != REQUEST_DEVICETOHOST_STANDARD_INTERFACE) ||
+          (setup.wValueH != HID_REPORT_DESCRIPTOR_TYPE) || (setup.wIndex != pluggedInterface) ) {
+        return 0;
+      }
+      return USBDevice.sendControl(diag_report_desc, sizeof(diag_report_desc));
+    }
+
+    bool setup(USBSetup &setup) {
+      uint16_t len;
+
+      if( setup.wIndex != pluggedInterface ) {
+        return false;
+      }
+      if( setup.bmRequestType == REQUEST_DEVICETOHOST_CLASS_INTERFACE ) {
+        if( (setup.bRequest == HID_GET_REPORT) && (setup.wValueH == HID_REPORT_TYPE_FEATURE) ) {
+          len = diag_get_feature(setup.wValueL, buf);
+          if( len ) {
+            USBDevice.sendControl(buf, min(len, (uint16_t)setup.wLength));
+            return true;
+          }
+        }
+      }else if( setup.bmRequestType == REQUEST_HOSTTODEVICE_CLASS_INTERFACE ) {
+        if( setup.bRequest == HID_SET_REPORT ) {
+          len = min((uint16_t)setup.wLength, (uint16_t)sizeof(buf));
+          USBDevice.recvControl(buf, len);
+          diag_set_feature(buf, len);
+          return true;
+        }
+        if( setup.bRequest == HID_SET_IDLE ) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    uint8_t epType[1];
+    byte buf[DIAG_DATA_LEN + 1];
+};
+
+#if defined(USB_MIDI)
+/**************************************************************
+ * MIDI interfaces
+ */
+class MidiUSB_ : public PluggableUSBModule {
+  public:
+    MidiUSB_() : PluggableUSBModule(2, 2, epType) {
+      epType[0] = USB_ENDPOINT_TYPE_BULK | USB_ENDPOINT_OUT(0);
+      epType[1] = USB_ENDPOINT_TYPE_BULK | USB_ENDPOINT_IN(0);
+      PluggableUSB().plug(this);
+    }
+
+    void send(const byte *buf, uint16_t len) {
+      USBDevice.send(pluggedEndpoint + 1, buf, len);
+    }
+
+    //Incoming MIDI is not used, but left unread it holds the endpoint
+    //NAKing and can stall the host's driver
+    void drain() {
+      byte rx[USB_MIDI_EP_SIZE];
+
+      while( USBDevice.available(pluggedEndpoint) ) {
+        USBDevice.recv(pluggedEndpoint, rx, sizeof(rx));
+      }
+    }
+
+  protected:
+    int getInterface(uint8_t *interfaceCount) {
+      const byte desc[USB_MIDI_DESC_LEN] = {
+        USB_MIDI_DESC(pluggedInterface, USB_ENDPOINT_OUT(pluggedEndpoint), USB_ENDPOINT_IN(pluggedEndpoint + 1))
+      };
+      *interfaceCount += 2;
+      return USBDevice.sendControl(desc, sizeof(desc));
+    }
+
+    int getDescriptor(USBSetup &setup) {
+      (void)setup;
+      return 0;
+    }
+
+    bool setup(USBSetup &setup) {
+      (void)setup;
+      return false;
+    }
+
+  private:
+    uint8_t epType[2];
+};
+#endif
+
+/**************************************************************
+ * Global Variables
+ */
+DiagHID_ diag_hid;
+#if defined(HID_NKRO)
+NkroHID_ nkro_hid;
+#endif
+#if defined(USB_MIDI)
+MidiUSB_ midi_usb;
+#endif
+uint32_t usb_config_count = 0;
+boolean usb_was_configured = false;
+volatile boolean usb_remote_wakeup = false;  //Host enabled DEVICE_REMOTE_WAKEUP
+
+//The core's interrupt hook, cortex_handlers.c
+extern "C" void USB_SetHandler(void (*new_usb_isr)(void));
+
+/******************************************************************
+ * USB interrupt
+ * Sees the standard requests the core keeps to itself, then lets the
+ * core handle the interrupt as usual.
+ */
+void usb_samd_isr() {
+  UsbDeviceDescriptor *ep_desc;
+  const byte *rq;
+
+  if( USB->DEVICE.INTFLAG.bit.EORST ) {
+    usb_remote_wakeup = false;
+  }
+  if( USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.bit.RXSTP ) {
+    //Setup packets land in bank 0 of EP0
+    ep_desc = (UsbDeviceDescriptor *)USB->DEVICE.DESCADD.reg;
+    rq = (const byte *)ep_desc[0].DeviceDescBank[0].ADDR.reg;
+    if( (rq[0] == (REQUEST_HOSTTODEVICE | REQUEST_STANDARD | REQUEST_DEVICE)) &&
+        (rq[2] == DEVICE_REMOTE_WAKEUP) && (rq[3] == 0) ) {
+      if( rq[1] == SET_FEATURE ) {
+        usb_remote_wakeup = true;
+      }else if( rq[1] == CLEAR_FEATURE ) {
+        usb_remote_wakeup = false;
+      }
+    }
+  }
+  USBDevice.ISRHandler();
+}
+
+/******************************************************************
+ * Procedures
+ */
+//The core attached to the bus before setup(); hosts enable remote
+//wakeup right before suspending the bus, long after this
+void usb_begin() {
+  USB_SetHandler(usb_samd_isr);
+  Keyboard.begin();
+}
+
+void usb_service() {
+#if defined(USB_MIDI)
+  midi_usb.drain();
+#endif
+}
+
+boolean usb_suspended() {
+  return USB->DEVICE.FSMSTATUS.bit.FSMSTATE == USB_FSMSTATUS_FSMSTATE_SUSPEND_Val;
+}
+
+boolean usb_configured() {
+  return USBDevice.configured() && !usb_suspended();
+}
+
+uint32_t usb_configs() {
+  boolean up = USBDevice.configured();
+
+  if( up && !usb_was_configured ) {
+    usb_config_count++;
+  }
+  usb_was_configured = up;
+  return usb_config_count;
+}
+
+//The port times the resume signalling itself
+boolean usb_wakeup() {
+  if( !usb_suspended() || !usb_remote_wakeup ) {
+    return false;
+  }
+  USB->DEVICE.CTRLB.bit.UPRSM = 1;
+  return true;
+}
+
+boolean usb_kbd_ready() {
+  return usb_configured();
+}
+
+boolean usb_kbd_boot() {
+  return false;
+}
+
+void usb_kbd_send(const byte *rep, uint16_t len) {
+#if defined(HID_NKRO)
+  HID().SendReport(USB_KBD_NKRO_ID, rep, len);
+#else
+  HID().SendReport(USB_KBD_ID, rep, len);
+#endif
+}
+
+#if defined(USB_MIDI)
+boolean usb_midi_ready() {
+  return usb_configured();
+}
+
+void usb_midi_send(const byte *buf, uint16_t len) {
+  midi_usb.send(buf, len);
+}
+#endif
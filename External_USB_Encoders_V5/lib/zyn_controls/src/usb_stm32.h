@@ -0,0 +1,449 @@
+/***************************************************************
+ * STM32 USB device
+ *
+ * The core's HID composite class only offers a boot keyboard and a
+ * mouse, so the device is brought up here with a class of its own on
+ * the ST USB device library the core builds for USBCON, reusing the
+ * core's device descriptor (USBD_Desc). Keyboard.begin() must not be
+ * called, usb_begin() replaces it.
+ *
+ * Interfaces:
+ *   0  HID boot keyboard, EP 0x81 IN, 8 byte reports every 1ms, or
+ *      with HID_NKRO a 16 byte bitmap report (hid_output.h); boot
+ *      protocol hosts still get the 8 byte report
+ *   1  HID vendor diagnostics (usb_diag.h), feature reports on EP0
+ *   2  Audio Control            \ USB_MIDI builds only (usb_midi.h),
+ *   3  MIDIStreaming, EP 0x03/0x83 / bulk 64 bytes
+ *
+ * The configuration offers remote wakeup. The library keeps whether
+ * the host enabled it (dev_remote_wakeup) and moves dev_state to
+ * USBD_STATE_SUSPENDED and back on its own; usb_configs() counts the
+ * configurations, a bus reset always ends in a new one. usb_wakeup()
+ * starts the resume signalling and usb_service() ends it USB_WAKEUP_MS
+ * later, loop() goes on meanwhile.
+ */
+#include <usbd_core.h>
+#include <usbd_ctlreq.h>
+#include <usbd_desc.h>
+
+#define USB_IF_KBD        0
+#define USB_IF_DIAG       1
+#define USB_NUM_HID_IF    2
+#if defined(USB_MIDI)
+#define USB_IF_MIDI       2
+#define USB_NUM_IF        4
+#define USB_MIDI_EP_OUT   0x03
+#define USB_MIDI_EP_IN    0x83
+#else
+#define USB_MIDI_DESC_LEN 0
+#define USB_NUM_IF        2
+#endif
+
+//The core stalls requests to interfaces above USBD_MAX_NUM_INTERFACES,
+//the device would enumerate without MIDI. USB_MIDI builds need
+//-D USBD_MAX_NUM_INTERFACES=4U (platformio.ini)
+#if defined(USBD_MAX_NUM_INTERFACES) && (USBD_MAX_NUM_INTERFACES < USB_NUM_IF - 1)
+#error "USBD_MAX_NUM_INTERFACES is too small for the MIDI interfaces"
+#endif
+
+#define USB_KBD_EP        0x81
+#if defined(HID_NKRO)
+#define USB_KBD_EP_SIZE   16
+#else
+#define USB_KBD_EP_SIZE   8
+#endif
+#define USB_KBD_INTERVAL  1    /* ms */
+#define USB_DIAG_EP       0x82
+#define USB_DIAG_EP_SIZE  8
+#define USB_DIAG_INTERVAL 10   /* ms, never used, HID requires it */
+#define USB_WAKEUP_MS     10   /* Resume signalling, 1-15ms */
+
+//HID class
+#define USB_HID_DESC_TYPE    0x21
+#define USB_HID_REPORT_TYPE  0x22
+#define USB_HID_DESC_LEN     9
+#define USB_HID_GET_REPORT   0x01
+#define USB_HID_GET_IDLE     0x02
+#define USB_HID_GET_PROTOCOL 0x03
+#define USB_HID_SET_REPORT   0x09
+#define USB_HID_SET_IDLE     0x0A
+#define USB_HID_SET_PROTOCOL 0x0B
+#define USB_HID_FEATURE      0x03 /* Report type in wValue high byte */
+
+//FIFO sizes in 32 bit words, the core's setup only covers its own class
+#define USB_RX_FIFO       0x80
+#define USB_TX0_FIFO      0x10
+#define USB_TX_FIFO       0x10
+
+#define USB_CFG_LEN       (9 + USB_NUM_HID_IF * (9 + USB_HID_DESC_LEN + 7) + USB_MIDI_DESC_LEN)
+#define USB_HID_DESC_OFS(intf) (9 + (intf) * (9 + USB_HID_DESC_LEN + 7) + 9)
+
+/**************************************************************
+ * Global Variables
+ */
+constexpr byte usb_kbd_report_desc[] = {
+  0x05, 0x01,        //Usage Page (Generic Desktop)
+  0x09, 0x06,        //Usage (Keyboard)
+  0xA1, 0x01,        //Collection (Application)
+  0x05, 0x07,        //  Usage Page (Key Codes)
+  0x19, 0xE0,        //  Usage Minimum (224)
+  0x29, 0xE7,        //  Usage Maximum (231)
+  0x15, 0x00,        //  Logical Minimum (0)
+  0x25, 0x01,        //  Logical Maximum (1)
+  0x75, 0x01,        //  Report Size (1)
+  0x95, 0x08,        //  Report Count (8)
+  0x81, 0x02,        //  Input (Data,Var,Abs) modifiers
+  0x95, 0x05,        //  Report Count (5)
+  0x75, 0x01,        //  Report Size (1)
+  0x05, 0x08,        //  Usage Page (LEDs)
+  0x19, 0x01,        //  Usage Minimum (1)
+  0x29, 0x05,        //  Usage Maximum (5)
+  0x91, 0x02,        //  Output (Data,Var,Abs) LEDs
+  0x95, 0x01,        //  Report Count (1)
+  0x75, 0x03,        //  Report Size (3)
+  0x91, 0x01,        //  Output (Const) padding
+#if defined(HID_NKRO)
+  0x95, 0x78,        //  Report Count (120)
+  0x75, 0x01,        //  Report Size (1)
+  0x15, 0x00,        //  Logical Minimum (0)
+  0x25, 0x01,        //  Logical Maximum (1)
+  0x05, 0x07,        //  Usage Page (Key Codes)
+  0x19, 0x00,        //  Usage Minimum (0)
+  0x29, 0x77,        //  Usage Maximum (119)
+  0x81, 0x02,        //  Input (Data,Var,Abs) key bitmap
+#else
+  0x95, 0x01,        //  Report Count (1)
+  0x75, 0x08,        //  Report Size (8)
+  0x81, 0x01,        //  Input (Const) reserved
+  0x95, 0x06,        //  Report Count (6)
+  0x75, 0x08,        //  Report Size (8)
+  0x15, 0x00,        //  Logical Minimum (0)
+  0x25, 0x65,        //  Logical Maximum (101)
+  0x05, 0x07,        //  Usage Page (Key Codes)
+  0x19, 0x00,        //  Usage Minimum (0)
+  0x29, 0x65,        //  Usage Maximum (101)
+  0x81, 0x00,        //  Input (Data,Array) keys
+#endif
+  0xC0               //End Collection
+};
+//Checked against HidReport_t by hid_output.h
+#define USB_KBD_REPORT_LEN (usb_desc_input_bits(usb_kbd_report_desc, sizeof(usb_kbd_report_desc)) / 8)
+static_assert(USB_KBD_REPORT_LEN == USB_KBD_EP_SIZE, "Keyboard report doesn't fit USB_KBD_EP_SIZE");
+
+byte usb_config_desc[USB_CFG_LEN] = {
+  0x09, USB_DESC_TYPE_CONFIGURATION, USB_CFG_LEN & 0xFF, USB_CFG_LEN >> 8,
+  USB_NUM_IF, 0x01, 0x00, 0xA0, 50,                 //Bus powered, remote wakeup, 100mA
+
+  //Keyboard
+  0x09, USB_DESC_TYPE_INTERFACE, USB_IF_KBD, 0x00, 0x01, 0x03, 0x01, 0x01, 0x00, //HID, boot, keyboard
+  USB_HID_DESC_LEN, USB_HID_DESC_TYPE, 0x11, 0x01, 0x00, 0x01, USB_HID_REPORT_TYPE,
+  sizeof(usb_kbd_report_desc) & 0xFF, sizeof(usb_kbd_report_desc) >> 8,
+  0x07, USB_DESC_TYPE_ENDPOINT, USB_KBD_EP, USBD_EP_TYPE_INTR, USB_KBD_EP_SIZE, 0x00, USB_KBD_INTERVAL,
+
+  //Diagnostics
+  0x09, USB_DESC_TYPE_INTERFACE, USB_IF_DIAG, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00,
+  USB_HID_DESC_LEN, USB_HID_DESC_TYPE, 0x11, 0x01, 0x00, 0x01, USB_HID_REPORT_TYPE,
+  sizeof(diag_report_desc) & 0xFF, sizeof(diag_report_desc) >> 8,
+  0x07, USB_DESC_TYPE_ENDPOINT, USB_DIAG_EP, USBD_EP_TYPE_INTR, USB_DIAG_EP_SIZE, 0x00, USB_DIAG_INTERVAL,
+
+#if defined(USB_MIDI)
+  USB_MIDI_DESC(USB_IF_MIDI, USB_MIDI_EP_OUT, USB_MIDI_EP_IN)
+#endif
+};
+
+byte usb_qualifier_desc[USB_LEN_DEV_QUALIFIER_DESC] = {
+  USB_LEN_DEV_QUALIFIER_DESC, USB_DESC_TYPE_DEVICE_QUALIFIER, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40, 0x01, 0x00
+};
+
+USBD_HandleTypeDef usb_dev;
+volatile boolean usb_kbd_busy = false;
+byte usb_kbd_buf[USB_KBD_EP_SIZE];
+byte usb_kbd_protocol = 1;
+byte usb_kbd_idle = 0;
+byte usb_kbd_leds = 0;
+byte usb_alt = 0;
+byte usb_status[2] = { 0, 0 };
+byte usb_ep0_buf[DIAG_DATA_LEN + 1];
+byte usb_ep0_if;
+uint16_t usb_ep0_len;
+volatile uint32_t usb_config_count = 0;
+boolean usb_waking = false; //Resume signalling since usb_wake_ms
+uint32_t usb_wake_ms;
+#if defined(USB_MIDI)
+volatile boolean usb_midi_busy = false;
+byte usb_midi_buf[USB_MIDI_EP_SIZE];
+byte usb_midi_rx[USB_MIDI_EP_SIZE];
+#endif
+
+/******************************************************************
+ * Class callbacks, called from the USB interrupt
+ */
+static uint8_t usb_class_init(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
+  (void)cfgidx;
+  USBD_LL_OpenEP(pdev, USB_KBD_EP, USBD_EP_TYPE_INTR, USB_KBD_EP_SIZE);
+  pdev->ep_in[USB_KBD_EP & 0xF].is_used = 1;
+  USBD_LL_OpenEP(pdev, USB_DIAG_EP, USBD_EP_TYPE_INTR, USB_DIAG_EP_SIZE);
+  pdev->ep_in[USB_DIAG_EP & 0xF].is_used = 1;
+  usb_kbd_busy = false;
+  usb_kbd_protocol = 1;   //Report protocol again after every reset
+  usb_config_count++;
+#if defined(USB_MIDI)
+  USBD_LL_OpenEP(pdev, USB_MIDI_EP_IN, USBD_EP_TYPE_BULK, USB_MIDI_EP_SIZE);
+  pdev->ep_in[USB_MIDI_EP_IN & 0xF].is_used = 1;
+  USBD_LL_OpenEP(pdev, USB_MIDI_EP_OUT, USBD_EP_TYPE_BULK, USB_MIDI_EP_SIZE);
+  pdev->ep_out[USB_MIDI_EP_OUT & 0xF].is_used = 1;
+  USBD_LL_PrepareReceive(pdev, USB_MIDI_EP_OUT, usb_midi_rx, USB_MIDI_EP_SIZE);
+  usb_midi_busy = false;
+#endif
+  return USBD_OK;
+}
+
+static uint8_t usb_class_deinit(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
+  (void)cfgidx;
+  USBD_LL_CloseEP(pdev, USB_KBD_EP);
+  pdev->ep_in[USB_KBD_EP & 0xF].is_used = 0;
+  USBD_LL_CloseEP(pdev, USB_DIAG_EP);
+  pdev->ep_in[USB_DIAG_EP & 0xF].is_used = 0;
+  usb_kbd_busy = false;
+#if defined(USB_MIDI)
+  USBD_LL_CloseEP(pdev, USB_MIDI_EP_IN);
+  pdev->ep_in[USB_MIDI_EP_IN & 0xF].is_used = 0;
+  USBD_LL_CloseEP(pdev, USB_MIDI_EP_OUT);
+  pdev->ep_out[USB_MIDI_EP_OUT & 0xF].is_used = 0;
+  usb_midi_busy = false;
+#endif
+  return USBD_OK;
+}
+
+static uint8_t usb_class_setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
+  byte intf = req->wIndex & 0xFF;
+  byte *pbuf = NULL;
+  uint16_t len = 0;
+
+  switch( req->bmRequest & USB_REQ_TYPE_MASK ) {
+    case USB_REQ_TYPE_CLASS:
+      switch( req->bRequest ) {
+        case USB_HID_SET_PROTOCOL:
+          usb_kbd_protocol = req->wValue;
+          break;
+        case USB_HID_GET_PROTOCOL:
+          USBD_CtlSendData(pdev, &usb_kbd_protocol, 1);
+          break;
+        case USB_HID_SET_IDLE:
+          usb_kbd_idle = req->wValue >> 8;
+          break;
+        case USB_HID_GET_IDLE:
+          USBD_CtlSendData(pdev, &usb_kbd_idle, 1);
+          break;
+        case USB_HID_GET_REPORT:
+          if( (intf == USB_IF_DIAG) && ((req->wValue >> 8) == USB_HID_FEATURE) ) {
+            len = diag_get_feature(req->wValue & 0xFF, usb_ep0_buf);
+          }
+          if( !len ) {
+            USBD_CtlError(pdev, req);
+            return USBD_FAIL;
+          }
+          USBD_CtlSendData(pdev, usb_ep0_buf, MIN(len, req->wLength));
+          break;
+        case USB_HID_SET_REPORT:
+          usb_ep0_if = intf;
+          usb_ep0_len = MIN(req->wLength, sizeof(usb_ep0_buf));
+          USBD_CtlPrepareRx(pdev, usb_ep0_buf, usb_ep0_len);
+          break;
+        default:
+          USBD_CtlError(pdev, req);
+          return USBD_FAIL;
+      }
+      break;
+
+    case USB_REQ_TYPE_STANDARD:
+      switch( req->bRequest ) {
+        case USB_REQ_GET_STATUS:
+          USBD_CtlSendData(pdev, usb_status, 2);
+          break;
+        case USB_REQ_GET_DESCRIPTOR:
+          if( ((req->wValue >> 8) == USB_HID_REPORT_TYPE) && (intf == USB_IF_KBD) ) {
+            pbuf = (byte *)usb_kbd_report_desc;
+            len = sizeof(usb_kbd_report_desc);
+          }else if( ((req->wValue >> 8) == USB_HID_REPORT_TYPE) && (intf == USB_IF_DIAG) ) {
+            pbuf = (byte *)diag_report_desc;
+            len = sizeof(diag_report_desc);
+          }else if( ((req->wValue >> 8) == USB_HID_DESC_TYPE) && (intf < USB_NUM_HID_IF) ) {
+            pbuf = &usb_config_desc[USB_HID_DESC_OFS(intf)];
+            len = USB_HID_DESC_LEN;
+          }else {
+            USBD_CtlError(pdev, req);
+            return USBD_FAIL;
+          }
+          USBD_CtlSendData(pdev, pbuf, MIN(len, req->wLength));
+          break;
+        case USB_REQ_GET_INTERFACE:
+          USBD_CtlSendData(pdev, &usb_alt, 1);
+          break;
+        case USB_REQ_SET_INTERFACE:
+        case USB_REQ_CLEAR_FEATURE:
+          break;
+        default:
+          USBD_CtlError(pdev, req);
+          return USBD_FAIL;
+      }
+      break;
+
+    default:
+      USBD_CtlError(pdev, req);
+      return USBD_FAIL;
+  }
+  return USBD_OK;
+}
+
+//SET_REPORT data stage complete
+static uint8_t usb_class_ep0_rx(USBD_HandleTypeDef *pdev) {
+  (void)pdev;
+  if( usb_ep0_if == USB_IF_KBD ) {
+    usb_kbd_leds = usb_ep0_buf[0];
+  }else if( usb_ep0_if == USB_IF_DIAG ) {
+    diag_set_feature(usb_ep0_buf, usb_ep0_len);
+  }
+  return USBD_OK;
+}
+
+static uint8_t usb_class_data_in(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+  (void)pdev;
+  if( epnum == (USB_KBD_EP & 0xF) ) {
+    usb_kbd_busy = false;
+  }
+#if defined(USB_MIDI)
+  if( epnum == (USB_MIDI_EP_IN & 0xF) ) {
+    usb_midi_busy = false;
+  }
+#endif
+  return USBD_OK;
+}
+
+#if defined(USB_MIDI)
+//Incoming MIDI is not used, keep the endpoint accepting it
+static uint8_t usb_class_data_out(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+  if( epnum == (USB_MIDI_EP_OUT & 0xF) ) {
+    USBD_LL_PrepareReceive(pdev, USB_MIDI_EP_OUT, usb_midi_rx, USB_MIDI_EP_SIZE);
+  }
+  return USBD_OK;
+}
+#else
+#define usb_class_data_out NULL
+#endif
+
+static uint8_t *usb_get_config_desc(uint16_t *length) {
+  *length = sizeof(usb_config_desc);
+  return usb_config_desc;
+}
+
+static uint8_t *usb_get_qualifier_desc(uint16_t *length) {
+  *length = sizeof(usb_qualifier_desc);
+  return usb_qualifier_desc;
+}
+
+USBD_ClassTypeDef usb_class = {
+  usb_class_init,
+  usb_class_deinit,
+  usb_class_setup,
+  NULL,                   //EP0_TxSent
+  usb_class_ep0_rx,
+  usb_class_data_in,
+  usb_class_data_out,
+  NULL,                   //SOF
+  NULL,                   //IsoINIncomplete
+  NULL,                   //IsoOUTIncomplete
+  usb_get_config_desc,    //HS
+  usb_get_config_desc,    //FS
+  usb_get_config_desc,    //Other speed
+  usb_get_qualifier_desc,
+};
+
+/******************************************************************
+ * Procedures
+ */
+void usb_begin() {
+  USBD_Init(&usb_dev, &USBD_Desc, 0);
+#if defined(USB_OTG_FS)
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef *)usb_dev.pData;
+  HAL_PCDEx_SetRxFiFo(hpcd, USB_RX_FIFO);
+  HAL_PCDEx_SetTxFiFo(hpcd, 0, USB_TX0_FIFO);
+  HAL_PCDEx_SetTxFiFo(hpcd, USB_KBD_EP & 0xF, USB_TX_FIFO);
+  HAL_PCDEx_SetTxFiFo(hpcd, USB_DIAG_EP & 0xF, USB_TX_FIFO);
+#if defined(USB_MIDI)
+  HAL_PCDEx_SetTxFiFo(hpcd, USB_MIDI_EP_IN & 0xF, USB_MIDI_EP_SIZE / 4);
+#endif
+#endif
+  USBD_RegisterClass(&usb_dev, &usb_class);
+  USBD_Start(&usb_dev);
+}
+
+//Everything else is done from the USB interrupt
+void usb_service() {
+  if( usb_waking && ((uint32_t)(millis() - usb_wake_ms) >= USB_WAKEUP_MS) ) {
+    HAL_PCD_DeActivateRemoteWakeup((PCD_HandleTypeDef *)usb_dev.pData);
+    usb_waking = false;
+  }
+}
+
+boolean usb_configured() {
+  return usb_dev.dev_state == USBD_STATE_CONFIGURED;
+}
+
+boolean usb_suspended() {
+  return usb_dev.dev_state == USBD_STATE_SUSPENDED;
+}
+
+uint32_t usb_configs() {
+  return usb_config_count;
+}
+
+/***************************************************
+ * usb wakeup
+ * Signal remote wakeup, if the host enabled it. Returns whether it
+ * was signalled, the host resumes the bus some ms later.
+ */
+boolean usb_wakeup() {
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef *)usb_dev.pData;
+
+  if( usb_waking || !usb_suspended() || !usb_dev.dev_remote_wakeup ) {
+    return false;
+  }
+  HAL_PCD_ActivateRemoteWakeup(hpcd); //usb_service() stops it
+  usb_wake_ms = millis();
+  usb_waking = true;
+  return true;
+}
+
+boolean usb_kbd_ready() {
+  return usb_configured() && !usb_kbd_busy;
+}
+
+//The host asked for boot protocol reports (BIOS)
+boolean usb_kbd_boot() {
+  return usb_kbd_protocol == 0;
+}
+
+void usb_kbd_send(const byte *rep, uint16_t len) {
+  if( !usb_kbd_ready() ) {
+    return;
+  }
+  memcpy(usb_kbd_buf, rep, MIN(len, sizeof(usb_kbd_buf)));
+  usb_kbd_busy = true;
+  USBD_LL_Transmit(&usb_dev, USB_KBD_EP, usb_kbd_buf, MIN(len, sizeof(usb_kbd_buf)));
+}
+
+#if defined(USB_MIDI)
+boolean usb_midi_ready() {
+  return usb_configured() && !usb_midi_busy;
+}
+
+void usb_midi_send(const byte *buf, uint16_t len) {
+  if( !usb_midi_ready() ) {
+    return;
+  }
+  memcpy(usb_midi_buf, buf, MIN(len, sizeof(usb_midi_buf)));
+  usb_midi_busy = true;
+  USBD_LL_Transmit(&usb_dev, USB_MIDI_EP_IN, usb_midi_buf, MIN(len, sizeof(usb_midi_buf)));
+}
+#endif
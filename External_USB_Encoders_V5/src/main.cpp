@@ -22,7 +22,8 @@
                                                                              
  For a full copy of the GNU General Public License see the LICENSE.txt file. 
 *******************************************************************                                                                             
-  w/ Simple Rotary 1.1.3 Library from mprograms
+  Encoders decoded in tree from pin interrupts, see quad_decoder.h in
+  lib/zyn_controls, no rotary encoder library needed
 *******************************************************************
  * Keymappings for reference - Oct 25th 2020
  Back Down    - "down" "Caps Lock"
@@ -57,8 +58,17 @@
  * September 23, 2023 - V5 has changed the way encoder and keyboard input is handled
  * With this in mind, we will swap out to the "default" mapping for encoders, and
  * stop processing BOLD style output in favor of direct Key On, Key Off processing 
- Select the new behavior */
+ Select the new behavior (-D LEGACY_BEHAVIOR keeps the old one, tools/bench.py builds both) */
+ #if !defined(LEGACY_BEHAVIOR)
  #define V5_BEHAVIOR 1
+ #endif
+ /*
+ Or send USB MIDI instead of keys, see the MIDI maps below:
+ encoders relative CC (two's complement), switches note on/off.
+ The device is then a keyboard and a MIDI interface at once and
+ every control goes out on the interface its map names, so the
+ tables can mix ENCODER_DEF_V5 and ENCODER_DEF_MIDI entries */
+ //#define MIDI_BEHAVIOR 1
  /*
  Layer - Ctrl 1    |    Learn - Ctrl 3
     [enc1]                 [enc3]
@@ -77,9 +87,11 @@ S2     (x)
 S3     (c)
 S4     (v)
 ********************************************************/
-#include <SimpleRotary.h>
 #include <Keyboard.h>
-#include "encoder_helpers.h"
+
+#if( defined(MIDI_BEHAVIOR) && !defined(USB_MIDI) )
+#define USB_MIDI
+#endif
 
 /**********************************
  * Include ONE of the following Hardware configurations
@@ -90,109 +102,116 @@ S4     (v)
 #include "black_pill_cfg.h"
 //#include "mkzero_cfg.h"
 
+#include "controller.h"
+
 #define KEY_COMMA ','
 #define KEY_PERIOD '.'
 
 /***********************************************
- * Create the encoder instances and maps
+ * Encoder keymaps by hardware slot
+ * ENCODER_DEF_V5 adds up to 4 steps per detent when the
+ * detents come faster than 40ms apart, and sends the switch key
+ * down and up with the switch (SW_KEY). ENCODER_DEF switches keep
+ * the short/bold/long classification on release (SW_CLASSIFY).
  */
-#if( defined(V5_BEHAVIOR) )
-ENCODER_DEF_PIN_MAP(enc1,ENC0_GND,ENC0_VCC,ENC0_SW,ENC0_A,ENC0_B);
-ENCODER_CREATE(enc1, KEY_COMMA, KEY_PERIOD, KEY_LEFT_SHIFT , KEY_LEFT_CTRL, 'i', KEY_NONE, KEY_NONE, KEY_NONE );
-
-ENCODER_DEF_PIN_MAP(enc2,ENC1_GND,ENC1_VCC,ENC1_SW,ENC1_A,ENC1_B);
-ENCODER_CREATE(enc2, KEY_COMMA, KEY_PERIOD, KEY_LEFT_CTRL, KEY_NONE, 'k', KEY_NONE, KEY_NONE, KEY_NONE );
-
-ENCODER_DEF_PIN_MAP(enc3,ENC2_GND,ENC2_VCC,ENC2_SW,ENC2_A,ENC2_B);
-ENCODER_CREATE(enc3, KEY_COMMA, KEY_PERIOD, KEY_LEFT_SHIFT, KEY_NONE, 'o', KEY_NONE, KEY_NONE, KEY_NONE );
-
-ENCODER_DEF_PIN_MAP(enc4,ENC3_GND,ENC3_VCC,ENC3_SW,ENC3_A,ENC3_B);
-ENCODER_CREATE(enc4, KEY_COMMA, KEY_PERIOD, KEY_NONE, KEY_NONE, 'l', KEY_NONE, KEY_NONE, KEY_NONE );
+constexpr EncDef_t enc_all[] = {
+#if( defined(MIDI_BEHAVIOR) )
+  //MIDI channel 1, CC 102-105, switch notes 60-63 (C4-D#4)
+  ENCODER_DEF_MIDI(ENC0, 1, 102, 60, 0, 4, 40 ), //enc1
+  ENCODER_DEF_MIDI(ENC1, 1, 103, 61, 0, 4, 40 ), //enc2
+  ENCODER_DEF_MIDI(ENC2, 1, 104, 62, 0, 4, 40 ), //enc3
+  ENCODER_DEF_MIDI(ENC3, 1, 105, 63, 0, 4, 40 ), //enc4
+#if EXP_COUNT
+  //Expanders 0-2, CC 106-120, switch notes 68-82
+  ENCODER_DEF_EXP_MIDI(0, 0, 1, 106, 68, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(0, 1, 1, 107, 69, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(0, 2, 1, 108, 70, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(0, 3, 1, 109, 71, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(0, 4, 1, 110, 72, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(1, 0, 1, 111, 73, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(1, 1, 1, 112, 74, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(1, 2, 1, 113, 75, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(1, 3, 1, 114, 76, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(1, 4, 1, 115, 77, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(2, 0, 1, 116, 78, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(2, 1, 1, 117, 79, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(2, 2, 1, 118, 80, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(2, 3, 1, 119, 81, 0, 4, 40 ),
+  ENCODER_DEF_EXP_MIDI(2, 4, 1, 120, 82, 0, 4, 40 ),
+#endif
+#elif( defined(V5_BEHAVIOR) )
+  ENCODER_DEF_V5(ENC0, KEY_COMMA, KEY_PERIOD, KEY_LEFT_SHIFT , KEY_LEFT_CTRL, 'i', 4, 40 ), //enc1
+  ENCODER_DEF_V5(ENC1, KEY_COMMA, KEY_PERIOD, KEY_LEFT_CTRL, KEY_NONE, 'k', 4, 40 ),        //enc2
+  ENCODER_DEF_V5(ENC2, KEY_COMMA, KEY_PERIOD, KEY_LEFT_SHIFT, KEY_NONE, 'o', 4, 40 ),       //enc3
+  ENCODER_DEF_V5(ENC3, KEY_COMMA, KEY_PERIOD, KEY_NONE, KEY_NONE, 'l', 4, 40 ),             //enc4
 #else
-ENCODER_DEF_PIN_MAP(back,ENC0_GND,ENC0_VCC,ENC0_SW,ENC0_A,ENC0_B);
-ENCODER_CREATE(back, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_CAPS_LOCK, KEY_NONE, KEY_ESC, KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL );
-
-ENCODER_DEF_PIN_MAP(layer,ENC1_GND,ENC1_VCC,ENC1_SW,ENC1_A,ENC1_B);
-ENCODER_CREATE(layer, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_LEFT_SHIFT, KEY_NONE, 'l', KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL );
-
-ENCODER_DEF_PIN_MAP(snap,ENC2_GND,ENC2_VCC,ENC2_SW,ENC2_A,ENC2_B);
-ENCODER_CREATE(snap, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_LEFT_CTRL, KEY_NONE, 's', KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL );
-
-ENCODER_DEF_PIN_MAP(select,ENC3_GND,ENC3_VCC,ENC3_SW,ENC3_A,ENC3_B);
-ENCODER_CREATE(select, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_NONE, KEY_NONE, KEY_RETURN, KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL );
+  ENCODER_DEF(ENC0, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_CAPS_LOCK, KEY_NONE, KEY_ESC, KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL ),     //back
+  ENCODER_DEF(ENC1, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_LEFT_SHIFT, KEY_NONE, 'l', KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL ),       //layer
+  ENCODER_DEF(ENC2, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_LEFT_CTRL, KEY_NONE, 's', KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL ),        //snap
+  ENCODER_DEF(ENC3, KEY_DOWN_ARROW, KEY_UP_ARROW, KEY_NONE, KEY_NONE, KEY_RETURN, KEY_NONE, KEY_LEFT_SHIFT, KEY_LEFT_CTRL ),      //select
+#endif
+#if EXP_COUNT && !defined(MIDI_BEHAVIOR)
+  //Expanders 0-2, F1-F12 with a modifier per group of four
+  ENCODER_DEF_EXP(0, 0, KEY_F1, KEY_F2, KEY_NONE, KEY_F3, 4, 40 ),
+  ENCODER_DEF_EXP(0, 1, KEY_F4, KEY_F5, KEY_NONE, KEY_F6, 4, 40 ),
+  ENCODER_DEF_EXP(0, 2, KEY_F7, KEY_F8, KEY_NONE, KEY_F9, 4, 40 ),
+  ENCODER_DEF_EXP(0, 3, KEY_F10, KEY_F11, KEY_NONE, KEY_F12, 4, 40 ),
+  ENCODER_DEF_EXP(0, 4, KEY_F1, KEY_F2, KEY_LEFT_SHIFT, KEY_F3, 4, 40 ),
+  ENCODER_DEF_EXP(1, 0, KEY_F4, KEY_F5, KEY_LEFT_SHIFT, KEY_F6, 4, 40 ),
+  ENCODER_DEF_EXP(1, 1, KEY_F7, KEY_F8, KEY_LEFT_SHIFT, KEY_F9, 4, 40 ),
+  ENCODER_DEF_EXP(1, 2, KEY_F10, KEY_F11, KEY_LEFT_SHIFT, KEY_F12, 4, 40 ),
+  ENCODER_DEF_EXP(1, 3, KEY_F1, KEY_F2, KEY_LEFT_CTRL, KEY_F3, 4, 40 ),
+  ENCODER_DEF_EXP(1, 4, KEY_F4, KEY_F5, KEY_LEFT_CTRL, KEY_F6, 4, 40 ),
+  ENCODER_DEF_EXP(2, 0, KEY_F7, KEY_F8, KEY_LEFT_CTRL, KEY_F9, 4, 40 ),
+  ENCODER_DEF_EXP(2, 1, KEY_F10, KEY_F11, KEY_LEFT_CTRL, KEY_F12, 4, 40 ),
+  ENCODER_DEF_EXP(2, 2, KEY_F1, KEY_F2, KEY_LEFT_ALT, KEY_F3, 4, 40 ),
+  ENCODER_DEF_EXP(2, 3, KEY_F4, KEY_F5, KEY_LEFT_ALT, KEY_F6, 4, 40 ),
+  ENCODER_DEF_EXP(2, 4, KEY_F7, KEY_F8, KEY_LEFT_ALT, KEY_F9, 4, 40 ),
 #endif
-/***********************************************/
+};
 
 /***********************************************
- * Create the button instances and maps
+ * Button keymaps by hardware slot
  */
-BUTTON_CREATE(v4b_1,SW0,'z',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL);
-BUTTON_CREATE(v4b_2,SW1,'x',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL);
-BUTTON_CREATE(v4b_3,SW2,'c',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL);
-BUTTON_CREATE(v4b_4,SW3,'v',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL);
+constexpr BtnDef_t btn_all[] = {
+#if( defined(MIDI_BEHAVIOR) )
+  BUTTON_DEF_MIDI(SW0, 1, 64, 0),
+  BUTTON_DEF_MIDI(SW1, 1, 65, 0),
+  BUTTON_DEF_MIDI(SW2, 1, 66, 0),
+  BUTTON_DEF_MIDI(SW3, 1, 67, 0),
+#elif( defined(SW_GESTURES) )
+  //Tap, double tap with shift, triple tap with ctrl, held repeats the key
+  BUTTON_DEF_GESTURE(SW0,'z',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL,KEY_NONE,3,250,500,100),
+  BUTTON_DEF_GESTURE(SW1,'x',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL,KEY_NONE,3,250,500,100),
+  BUTTON_DEF_GESTURE(SW2,'c',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL,KEY_NONE,3,250,500,100),
+  BUTTON_DEF_GESTURE(SW3,'v',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL,KEY_NONE,3,250,500,100),
+#else
+  BUTTON_DEF(SW0,'z',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL),
+  BUTTON_DEF(SW1,'x',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL),
+  BUTTON_DEF(SW2,'c',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL),
+  BUTTON_DEF(SW3,'v',KEY_NONE,KEY_LEFT_SHIFT,KEY_LEFT_CTRL),
+#endif
+};
 
-/***************************************************
- * setup
+/***********************************************
+ * Fader and pot keymaps by hardware slot, -D ANALOG_SCAN
  */
-void setup() {
-  // declare led pin to be an output:
-  if( led != PIN_NA) { 
-    pinMode(led, OUTPUT); 
-    digitalWrite(led,0); //Turn on the LED to indicate that we are running code, not bootloader
-  }
-
-  ENCODER_SET_GPIO(enc1);
-  ENCODER_SET_GPIO(enc2);
-  ENCODER_SET_GPIO(enc3);
-  ENCODER_SET_GPIO(enc4);
-  
-  BUTTON_SET_GPIO(v4b_1);
-  BUTTON_SET_GPIO(v4b_2);
-  BUTTON_SET_GPIO(v4b_3);
-  BUTTON_SET_GPIO(v4b_4);
-
-  //Detect config for inverted rotation encoders
-  invert_encoders = default_invert;
-  if( pin_invert != PIN_NA ) {
-    pinMode(pin_invert, INPUT);
-    if( digitalRead(pin_invert) ) {
-      invert_encoders = true;
-    }
-  }
-  if( invert_encoders ) {
-      cw = 2;
-      ccw = 1;
-  }    
-
-  // wait for 2 second before starting keyboard.
-  delay(2000);
-
-// initialize control over the keyboard:
-  Keyboard.begin();
-
-  // wait for .5 second AFTER starting keyboard.
-  delay(500);
-
-  if( led != PIN_NA) { digitalWrite(led,1); } //Turn off the LED once we are booted and servicing Encoders
-}
+#if defined(ANALOG_SCAN)
+constexpr AnaDef_t ana_all[] = {
+#if( defined(MIDI_BEHAVIOR) )
+  //Absolute CC 7 (volume) and 10 (pan) on channel 1, CC 70-71 on the rest
+  ANALOG_DEF_MIDI(ANA0, 1, 7),
+  ANALOG_DEF_MIDI(ANA1, 1, 10),
+  ANALOG_DEF_MIDI(ANA2, 1, 70),
+  ANALOG_DEF_MIDI(ANA3, 1, 71),
+#else
+  //Up and down arrows, 32 steps over the travel
+  ANALOG_DEF_KEY(ANA0, KEY_UP_ARROW, KEY_DOWN_ARROW, KEY_NONE, KEY_NONE, 32),
+  ANALOG_DEF_KEY(ANA1, KEY_UP_ARROW, KEY_DOWN_ARROW, KEY_LEFT_SHIFT, KEY_NONE, 32),
+  ANALOG_DEF_KEY(ANA2, KEY_UP_ARROW, KEY_DOWN_ARROW, KEY_LEFT_CTRL, KEY_NONE, 32),
+  ANALOG_DEF_KEY(ANA3, KEY_UP_ARROW, KEY_DOWN_ARROW, KEY_LEFT_ALT, KEY_NONE, 32),
+#endif
+};
+#endif
 
-/***************************************************
- * loop
- */
-void loop() {  
-#if( defined(V5_BEHAVIOR) )
-  ENCODER_PROCESS(enc1);
-  ENCODER_PROCESS(enc2);
-  ENCODER_PROCESS(enc3);
-  ENCODER_PROCESS(enc4);
-#else  
-  ENCODER_PROCESS(back);
-  ENCODER_PROCESS(layer);
-  ENCODER_PROCESS(snap);
-  ENCODER_PROCESS(select);
-#endif  
-  BUTTON_PROCESS(v4b_1);
-  BUTTON_PROCESS(v4b_2);
-  BUTTON_PROCESS(v4b_3);
-  BUTTON_PROCESS(v4b_4);
-}
+#include "controller_main.h"
@@ -0,0 +1,253 @@
+#!/usr/bin/env python3
+"""Throughput and drop rate of the encoder to HID pipeline, on the host.
+
+  bench.py                      V5 and legacy keymaps, every scenario
+  bench.py --keymap v5 --scenario all --rates 50 100 200
+  bench.py --flags="-DHID_NKRO -DSCAN_RATE_HZ=2000" --csv > nkro.csv
+
+Builds the native simulator (lib/native_sim) once per keymap and runs
+it on generated timelines: quadrature waveforms at each detent rate
+of --rates on one encoder at a time (enc1-enc4) and on all four at
+once (all), and presses of the four front panel switches (sw) at the
+press rates of --press-rates. Everything the firmware does between
+the pins and the host (decoder, debounce, acceleration, the output
+queue and the report pacing) runs as it does on the Black Pill.
+
+Each run prints one JSON object (--csv: a row) with the inputs made,
+the reports and key downs the host took, the reports per input, the
+deepest output queue backlog and its drops (DIAG_OBJ_QUEUE), the
+reports the endpoint model dropped, and percentiles of the latency
+from each input to its key reaching the host. An input counts as
+delivered by the first key of its control the host takes after the
+input began that an earlier input hasn't claimed; the extra keys of
+acceleration are skipped. Inputs not delivered by the end of the run
+are "lost", those delivered after --late-ms are "late". The last line
+of each scenario gives the highest rate with neither, and no drops.
+
+The keys of each control are learned from a calibration run, one
+slow detent or press of each, so custom keymaps work as long as no two
+controls of a scenario make the same first report.
+"""
+import argparse
+import csv
+import json
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+KEYMAPS = {"v5": [], "legacy": ["-DLEGACY_BEHAVIOR"]}
+
+#Black Pill pins, lib/zyn_controls/src/black_pill_cfg.h
+ENCODERS = [("PA7", "PA6"), ("PA1", "PA0"), ("PB13", "PB14"), ("PB6", "PB7")]
+SWITCHES = ["PA15", "PA14", "PA13", "PB0"]
+START_MS = 1000.0  # After enumeration
+GAP_MS = 1000.0    # Between the calibration inputs
+PRESS_MS = 100.0   # Longest press, a short one for every keymap
+DIAG_OBJ_QUEUE = 7
+FIELDS = ["keymap", "scenario", "rate_hz", "inputs", "reports", "key_downs", "reports_per_input",
+          "delivered", "lost", "late", "lat_p50_ms", "lat_p90_ms", "lat_p99_ms", "lat_max_ms",
+          "backlog_max", "queue_overflow", "queue_dropped", "queue_wait_max_ms", "ep_drop_busy"]
+
+
+def build(keymap, flags, cxx, out):
+    srcs = [os.path.join(ROOT, "src", "main.cpp")]
+    sim_dir = os.path.join(ROOT, "lib", "native_sim")
+    srcs += [os.path.join(sim_dir, f) for f in sorted(os.listdir(sim_dir)) if f.endswith(".cpp")]
+    cmd = [cxx, "-std=gnu++11", "-funsigned-char", "-O1", "-DNATIVE_SIM", "-w",
+           "-I" + sim_dir, "-I" + os.path.join(ROOT, "lib", "zyn_controls", "src")] + KEYMAPS[keymap] + flags + srcs + ["-o", out]
+    subprocess.run(cmd, check=True)
+
+
+def run(sim, lines, tmp):
+    """Reports [(ms, key)] the host took and the queue statistics"""
+    tl = os.path.join(tmp, "run.tl")
+    qfile = os.path.join(tmp, "queue.bin")
+    with open(tl, "w") as f:
+        f.write("\n".join(lines + ["diag_save %d %s" % (DIAG_OBJ_QUEUE, qfile)]) + "\n")
+    out = subprocess.run([sim, tl], check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout
+    reports = []
+    summary = {}
+    for line in out.splitlines():
+        if line.startswith("# reports"):
+            w = line[2:].split()
+            summary = dict(zip(w[0::2], (int(v) for v in w[1::2])))
+        elif not line.startswith("#"):
+            t, rest = line.split(None, 1)
+            reports.append((float(t), rest.split()))
+    with open(qfile, "rb") as f:
+        q = struct.unpack_from("<6I", f.read())
+    summary.update(backlog_max=q[4], queue_overflow=q[3], queue_dropped=q[2], queue_wait_max_ms=q[5] / 1000.0)
+    return reports, summary
+
+
+def key_downs(reports):
+    """[(ms, signature)] of the reports that put a key down"""
+    downs = []
+    held = set()
+    for t, rep in reports:
+        if rep[0] == "midi":
+            downs.append((t, ("midi",) + tuple(rep[1:4])))
+            continue
+        b = [int(x, 16) for x in rep]
+        if len(b) == 8:
+            keys = set(k for k in b[2:] if k)
+        else:
+            keys = set(8 * (i - 1) + n for i in range(1, len(b)) for n in range(8) if b[i] & (1 << n))
+        if keys - held:
+            downs.append((t, (b[0],) + tuple(sorted(keys))))
+        held = keys
+    return downs
+
+
+def timeline(inputs):
+    """Timeline lines and [(control, ms input complete, ms started)] of
+    [(control, kind, ms, arg)] inputs, kind "turn" or "press" """
+    lines = ["0 set PB2 0", "end %.3f" % (max(i[2] for i in inputs) + 1000.0)]
+    made = []
+    for control, kind, t, arg in inputs:
+        if kind == "turn":
+            a, b = ENCODERS[control]
+            lines.append("%.3f turn %s %s 1 %.3f" % (t, a, b, arg))
+            made.append((control, t + arg * 3 / 4, t))
+        else:
+            lines.append("%.3f press %s %.3f" % (t, SWITCHES[control], arg))
+            made.append((control, t + arg, t))
+    return lines, made
+
+
+def calibrate(sim, tmp):
+    """Signature of the first key down of each encoder and switch"""
+    inputs = [(i, "turn", START_MS + i * GAP_MS, 40.0) for i in range(4)]
+    inputs += [(i, "press", START_MS + (4 + i) * GAP_MS, PRESS_MS) for i in range(4)]
+    lines, _ = timeline(inputs)
+    downs = key_downs(run(sim, lines, tmp)[0])
+    sig = {}
+    for n, (_, _, t, _) in enumerate(inputs):
+        first = [d for d in downs if t <= d[0] < t + GAP_MS]
+        if not first:
+            sys.exit("calibration: input %d made no key" % n)
+        sig[("enc" if n < 4 else "sw", n % 4)] = first[0][1]
+    return sig
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def measure(sim, tmp, sig, kind, controls, rate, count, late_ms):
+    period = 1000.0 / rate
+    inputs = []
+    for n in range(count):
+        for j, c in enumerate(controls):
+            #Stagger the controls, so they don't all change on the same tick
+            t = START_MS + n * period + j * period / (len(controls) + 1)
+            if kind == "turn":
+                inputs.append((c, "turn", t, period))
+            else:
+                inputs.append((c, "press", t, min(period / 2, PRESS_MS)))
+    lines, made = timeline(inputs)
+    reports, summary = run(sim, lines, tmp)
+    downs = key_downs(reports)
+
+    group = "enc" if kind == "turn" else "sw"
+    owner = {}
+    for c in controls:
+        if sig[(group, c)] in owner:
+            sys.exit("%s%d and %s%d make the same report" % (group, c, group, owner[sig[(group, c)]]))
+        owner[sig[(group, c)]] = c
+    seen = {c: [] for c in controls}
+    for t, s in downs:
+        if s in owner:
+            seen[owner[s]].append(t)
+
+    lat = []
+    lost = 0
+    done = {c: 0 for c in controls}
+    for c, t_done, t_start in made:
+        #The first key of the control since the input began that an
+        #earlier input hasn't claimed, extra keys of acceleration are skipped
+        times = seen[c]
+        j = done[c]
+        while j < len(times) and times[j] < t_start:
+            j += 1
+        if j == len(times):
+            lost += 1
+            continue
+        done[c] = j + 1
+        #Keys sent on the press edge come before the input is complete
+        lat.append(times[j] - (t_done if times[j] >= t_done else t_start))
+
+    row = {"scenario": None, "rate_hz": rate, "inputs": len(made), "reports": summary.get("polled", 0),
+           "key_downs": summary.get("key_downs", 0), "delivered": len(lat), "lost": lost,
+           "late": sum(1 for v in lat if v > late_ms),
+           "lat_p50_ms": percentile(lat, 50), "lat_p90_ms": percentile(lat, 90),
+           "lat_p99_ms": percentile(lat, 99), "lat_max_ms": max(lat) if lat else None,
+           "ep_drop_busy": summary.get("drop_busy", 0)}
+    row["reports_per_input"] = round(row["reports"] / float(len(made)), 3)
+    for k in ("backlog_max", "queue_overflow", "queue_dropped", "queue_wait_max_ms"):
+        row[k] = summary[k]
+    return row
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--keymap", choices=sorted(KEYMAPS), action="append", help="default both")
+    ap.add_argument("--scenario", choices=["enc1", "enc2", "enc3", "enc4", "all", "sw"], action="append",
+                    help="default all of them")
+    ap.add_argument("--rates", type=float, nargs="+", default=[5, 10, 20, 40, 80, 160, 320],
+                    help="detents per second, per encoder")
+    ap.add_argument("--press-rates", type=float, nargs="+", default=[1, 2, 4, 8, 16],
+                    help="presses per second, per switch")
+    ap.add_argument("--count", type=int, default=50, help="inputs per control and run")
+    ap.add_argument("--late-ms", type=float, default=50.0, help="latency that counts as late")
+    ap.add_argument("--flags", default="", help="extra build flags, e.g. --flags=-DHID_NKRO")
+    ap.add_argument("--cxx", default=os.environ.get("CXX", "c++"))
+    ap.add_argument("--csv", action="store_true", help="CSV rather than JSON lines")
+    args = ap.parse_args()
+
+    scenarios = args.scenario or ["enc1", "enc2", "enc3", "enc4", "all", "sw"]
+    out = csv.DictWriter(sys.stdout, FIELDS + ["max_rate_hz"], extrasaction="ignore") if args.csv else None
+    if out:
+        out.writeheader()
+    tmp = tempfile.mkdtemp(prefix="bench")
+    try:
+        for keymap in args.keymap or ["v5", "legacy"]:
+            sim = os.path.join(tmp, "sim_" + keymap)
+            build(keymap, args.flags.split(), args.cxx, sim)
+            sig = calibrate(sim, tmp)
+            for scenario in scenarios:
+                if scenario == "sw":
+                    kind, controls, rates = "press", [0, 1, 2, 3], args.press_rates
+                elif scenario == "all":
+                    kind, controls, rates = "turn", [0, 1, 2, 3], args.rates
+                else:
+                    kind, controls, rates = "turn", [int(scenario[3]) - 1], args.rates
+                best = None
+                for rate in rates:
+                    row = measure(sim, tmp, sig, kind, controls, rate, args.count, args.late_ms)
+                    row.update(keymap=keymap, scenario=scenario)
+                    if not (row["lost"] or row["late"] or row["queue_overflow"] or row["ep_drop_busy"]):
+                        best = rate if best is None else max(best, rate)
+                    if out:
+                        out.writerow(row)
+                    else:
+                        print(json.dumps(row, sort_keys=True))
+                    sys.stdout.flush()
+                summary = {"keymap": keymap, "scenario": scenario, "max_rate_hz": best}
+                if out:
+                    out.writerow(summary)
+                else:
+                    print(json.dumps(summary, sort_keys=True))
+    finally:
+        shutil.rmtree(tmp)
+
+
+if __name__ == "__main__":
+    main()
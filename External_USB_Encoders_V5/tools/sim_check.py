@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Run the simulator timelines and check their output against the expected.
+
+  sim_check.py                  every case, exit status 1 on a mismatch
+  sim_check.py spin boot.legacy only those cases
+  sim_check.py --update         store what the firmware does now as expected
+
+Each case is a timeline of lib/native_sim/timelines run on the native
+simulator built with the flags it needs (CASES). Its output, the
+reports the host took and the summary, and the contents of any
+diagnostic object the timeline saves with diag_save, must match
+timelines/expected/<case>.out line for line; a mismatch prints the
+difference. Run it after every change of the firmware or the
+simulator, and --update only once the new output has been looked at
+and is what the change meant to do.
+"""
+import argparse
+import difflib
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+SIM_DIR = os.path.join(ROOT, "lib", "native_sim")
+TIMELINES = os.path.join(SIM_DIR, "timelines")
+EXPECTED = os.path.join(TIMELINES, "expected")
+
+#Case: (timeline, build flags)
+CASES = {
+    "spin":         ("spin", []),
+    "spin.legacy":  ("spin", ["-DLEGACY_BEHAVIOR"]),
+    "spin.midi":    ("spin", ["-DMIDI_BEHAVIOR"]),
+    "spin.rate":    ("spin", ["-DENC_RATE_HZ=50"]),
+    "spin.fixed":   ("spin", ["-DKEYMAP_FIXED"]),
+    "idle":         ("idle", []),
+    "boot":         ("boot", []),
+    "boot.discard": ("boot", ["-DBOOT_DISCARD"]),
+    "wrap":         ("wrap", []),
+    "wrap.legacy":  ("wrap", ["-DLEGACY_BEHAVIOR"]),
+    "bounce":       ("bounce", []),
+    "suspend":      ("suspend", []),
+    "wiggle":       ("wiggle", ["-DENC_RATE_HZ=50"]),
+    "gesture":      ("gesture", ["-DSW_GESTURES"]),
+    "expander":     ("expander", ["-DEXP_COUNT=3"]),
+    "expander.spi": ("expander", ["-DEXP_COUNT=3", "-DEXP_SPI"]),
+    "expander.missing": ("expander", ["-DEXP_COUNT=3", "-DEXP_SPI", "-DSIM_MCP_FITTED=5", "-DSIM_SPI_MISO=0"]),
+    "chord":        ("chord", ["-DEXP_COUNT=3"]),
+    "chord.nkro":   ("chord", ["-DEXP_COUNT=3", "-DHID_NKRO"]),
+    "analog":       ("analog", ["-DANALOG_SCAN"]),
+    "remap":        ("remap", []),
+}
+
+DIAG_SAVED = re.compile(r"^# diag object (\d+), \d+ bytes saved to (\S+)$")
+
+
+def build(flags, cxx, out):
+    srcs = [os.path.join(ROOT, "src", "main.cpp")]
+    srcs += [os.path.join(SIM_DIR, f) for f in sorted(os.listdir(SIM_DIR)) if f.endswith(".cpp")]
+    cmd = [cxx, "-std=gnu++11", "-funsigned-char", "-O1", "-DNATIVE_SIM", "-w",
+           "-I" + SIM_DIR, "-I" + os.path.join(ROOT, "lib", "zyn_controls", "src")] + flags + srcs + ["-o", out]
+    subprocess.run(cmd, check=True)
+
+
+def run(sim, timeline):
+    """Output of one run, saved diagnostic objects appended as hex"""
+    out = subprocess.run([sim, os.path.join(TIMELINES, timeline + ".tl")], check=True,
+                         stdout=subprocess.PIPE, universal_newlines=True).stdout
+    lines = out.splitlines()
+    for line in out.splitlines():
+        m = DIAG_SAVED.match(line)
+        if m:
+            with open(m.group(2), "rb") as f:
+                data = f.read()
+            for ofs in range(0, len(data), 16):
+                lines.append("# diag object %s %04x: %s" % (m.group(1), ofs, data[ofs:ofs + 16].hex()))
+    return [line + "\n" for line in lines]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("cases", nargs="*", help="default all of them: " + " ".join(sorted(CASES)))
+    ap.add_argument("--update", action="store_true", help="rewrite the expected output")
+    ap.add_argument("--cxx", default=os.environ.get("CXX", "c++"))
+    args = ap.parse_args()
+
+    for name in args.cases:
+        if name not in CASES:
+            ap.error("unknown case " + name)
+    failed = []
+    sims = {}
+    tmp = tempfile.mkdtemp(prefix="sim_check")
+    try:
+        for name in args.cases or sorted(CASES):
+            timeline, flags = CASES[name]
+            key = " ".join(flags)
+            if key not in sims:
+                sims[key] = os.path.join(tmp, "sim%d" % len(sims))
+                build(flags, args.cxx, sims[key])
+            got = run(sims[key], timeline)
+            path = os.path.join(EXPECTED, name + ".out")
+            if args.update:
+                with open(path, "w") as f:
+                    f.writelines(got)
+                print("%-14s updated" % name)
+                continue
+            try:
+                with open(path) as f:
+                    want = f.readlines()
+            except IOError:
+                want = []
+            if got == want:
+                print("%-14s ok" % name)
+            else:
+                print("%-14s FAILED" % name)
+                sys.stdout.writelines(difflib.unified_diff(want, got, os.path.relpath(path, ROOT), "got"))
+                failed.append(name)
+    finally:
+        shutil.rmtree(tmp)
+    if failed:
+        print("%d of %d cases failed: %s" % (len(failed), len(args.cases or CASES), " ".join(failed)))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""Replay an input trace (lib/zyn_controls/src/trace_log.h) through the native simulator.
+
+  zyn_diag.py trace save unit7.bin
+  pio run -e native
+  trace_replay.py unit7.bin [--timeline unit7.tl] [--tolerance 2]
+
+The pin levels recorded become "set" lines of a simulator timeline,
+with the levels before the oldest record applied as straps at time 0
+and the recorded edges from --start ms on. The firmware of the native
+build runs it through the same decoder, switch and output code, and
+the reports it makes are checked against the ones the unit sent:
+the sequences must match and, with --tolerance, each report must come
+out within that many ms of the recorded time relative to the first
+edge. Exit status 1 on a mismatch, so a saved timeline and trace make
+a regression test.
+
+Build the simulator with the keymaps and flags of the unit; keymaps
+the host loaded at run time aren't in the trace. Reports recorded
+before the first edge of the trace come from inputs older than it and
+are left out. The pins are named as the simulator names them, which
+covers the Black Pill (PA0-PC15), port expanders (X0A0-X7B7) and traces
+taken in the simulator.
+"""
+import argparse
+import difflib
+import os
+import subprocess
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import zyn_diag  # noqa: E402
+
+SIM_DEFAULT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", ".pio", "build", "native", "program")
+SIM_D0_PORT = 3  # Simulator ports 0-2 are PA-PC, then D0-D21
+
+
+def pin_name(trace, port, bit):
+    exp = port - (trace["ports"] - trace["exps"])
+    if exp >= 0:
+        return "X%d%s%d" % (exp, "AB"[bit // 8], bit % 8)  # Expander GPA0-GPB7
+    if port < SIM_D0_PORT:
+        return "P%s%d" % ("ABC"[port], bit)
+    return "D%d" % ((port - SIM_D0_PORT) * 16 + bit)
+
+
+def fmt(kind, val):
+    return ("midi " if kind == "midi" else "") + " ".join("%02x" % b for b in val)
+
+
+def build(trace, start_ms):
+    """Timeline lines and the expected [(ms, text)] of a parsed trace"""
+    if trace["arch"] == "samd":
+        sys.exit("SAMD traces can't be replayed, the simulator models the Black Pill pins")
+    lines = ["# Replay of a %s trace, %d records" % (trace["arch"], len(trace["records"]))]
+    levels = list(trace["base"])
+    for port, mask in enumerate(trace["mask"]):
+        for bit in range(32):
+            if mask & (1 << bit):
+                lines.append("0 set %s %d" % (pin_name(trace, port, bit), (levels[port] >> bit) & 1))
+    t0 = None
+    last_ms = start_ms
+    expect = []
+    for t, kind, val in zyn_diag.trace_events(trace):
+        if kind == "port":
+            port, new = val
+            if t0 is None:
+                t0 = t
+            ms = start_ms + (t - t0) / 1000.0
+            changed = (new ^ levels[port]) & trace["mask"][port]
+            for bit in range(32):
+                if changed & (1 << bit):
+                    lines.append("%.3f set %s %d" % (ms, pin_name(trace, port, bit), (new >> bit) & 1))
+            levels[port] = new
+            last_ms = ms
+        elif t0 is not None:
+            expect.append((start_ms + (t - t0) / 1000.0, fmt(kind, val)))
+    lines.append("end %.3f" % (max([last_ms] + [e[0] for e in expect]) + 500))
+    return lines, expect
+
+
+def run_sim(sim, timeline):
+    out = subprocess.run([sim, timeline], check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout
+    got = []
+    for line in out.splitlines():
+        if line.startswith("#"):
+            continue
+        t, rest = line.split(None, 1)
+        got.append((float(t), rest.strip()))
+    return got
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("trace", help="file saved by zyn_diag.py trace save")
+    ap.add_argument("--sim", default=SIM_DEFAULT, help="native simulator build")
+    ap.add_argument("--timeline", help="keep the timeline in this file")
+    ap.add_argument("--start", type=float, default=1000.0, help="ms of the first edge, after enumeration")
+    ap.add_argument("--tolerance", type=float, help="ms a report may move from its recorded time")
+    args = ap.parse_args()
+
+    with open(args.trace, "rb") as f:
+        trace = zyn_diag.parse_trace(f.read())
+    lines, expect = build(trace, args.start)
+    path = args.timeline or args.trace + ".tl"
+    with open(path, "w") as f:
+        f.write("\n".join(lines) + "\n")
+    got = run_sim(args.sim, path)
+
+    ok = True
+    want = [e[1] for e in expect]
+    have = [g[1] for g in got]
+    if want != have:
+        ok = False
+        sys.stdout.writelines(difflib.unified_diff([w + "\n" for w in want], [h + "\n" for h in have],
+                                                   "recorded", "replayed"))
+    worst = 0.0
+    for (t_want, _), (t_have, _) in zip(expect, got):
+        worst = max(worst, abs(t_have - t_want))
+    print("%d reports recorded, %d replayed, %s, timing within %.3f ms" %
+          (len(want), len(have), "match" if want == have else "MISMATCH", worst))
+    if args.tolerance is not None and worst > args.tolerance:
+        ok = False
+    if not args.timeline:
+        os.remove(path)
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,410 @@
+#!/usr/bin/env python3
+"""Host side of the diagnostic HID interface (lib/zyn_controls/src/usb_diag.h).
+
+Finds the controller's vendor HID interface among /dev/hidraw*, and
+reads or resets the objects the firmware registered.
+
+  zyn_diag.py profile             show the scan loop profile
+  zyn_diag.py profile --reset     clear it
+  zyn_diag.py boot                enumeration, time to first report and
+                                  suspends
+  zyn_diag.py idle                idle sleep, wake latency and residency
+  zyn_diag.py idle --ma 25 8      ... and the average current, given
+                                  the supply current awake and asleep
+  zyn_diag.py idle --reset        clear it
+  zyn_diag.py trace               print the input trace, oldest first
+  zyn_diag.py trace save <file>   store it for tools/trace_replay.py
+  zyn_diag.py trace --reset       empty it
+  zyn_diag.py queue               output queue depth, drops and wait times
+  zyn_diag.py queue --reset       clear it
+  zyn_diag.py encoders            decoder transitions, invalid ones and
+                                  reversals of each encoder
+  zyn_diag.py encoders --reset    clear them
+  zyn_diag.py keymap get          print the active keymaps as JSON
+  zyn_diag.py keymap set <file>   load keymaps from JSON, live at once
+  zyn_diag.py keymap save         store the active keymaps in flash
+  zyn_diag.py keymap defaults     back to the maps built into the firmware
+  zyn_diag.py dump <obj>          hex dump any object
+
+keymap set/save/defaults take --all to retarget every controller
+attached, e.g. keymap set --all --save fleet.json
+"""
+import argparse
+import fcntl
+import glob
+import json
+import os
+import struct
+import sys
+
+DIAG_REPORT_CMD = 1
+DIAG_REPORT_DATA = 2
+DIAG_CMD_LEN = 7
+DIAG_DATA_LEN = 63
+DIAG_CHUNK = DIAG_DATA_LEN - 6
+DIAG_CMD_SELECT = 0
+DIAG_CMD_RESET = 1
+DIAG_CMD_COMMIT = 2
+DIAG_CMD_DEFAULTS = 3
+TRACE_CMD_FREEZE = 4
+TRACE_CMD_RUN = 5
+
+DIAG_OBJ_PROFILE = 1
+DIAG_OBJ_ENC_MAPS = 2
+DIAG_OBJ_BTN_MAPS = 3
+DIAG_OBJ_BOOT = 4
+DIAG_OBJ_IDLE = 5
+DIAG_OBJ_TRACE = 6
+DIAG_OBJ_QUEUE = 7
+DIAG_OBJ_ENC_STATS = 8
+
+# Start of diag_report_desc: Usage Page (Vendor 0xFF00), Usage (1)
+DIAG_DESC_SIG = bytes([0x06, 0x00, 0xFF, 0x09, 0x01])
+
+# TraceLog_t and TraceRec_t in trace_log.h
+TRACE_REC_PORT = 1
+TRACE_REC_REPORT = 2
+TRACE_REC_MIDI = 3
+TRACE_ARCH_NAMES = {1: "stm32", 2: "samd", 3: "native"}
+
+PROF_BUCKETS = 16
+PROF_HIST_SHIFT = 6
+# KeyMap_t in encoder_helpers.h, one byte per field
+KEYMAP_FIELDS = ["key_cw", "key_ccw", "mod1_enc", "mod2_enc", "key_switch",
+                 "mod_short", "mod_bold", "mod_long", "accel_max", "accel_ms",
+                 "midi_ch", "midi_cc", "midi_sw", "midi_flags", "sw_mode",
+                 "key_hold", "gest_taps", "gest_tap", "gest_hold", "gest_repeat"]
+NUMERIC_FIELDS = ("accel", "midi", "sw_mode", "gest")
+
+PROF_STAGE_NAMES = ["loop", "encoders", "buttons", "output", "edge->queued", "port scan", "tick period"]
+
+
+def _ioc_rw(nr, size):
+    return (3 << 30) | (size << 16) | (ord('H') << 8) | nr
+
+
+def HIDIOCSFEATURE(size):
+    return _ioc_rw(0x06, size)
+
+
+def HIDIOCGFEATURE(size):
+    return _ioc_rw(0x07, size)
+
+
+def find_devices():
+    found = []
+    for node in sorted(glob.glob("/sys/class/hidraw/hidraw*")):
+        try:
+            with open(os.path.join(node, "device/report_descriptor"), "rb") as f:
+                if f.read().startswith(DIAG_DESC_SIG):
+                    found.append("/dev/" + os.path.basename(node))
+        except OSError:
+            pass
+    return found
+
+
+class Diag:
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR)
+
+    def command(self, obj, cmd, offset=0):
+        buf = bytearray(struct.pack("<BBBH3x", DIAG_REPORT_CMD, obj, cmd, offset))
+        fcntl.ioctl(self.fd, HIDIOCSFEATURE(len(buf)), buf)
+
+    def chunk(self):
+        buf = bytearray(DIAG_DATA_LEN + 1)
+        buf[0] = DIAG_REPORT_DATA
+        fcntl.ioctl(self.fd, HIDIOCGFEATURE(len(buf)), buf)
+        _, obj, n, offset, size = struct.unpack_from("<BBBHH", buf)
+        return obj, offset, size, bytes(buf[7:7 + n])
+
+    def read(self, obj):
+        self.command(obj, DIAG_CMD_SELECT)
+        data = b""
+        while True:
+            got, offset, size, chunk = self.chunk()
+            if got != obj or size == 0:
+                raise RuntimeError("object %d not present in this firmware" % obj)
+            data += chunk
+            if not chunk or len(data) >= size:
+                return data
+
+    def write(self, obj, data):
+        for offset in range(0, len(data), DIAG_CHUNK):
+            chunk = data[offset:offset + DIAG_CHUNK]
+            buf = bytearray(DIAG_DATA_LEN + 1)
+            struct.pack_into("<BBBHH", buf, 0, DIAG_REPORT_DATA, obj, len(chunk), offset, len(data))
+            buf[7:7 + len(chunk)] = chunk
+            fcntl.ioctl(self.fd, HIDIOCSFEATURE(len(buf)), buf)
+
+    def reset(self, obj):
+        self.command(obj, DIAG_CMD_RESET)
+
+
+def show_profile(data):
+    cycles_per_us, stages = struct.unpack_from("<II", data)
+    cycles_per_us = max(cycles_per_us, 1)
+    stage_fmt = "<QIIII%dI" % PROF_BUCKETS
+    stage_len = struct.calcsize(stage_fmt)
+    print("%-14s %10s %10s %10s %10s" % ("stage", "count", "min us", "avg us", "max us"))
+    hists = []
+    for i in range(stages):
+        f = struct.unpack_from(stage_fmt, data, 8 + i * stage_len)
+        total, count, lo, hi = f[0], f[1], f[2], f[3]
+        name = PROF_STAGE_NAMES[i] if i < len(PROF_STAGE_NAMES) else "stage %d" % i
+        if count:
+            print("%-14s %10d %10.2f %10.2f %10.2f" % (name, count, lo / cycles_per_us,
+                  total / count / cycles_per_us, hi / cycles_per_us))
+        else:
+            print("%-14s %10d %10s %10s %10s" % (name, 0, "-", "-", "-"))
+        hists.append((name, f[5:]))
+    for name, hist in hists:
+        total = sum(hist)
+        if not total:
+            continue
+        print("\n%s" % name)
+        for b, n in enumerate(hist):
+            if not n:
+                continue
+            limit = (1 << (b + PROF_HIST_SHIFT + 1)) / cycles_per_us
+            label = ">= %.1f us" % (limit / 2) if b == PROF_BUCKETS - 1 else "< %.1f us" % limit
+            print("  %14s %10d %s" % (label, n, "#" * max(1, 50 * n // total)))
+
+
+def show_boot(data):
+    configured, first_report, configures, backlog, discarded = struct.unpack_from("<5I", data)
+    print("configured       %8d ms after reset" % configured)
+    if first_report:
+        print("first report     %8d ms after reset" % first_report)
+    else:
+        print("first report            - ms after reset")
+    print("configurations   %8d" % configures)
+    print("boot backlog     %8d events, %d discarded" % (backlog, discarded))
+    if len(data) >= 36:
+        suspends, wakeups, expired, stale = struct.unpack_from("<4I", data, 20)
+        print("suspends         %8d, %d remote wakeups" % (suspends, wakeups))
+        print("expired          %8d events, %d detents" % (expired, stale))
+
+
+def show_idle(data, ma=None):
+    (sleeps, wakes_line, wakes_level, wfi, asleep, uptime,
+     wake_last, wake_max, no_line) = struct.unpack_from("<9I", data)
+    residency = asleep / uptime if uptime else 0.0
+    print("sleeps           %8d" % sleeps)
+    print("wakes            %8d by wake line, %d by pin levels" % (wakes_line, wakes_level))
+    print("wfi              %8d" % wfi)
+    print("asleep           %8d ms of %d ms up, %.1f%%" % (asleep, uptime, 100.0 * residency))
+    print("wake to scan     %8d us last, %d us max" % (wake_last, wake_max))
+    print("no wake line     %8d pins, woken at the next SysTick" % no_line)
+    if ma:
+        print("average current  %8.2f mA" % (ma[0] * (1.0 - residency) + ma[1] * residency))
+
+
+def parse_queue(data):
+    f = struct.unpack_from("<14I", data)
+    return {"pushed": f[0], "sent": f[1], "dropped": f[2], "overflow": f[3],
+            "backlog_max": f[4], "wait_max_us": f[5], "wait": list(f[6:])}
+
+
+def show_queue(data):
+    q = parse_queue(data)
+    print("events           %8d queued, %d sent" % (q["pushed"], q["sent"]))
+    print("dropped          %8d host away, %d queue full" % (q["dropped"], q["overflow"]))
+    print("backlog          %8d events at most" % q["backlog_max"])
+    print("wait             %8d us at most" % q["wait_max_us"])
+    for n, count in enumerate(q["wait"]):
+        label = ("< %d ms" % (1 << n)) if n < len(q["wait"]) - 1 else (">= %d ms" % (1 << (n - 1)))
+        print("  %-14s %8d" % (label, count))
+
+
+def show_encoders(data):
+    """QuadStats_t of each encoder, quad_decoder.h"""
+    print("encoder  transitions  invalid       reversals      detents")
+    for n in range(len(data) // 16):
+        trans, invalid, rev, detents = struct.unpack_from("<4I", data, 16 * n)
+        total = trans + invalid
+        print("enc%-5d %11d  %6d %5.2f%%  %6d %5.2f%%  %7d" %
+              (n + 1, trans, invalid, 100.0 * invalid / total if total else 0.0,
+               rev, 100.0 * rev / trans if trans else 0.0, detents))
+
+
+def parse_trace(data):
+    """TraceLog_t as a dict, records oldest first with t_us unwrapped"""
+    arch, ports, frozen, exps, length, head, count, lost = struct.unpack_from("<BBBBIIII", data)
+    ofs = 20
+    mask = list(struct.unpack_from("<%dI" % ports, data, ofs))
+    base = list(struct.unpack_from("<%dI" % ports, data, ofs + 4 * ports))
+    ofs += 8 * ports
+    recs = []
+    t = None
+    last = 0
+    for i in range(count):
+        n = (head - count + i) % length
+        t_us, typ, arg, rlen, val = struct.unpack_from("<IBBBxI", data, ofs + 12 * n)
+        t = t_us if t is None else t + ((t_us - last) & 0xFFFFFFFF)
+        last = t_us
+        recs.append({"t_us": t, "type": typ, "arg": arg, "len": rlen, "data": val})
+    return {"arch": TRACE_ARCH_NAMES.get(arch, str(arch)), "ports": ports, "exps": exps, "frozen": frozen,
+            "len": length, "lost": lost, "mask": mask, "base": base, "records": recs}
+
+
+def trace_events(trace):
+    """Yield (t_us, kind, value): ("port", (port, levels)), ("report", bytes), ("midi", bytes)"""
+    report = b""
+    for rec in trace["records"]:
+        if rec["type"] == TRACE_REC_PORT:
+            yield rec["t_us"], "port", (rec["arg"], rec["data"])
+        elif rec["type"] == TRACE_REC_REPORT:
+            if rec["arg"] == 0:
+                report = b""
+            report += struct.pack("<I", rec["data"])
+            if len(report) >= rec["len"]:
+                yield rec["t_us"], "report", report[:rec["len"]]
+        elif rec["type"] == TRACE_REC_MIDI:
+            yield rec["t_us"], "midi", struct.pack("<I", rec["data"])
+
+
+def show_trace(data):
+    trace = parse_trace(data)
+    t0 = trace["records"][0]["t_us"] if trace["records"] else 0
+    print("%s, %d records, %d overwritten%s" % (trace["arch"], len(trace["records"]), trace["lost"],
+                                                 ", frozen" if trace["frozen"] else ""))
+    for p, (m, b) in enumerate(zip(trace["mask"], trace["base"])):
+        if m:
+            print("port %d  pins %08x  levels %08x at start" % (p, m, b))
+    for t, kind, val in trace_events(trace):
+        if kind == "port":
+            print("%12.3f  port %d  %08x" % ((t - t0) / 1000.0, val[0], val[1]))
+        else:
+            print("%12.3f  %-6s %s" % ((t - t0) / 1000.0, kind, " ".join("%02x" % b for b in val)))
+
+
+def trace_read(diag):
+    diag.command(DIAG_OBJ_TRACE, TRACE_CMD_FREEZE)
+    try:
+        return diag.read(DIAG_OBJ_TRACE)
+    finally:
+        diag.command(DIAG_OBJ_TRACE, TRACE_CMD_RUN)
+
+
+def key_to_json(k):
+    return chr(k) if 0x20 <= k < 0x7F else k
+
+
+def key_from_json(k):
+    return ord(k) if isinstance(k, str) else int(k)
+
+
+def keymap_get(diag):
+    maps = {}
+    for name, obj in (("encoders", DIAG_OBJ_ENC_MAPS), ("buttons", DIAG_OBJ_BTN_MAPS)):
+        data = diag.read(obj)
+        n = len(KEYMAP_FIELDS)
+        maps[name] = [{f: (v if f.startswith(NUMERIC_FIELDS) else key_to_json(v))
+                       for f, v in zip(KEYMAP_FIELDS, data[i:i + n])}
+                      for i in range(0, len(data), n)]
+    return maps
+
+
+def keymap_set(diag, maps):
+    for name, obj in (("encoders", DIAG_OBJ_ENC_MAPS), ("buttons", DIAG_OBJ_BTN_MAPS)):
+        have = len(diag.read(obj)) // len(KEYMAP_FIELDS)
+        if len(maps[name]) != have:
+            raise RuntimeError("%s: file has %d, controller has %d" % (name, len(maps[name]), have))
+        data = bytes(key_from_json(m[f]) & 0xFF for m in maps[name] for f in KEYMAP_FIELDS)
+        diag.write(obj, data)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("-d", "--device", help="hidraw node, found by report descriptor if not given")
+    sub = ap.add_subparsers(dest="cmd")
+    p = sub.add_parser("profile")
+    p.add_argument("--reset", action="store_true")
+    sub.add_parser("boot")
+    p = sub.add_parser("idle")
+    p.add_argument("--reset", action="store_true")
+    p.add_argument("--ma", type=float, nargs=2, metavar=("AWAKE", "ASLEEP"),
+                   help="supply current measured awake and asleep")
+    p = sub.add_parser("trace")
+    p.add_argument("action", nargs="?", choices=["save"])
+    p.add_argument("file", nargs="?")
+    p.add_argument("--reset", action="store_true")
+    p = sub.add_parser("queue")
+    p.add_argument("--reset", action="store_true")
+    p = sub.add_parser("encoders")
+    p.add_argument("--reset", action="store_true")
+    p = sub.add_parser("keymap")
+    p.add_argument("action", choices=["get", "set", "save", "defaults"])
+    p.add_argument("file", nargs="?")
+    p.add_argument("--all", action="store_true", help="every controller attached")
+    p.add_argument("--save", action="store_true", help="store in flash after set")
+    p = sub.add_parser("dump")
+    p.add_argument("obj", type=int)
+    args = ap.parse_args()
+
+    paths = [args.device] if args.device else find_devices()
+    if not paths:
+        sys.exit("no controller with a diagnostic interface found")
+    diag = Diag(paths[0])
+
+    if args.cmd == "keymap":
+        if args.action == "get":
+            print(json.dumps(keymap_get(diag), indent=2))
+            return
+        if args.action == "set":
+            if not args.file:
+                sys.exit("keymap set needs a file")
+            with open(args.file) as f:
+                maps = json.load(f)
+        for path in paths if args.all else paths[:1]:
+            diag = Diag(path)
+            if args.action == "set":
+                keymap_set(diag, maps)
+            if args.action == "defaults":
+                diag.command(DIAG_OBJ_ENC_MAPS, DIAG_CMD_DEFAULTS)
+            if args.action == "save" or args.save:
+                diag.command(DIAG_OBJ_ENC_MAPS, DIAG_CMD_COMMIT)
+            print("%s: %s done" % (path, args.action))
+    elif args.cmd == "profile":
+        if args.reset:
+            diag.reset(DIAG_OBJ_PROFILE)
+        else:
+            show_profile(diag.read(DIAG_OBJ_PROFILE))
+    elif args.cmd == "boot":
+        show_boot(diag.read(DIAG_OBJ_BOOT))
+    elif args.cmd == "idle":
+        if args.reset:
+            diag.reset(DIAG_OBJ_IDLE)
+        else:
+            show_idle(diag.read(DIAG_OBJ_IDLE), args.ma)
+    elif args.cmd == "trace":
+        if args.reset:
+            diag.reset(DIAG_OBJ_TRACE)
+        elif args.action == "save":
+            if not args.file:
+                sys.exit("trace save needs a file")
+            with open(args.file, "wb") as f:
+                f.write(trace_read(diag))
+        else:
+            show_trace(trace_read(diag))
+    elif args.cmd == "queue":
+        if args.reset:
+            diag.reset(DIAG_OBJ_QUEUE)
+        else:
+            show_queue(diag.read(DIAG_OBJ_QUEUE))
+    elif args.cmd == "encoders":
+        if args.reset:
+            diag.reset(DIAG_OBJ_ENC_STATS)
+        else:
+            show_encoders(diag.read(DIAG_OBJ_ENC_STATS))
+    elif args.cmd == "dump":
+        data = diag.read(args.obj)
+        for i in range(0, len(data), 16):
+            print("%04x  %s" % (i, " ".join("%02x" % b for b in data[i:i + 16])))
+    else:
+        ap.print_help()
+
+
+if __name__ == "__main__":
+    main()